@@ -10,56 +10,84 @@
 // ignore stdlib warnings if working in Visual Studio:
 #define _CRT_SECURE_NO_WARNINGS 
 
+// POSIX threads and sysconf() under -std=c11:
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
 
 #include "avl.h"
 
-// AVLCreate:
-// Dynamically creates and returns an empty AVL tree.
-//
-AVL *AVLCreate(void) {
+// Searches advanced in lockstep by AVLSearchBatch:
+#define AVL_BATCH_GROUP        16
 
-    AVL *tree;
-    tree = (AVL *)malloc(sizeof(AVL));
-    tree->Root = NULL;
-    tree->Count = 0;
+// Hint the CPU to start loading the node, if the compiler can:
+#if defined(__GNUC__)
+#define AVL_PREFETCH(node) __builtin_prefetch(node)
+#else
+#define AVL_PREFETCH(node)
+#endif
 
-    return tree;
-}
+// Union recursion levels that still fork a thread:
+#define AVL_UNION_FORK_DEPTH   3
+#define AVL_UNION_FORK_HEIGHT  12
 
-// _AVLFree:
-// This is AVLFree helper function. It recursivery free memory from the
-// leaves of the tree to the root.
 //
-AVLNode *_AVLFree(AVLNode *root, void(*fp)(AVLKey key, AVLValue value)) {
-    
-    if(root == NULL) {
-        return NULL;
-    } else {
-        _AVLFree(root->Left, fp);
-        _AVLFree(root->Right, fp);
-        fp(root->Key, root->Value);
-        free(root);
-    }
-    
-    return NULL;
-}
-
-// AVLFree:
-// Frees the memory associated with the tree: the handle and the nodes.
-// The provided function pointer is called to free the memory that
-// might have been allocated as part of the key or value.
+// Parallel scan engine declarations:
+//
+// Every worker owns a deque of subtree tasks. A worker walks its task down
+// the left spine, pushing right subtrees onto the bottom of its own deque,
+// until the subtree is small enough to be scanned sequentially. Idle workers
+// steal the oldest (and therefore largest) task from the top of other deques.
 //
-void AVLFree(AVL *tree, void(*fp)(AVLKey key, AVLValue value)) {
 
-    _AVLFree(tree->Root, fp);
-    free(tree);
+#define AVL_MAX_SCAN_THREADS   64
+#define AVL_SCAN_DEQUE_SIZE    256
+#define AVL_SCAN_GRAIN_HEIGHT  8
+#define AVL_SCAN_MIN_COUNT     4096
+#define AVL_SCAN_PARTIAL_ALIGN 64
+
+typedef struct AVLScanDeque {
+    pthread_mutex_t Lock;
+    int Top;
+    int Bottom;
+    AVLLinks *Tasks[AVL_SCAN_DEQUE_SIZE];
+} AVLScanDeque;
+
+typedef struct AVLScanPool {
+    pthread_mutex_t ScanLock;
+    pthread_mutex_t JobLock;
+    pthread_cond_t  JobReady;
+    pthread_cond_t  JobDone;
+    pthread_t Threads[AVL_MAX_SCAN_THREADS];
+    int ThreadCount;
+    boolean Started;
+    boolean ShuttingDown;
+    unsigned long Generation;
+    int Finished;
     
-    return;
-}
+    // Current scan job:
+    AVLVisitor Visit;
+    void *Arg;
+    char *Partials;
+    size_t PartialStride;
+    atomic_long Pending;
+    AVLScanDeque Deques[AVL_MAX_SCAN_THREADS];
+} AVLScanPool;
+
+static AVLScanPool _scanPool = {
+    .ScanLock = PTHREAD_MUTEX_INITIALIZER,
+    .JobLock = PTHREAD_MUTEX_INITIALIZER,
+    .JobReady = PTHREAD_COND_INITIALIZER,
+    .JobDone = PTHREAD_COND_INITIALIZER,
+    .ThreadCount = 0
+};
 
 // AVLCompareKeys:
 // Compares key1 and key2, returning
@@ -99,6 +127,14 @@ int AVLHeight(AVL *tree) {
     }
 }
 
+// AVLVersion:
+// Returns the change counter of the tree.
+//
+unsigned long AVLVersion(AVL *tree) {
+    
+    return tree->Version;
+}
+
 // _max2:
 // Helper function that return largest of two numbers.
 //
@@ -110,7 +146,7 @@ int _max2(int val1, int val2) {
 // _height:
 // Helper function that returns the heights of AVl node.
 //
-int _height(AVLNode *node) {
+int _height(AVLLinks *node) {
 
     if(node == NULL) {
         return -1;
@@ -122,10 +158,10 @@ int _height(AVLNode *node) {
 // RightRotate:
 // Rotate node to the right at k2, and returns new root node.
 //
-AVLNode *RightRotate(AVLNode *k2) {
+AVLLinks *RightRotate(AVLLinks *k2) {
     
-    AVLNode *k1 = k2->Left;
-    AVLNode *Y = k1->Right;
+    AVLLinks *k1 = k2->Left;
+    AVLLinks *Y = k1->Right;
     
     k1->Right = k2;
     k2->Left = Y;
@@ -139,10 +175,10 @@ AVLNode *RightRotate(AVLNode *k2) {
 // LeftRotate:
 // Rotate node to the left at k2, and returns new root node.
 //
-AVLNode *LeftRotate(AVLNode *k1) {
+AVLLinks *LeftRotate(AVLLinks *k1) {
     
-    AVLNode *k2 = k1->Right;
-    AVLNode *Y = k2->Left;
+    AVLLinks *k2 = k1->Right;
+    AVLLinks *Y = k2->Left;
     
     k2->Left = k1;
     k1->Right = Y;
@@ -154,52 +190,19 @@ AVLNode *LeftRotate(AVLNode *k1) {
 }
 
 
-// AVLInsert:
-// Inserts new AVlValue node to the AVL tree.
+// _AVLRebalance:
+// Completes insertion of a new leaf: stack holds the path from the root down
+// to the parent of the new leaf (topStack is the parent's index). Updates
+// heights on the way up and rotates at the first unbalanced node.
 //
-boolean AVLInsert(AVL *tree, AVLKey key, AVLValue value) {
-    
-    AVLNode *prev = NULL;
-    AVLNode *cur = tree->Root;
-    AVLNode *stack[64];
-    int topStack = -1;
-    
-    // Find location where to insert new mode:
-    while(cur != NULL) {
-        topStack++;
-        stack[topStack] = cur;
-        if(AVLCompareKeys(key, cur->Key) == 0) {
-            return false;
-        } else if(AVLCompareKeys(key, cur->Key) < 0) {
-            prev = cur;
-            cur = cur->Left;
-        } else {
-            prev = cur;
-            cur = cur->Right;
-        }
-    }
+void _AVLRebalance(AVL *tree, AVLLinks **stack, int topStack) {
     
-    // Create new node:
-    AVLNode *newNode = (AVLNode *)malloc(sizeof(AVLNode));
-    newNode->Key = key;
-    newNode->Value = value;
-    newNode->Height = 0;
-    newNode->Left = NULL;
-    newNode->Right = NULL;
-    
-    // Insert new node:
-    if(prev == NULL) {
-        tree->Root = newNode;
-    } else if(AVLCompareKeys(key, prev->Key) < 0) {
-        prev->Left = newNode;
-    }  else {
-        prev->Right = newNode;
-    }
-    tree->Count++;
+    AVLLinks *prev = NULL;
+    AVLLinks *cur = NULL;
     
     // Check if AVL tree is balanced:
     boolean rebalance = false;
-    AVLNode *N = NULL;
+    AVLLinks *N = NULL;
     while(topStack >= 0) {
         N = stack[topStack];
         topStack--;
@@ -220,7 +223,7 @@ boolean AVLInsert(AVL *tree, AVLKey key, AVLValue value) {
     }
     
     // Balance AVL tree if needed:
-    AVLNode *K = NULL;
+    AVLLinks *K = NULL;
     if(rebalance) {
         cur = N;
         if(topStack < 0) {
@@ -266,29 +269,1063 @@ boolean AVLInsert(AVL *tree, AVLKey key, AVLValue value) {
         }
     }
     
+    return;
+}
+
+// _AVLForEach:
+// This is AVLForEach helper function. It visits nodes in order of keys.
+//
+void _AVLForEach(AVLLinks *root, void(*fp)(void *node, void *arg), void *arg) {
+    
+    while(root != NULL) {
+        _AVLForEach(root->Left, fp, arg);
+        fp(root, arg);
+        root = root->Right;
+    }
+    
+    return;
+}
+
+// AVLForEach:
+// Calls provided function for every node of the tree, in ascending order of
+// keys, on the calling thread.
+//
+void AVLForEach(AVL *tree, void(*fp)(void *node, void *arg), void *arg) {
+    
+    _AVLForEach(tree->Root, fp, arg);
+    
+    return;
+}
+
+// AVLSearchBatch:
+// Searches count keys and stores the node of every key, or NULL if not
+// found, into found. Searches are advanced in groups, one tree level per
+// pass over the group, and the next node of every search is prefetched, so
+// the cache misses of all searches in the group overlap instead of waiting
+// for each other.
+//
+void AVLSearchBatch(AVL *tree, const AVLKey *keys, int count, AVLLinks **found) {
+    
+    for(int base = 0; base < count; base += AVL_BATCH_GROUP) {
+        int size = (count - base < AVL_BATCH_GROUP) ? count - base : AVL_BATCH_GROUP;
+        AVLLinks *cur[AVL_BATCH_GROUP];
+        for(int i = 0; i < size; i++) {
+            cur[i] = tree->Root;
+            found[base + i] = NULL;
+        }
+        
+        int active = size;
+        while(active > 0) {
+            active = 0;
+            for(int i = 0; i < size; i++) {
+                AVLLinks *node = cur[i];
+                if(node == NULL) {
+                    continue;
+                }
+                AVLKey key = keys[base + i];
+                if(key == node->Key) {
+                    found[base + i] = node;
+                    cur[i] = NULL;
+                    continue;
+                }
+                node = (key < node->Key) ? node->Left : node->Right;
+                if(node != NULL) {
+                    AVL_PREFETCH(node);
+                    active++;
+                }
+                cur[i] = node;
+            }
+        }
+    }
+    
+    return;
+}
+
+// _AVLMakeNode:
+// Join helper function: makes node the root of left and right subtrees and
+// returns it.
+//
+AVLLinks *_AVLMakeNode(AVLLinks *left, AVLLinks *node, AVLLinks *right) {
+    
+    node->Left = left;
+    node->Right = right;
+    node->Height = 1 + _max2(_height(left), _height(right));
+    
+    return node;
+}
+
+// _AVLJoinRight:
+// Join helper function for the case when left tree is taller than the
+// right one: descends the right spine of the left tree and rebalances on the
+// way back up.
+//
+AVLLinks *_AVLJoinRight(AVLLinks *left, AVLLinks *node, AVLLinks *right) {
+    
+    AVLLinks *l = left->Left;
+    AVLLinks *c = left->Right;
+    
+    if(_height(c) <= _height(right) + 1) {
+        AVLLinks *T = _AVLMakeNode(c, node, right);
+        if(_height(T) <= _height(l) + 1) {
+            return _AVLMakeNode(l, left, T);
+        } else {
+            return LeftRotate(_AVLMakeNode(l, left, RightRotate(T)));
+        }
+    } else {
+        AVLLinks *T = _AVLJoinRight(c, node, right);
+        AVLLinks *T2 = _AVLMakeNode(l, left, T);
+        if(_height(T) <= _height(l) + 1) {
+            return T2;
+        } else {
+            return LeftRotate(T2);
+        }
+    }
+}
+
+// _AVLJoinLeft:
+// Mirror image of _AVLJoinRight for the case when right tree is taller.
+//
+AVLLinks *_AVLJoinLeft(AVLLinks *left, AVLLinks *node, AVLLinks *right) {
+    
+    AVLLinks *r = right->Right;
+    AVLLinks *c = right->Left;
+    
+    if(_height(c) <= _height(left) + 1) {
+        AVLLinks *T = _AVLMakeNode(left, node, c);
+        if(_height(T) <= _height(r) + 1) {
+            return _AVLMakeNode(T, right, r);
+        } else {
+            return RightRotate(_AVLMakeNode(LeftRotate(T), right, r));
+        }
+    } else {
+        AVLLinks *T = _AVLJoinLeft(left, node, c);
+        AVLLinks *T2 = _AVLMakeNode(T, right, r);
+        if(_height(T) <= _height(r) + 1) {
+            return T2;
+        } else {
+            return RightRotate(T2);
+        }
+    }
+}
+
+// _AVLJoin:
+// Returns balanced tree of all keys of left tree, node and all keys of right
+// tree. All keys of left must be smaller and all keys of right must be larger
+// than node's key.
+//
+AVLLinks *_AVLJoin(AVLLinks *left, AVLLinks *node, AVLLinks *right) {
+    
+    if(_height(left) > _height(right) + 1) {
+        return _AVLJoinRight(left, node, right);
+    } else if(_height(right) > _height(left) + 1) {
+        return _AVLJoinLeft(left, node, right);
+    } else {
+        return _AVLMakeNode(left, node, right);
+    }
+}
+
+// _AVLSplit:
+// Splits tree into left tree with keys smaller than key and right tree with
+// keys larger than key. Returns the detached node holding key, or NULL if
+// key is not in the tree.
+//
+AVLLinks *_AVLSplit(AVLLinks *root, AVLKey key, AVLLinks **left, AVLLinks **right) {
+    
+    if(root == NULL) {
+        *left = NULL;
+        *right = NULL;
+        return NULL;
+    }
+    
+    AVLLinks *found = NULL;
+    if(key == root->Key) {
+        *left = root->Left;
+        *right = root->Right;
+        found = root;
+    } else if(key < root->Key) {
+        AVLLinks *R = NULL;
+        found = _AVLSplit(root->Left, key, left, &R);
+        *right = _AVLJoin(R, root, root->Right);
+    } else {
+        AVLLinks *L = NULL;
+        found = _AVLSplit(root->Right, key, &L, right);
+        *left = _AVLJoin(root->Left, root, L);
+    }
+    
+    return found;
+}
+
+// AVLUNIONJOB:
+// Arguments and result of one _AVLUnion call, so that it can also run on a
+// separate thread.
+//
+typedef struct AVLUNIONJOB {
+    AVLLinks *Root1;
+    AVLLinks *Root2;
+    AVLMerger Merge;
+    int Depth;
+    int Duplicates;
+    AVLLinks *Result;
+} AVLUNIONJOB;
+
+void *_AVLUnionJob(void *arg);
+
+// _AVLUnion:
+// Join-based union of two trees: splits the second tree by the root key of
+// the first, unions the halves recursively and joins them back by the root.
+// The two halves are independent, so near the top one of them is forked to
+// a new thread. Duplicate keys are folded by merge.
+//
+AVLLinks *_AVLUnion(AVLLinks *root1, AVLLinks *root2, AVLMerger merge, int depth,
+                   int *duplicates) {
+    
+    if(root1 == NULL) {
+        return root2;
+    } else if(root2 == NULL) {
+        return root1;
+    }
+    
+    AVLLinks *left2 = NULL;
+    AVLLinks *right2 = NULL;
+    AVLLinks *found = _AVLSplit(root2, root1->Key, &left2, &right2);
+    AVLLinks *left1 = root1->Left;
+    AVLLinks *right1 = root1->Right;
+    
+    AVLUNIONJOB leftJob = {left1, left2, merge, depth + 1, 0, NULL};
+    AVLUNIONJOB rightJob = {right1, right2, merge, depth + 1, 0, NULL};
+    pthread_t thread;
+    boolean forked = false;
+    if(depth < AVL_UNION_FORK_DEPTH && AVLScanThreads() > 1 &&
+       _max2(_height(left1), _height(left2)) >= AVL_UNION_FORK_HEIGHT) {
+        forked = (pthread_create(&thread, NULL, _AVLUnionJob, &leftJob) == 0);
+    }
+    if(!forked) {
+        _AVLUnionJob(&leftJob);
+    }
+    _AVLUnionJob(&rightJob);
+    if(forked) {
+        pthread_join(thread, NULL);
+    }
+    *duplicates += leftJob.Duplicates + rightJob.Duplicates;
+    
+    if(found != NULL) {
+        merge(root1, found);
+        free(found);
+        *duplicates += 1;
+    }
+    
+    return _AVLJoin(leftJob.Result, root1, rightJob.Result);
+}
+
+// _AVLUnionJob:
+// Thread body that runs _AVLUnion for the job.
+//
+void *_AVLUnionJob(void *arg) {
+    
+    AVLUNIONJOB *job = (AVLUNIONJOB *)arg;
+    job->Result = _AVLUnion(job->Root1, job->Root2, job->Merge, job->Depth,
+                            &job->Duplicates);
+    
+    return NULL;
+}
+
+// AVLUnion:
+// Moves all nodes of tree2 into tree1, leaving tree2 empty. Nodes are
+// relinked, not copied. For keys present in both trees merge folds tree2's
+// node into tree1's node, and tree2's node is freed.
+//
+void AVLUnion(AVL *tree1, AVL *tree2, AVLMerger merge) {
+    
+    int duplicates = 0;
+    
+    // Union relinks nodes in place, which readers of snapshots would see:
+    assert(tree1->Versions == NULL && tree2->Versions == NULL);
+    
+    tree1->Root = _AVLUnion(tree1->Root, tree2->Root, merge, 0, &duplicates);
+    tree1->Count += tree2->Count - duplicates;
+    tree2->Root = NULL;
+    tree2->Count = 0;
+    tree1->Version++;
+    tree2->Version++;
+    
+    return;
+}
+
+//
+// Snapshot declarations:
+//
+// A snapshot is a published, immutable version of the tree. The writer
+// changes the tree by copying the path from the root to the changed node;
+// nodes copied or created since the last Publish are fresh and are changed
+// in place. Nodes and memory replaced while building version e are still
+// seen by snapshots older than e, so they are retired to the snapshot
+// published before e, and freed once that snapshot and all older snapshots
+// are unpinned and replaced.
+//
+
+#define AVL_FRESH_INITIAL_SIZE 1024
+
+typedef struct AVLSnapshot {
+    AVL                 Tree;
+    atomic_int          Readers;
+    struct AVLSnapshot *Newer;
+    void              **Retired;
+    int                 RetiredCount;
+} AVLSnapshot;
+
+typedef struct AVLVersions {
+    pthread_mutex_t  Lock;
+    AVLSnapshot     *Oldest;
+    AVLSnapshot     *Current;
+    size_t           NodeSize;
+    void           **Retired;
+    int              RetiredCount;
+    int              RetiredCapacity;
+    AVLLinks       **Fresh;
+    int              FreshCount;
+    int              FreshSize;
+} AVLVersions;
+
+// _AVLNewSnapshot:
+// Returns a new snapshot of the current state of the tree.
+//
+static AVLSnapshot *_AVLNewSnapshot(AVL *tree) {
+    
+    AVLSnapshot *snapshot = (AVLSnapshot *)malloc(sizeof(AVLSnapshot));
+    snapshot->Tree.Root = tree->Root;
+    snapshot->Tree.Count = tree->Count;
+    snapshot->Tree.Version = tree->Version;
+    snapshot->Tree.Versions = NULL;
+    snapshot->Tree.Pinned = snapshot;
+    atomic_init(&snapshot->Readers, 0);
+    snapshot->Newer = NULL;
+    snapshot->Retired = NULL;
+    snapshot->RetiredCount = 0;
+    
+    return snapshot;
+}
+
+// _AVLFreeSnapshot:
+// Frees the snapshot and the memory retired to it.
+//
+static void _AVLFreeSnapshot(AVLSnapshot *snapshot) {
+    
+    for(int i = 0; i < snapshot->RetiredCount; i++) {
+        free(snapshot->Retired[i]);
+    }
+    free(snapshot->Retired);
+    free(snapshot);
+    
+    return;
+}
+
+// _AVLFreshSlot:
+// Returns the slot of node in the open addressing set of fresh nodes, or
+// the empty slot where it belongs.
+//
+static AVLLinks **_AVLFreshSlot(AVLLinks **fresh, int size, AVLLinks *node) {
+    
+    unsigned long long hash = (unsigned long long)(size_t)node * 0x9E3779B97F4A7C15ULL;
+    int i = (int)(hash >> 32) & (size - 1);
+    while(fresh[i] != NULL && fresh[i] != node) {
+        i = (i + 1) & (size - 1);
+    }
+    
+    return &fresh[i];
+}
+
+// _AVLAddFresh:
+// Marks node as fresh, growing the set when it gets half full.
+//
+static void _AVLAddFresh(AVLVersions *versions, AVLLinks *node) {
+    
+    if(2 * (versions->FreshCount + 1) > versions->FreshSize) {
+        int size = versions->FreshSize * 2;
+        AVLLinks **fresh = (AVLLinks **)calloc(size, sizeof(AVLLinks *));
+        for(int i = 0; i < versions->FreshSize; i++) {
+            if(versions->Fresh[i] != NULL) {
+                *_AVLFreshSlot(fresh, size, versions->Fresh[i]) = versions->Fresh[i];
+            }
+        }
+        free(versions->Fresh);
+        versions->Fresh = fresh;
+        versions->FreshSize = size;
+    }
+    *_AVLFreshSlot(versions->Fresh, versions->FreshSize, node) = node;
+    versions->FreshCount++;
+    
+    return;
+}
+
+// _AVLWritable:
+// Returns node itself if it is fresh, otherwise a fresh copy of node, and
+// retires node.
+//
+static AVLLinks *_AVLWritable(AVL *tree, AVLLinks *node) {
+    
+    AVLVersions *versions = tree->Versions;
+    if(*_AVLFreshSlot(versions->Fresh, versions->FreshSize, node) == node) {
+        return node;
+    }
+    
+    AVLLinks *copy = (AVLLinks *)malloc(versions->NodeSize);
+    memcpy(copy, node, versions->NodeSize);
+    _AVLAddFresh(versions, copy);
+    AVLRetire(tree, node);
+    
+    return copy;
+}
+
+// AVLEnableSnapshots:
+// Switches the tree to versioned mode, and publishes its current state as
+// the first snapshot. nodeSize is the size of the typed nodes.
+//
+void AVLEnableSnapshots(AVL *tree, size_t nodeSize) {
+    
+    assert(tree->Versions == NULL && tree->Pinned == NULL);
+    
+    AVLVersions *versions = (AVLVersions *)malloc(sizeof(AVLVersions));
+    pthread_mutex_init(&versions->Lock, NULL);
+    versions->Current = _AVLNewSnapshot(tree);
+    versions->Oldest = versions->Current;
+    versions->NodeSize = nodeSize;
+    versions->Retired = NULL;
+    versions->RetiredCount = 0;
+    versions->RetiredCapacity = 0;
+    versions->FreshSize = AVL_FRESH_INITIAL_SIZE;
+    versions->Fresh = (AVLLinks **)calloc(versions->FreshSize, sizeof(AVLLinks *));
+    versions->FreshCount = 0;
+    tree->Versions = versions;
+    
+    return;
+}
+
+// AVLFreeSnapshots:
+// Frees all snapshots and retired memory of the tree, leaving the nodes of
+// the tree itself. No reader may hold a view of the tree.
+//
+void AVLFreeSnapshots(AVL *tree) {
+    
+    AVLVersions *versions = tree->Versions;
+    if(versions == NULL) {
+        return;
+    }
+    
+    while(versions->Oldest != NULL) {
+        AVLSnapshot *newer = versions->Oldest->Newer;
+        _AVLFreeSnapshot(versions->Oldest);
+        versions->Oldest = newer;
+    }
+    for(int i = 0; i < versions->RetiredCount; i++) {
+        free(versions->Retired[i]);
+    }
+    free(versions->Retired);
+    free(versions->Fresh);
+    pthread_mutex_destroy(&versions->Lock);
+    free(versions);
+    tree->Versions = NULL;
+    
+    return;
+}
+
+// AVLMarkFresh:
+// Adds memory that readers cannot see yet, e.g. a copy of a value's data,
+// to the fresh set of the tree, until the next publish.
+//
+void AVLMarkFresh(AVL *tree, void *memory) {
+    
+    AVLVersions *versions = tree->Versions;
+    if(versions == NULL || !AVLIsShared(tree, memory)) {
+        return;
+    }
+    
+    _AVLAddFresh(versions, (AVLLinks *)memory);
+    
+    return;
+}
+
+// AVLIsShared:
+// Returns true if the tree is versioned and memory may be seen by readers:
+// a node or memory that is not fresh since the last publish.
+//
+boolean AVLIsShared(AVL *tree, const void *memory) {
+    
+    AVLVersions *versions = tree->Versions;
+    if(versions == NULL) {
+        return false;
+    }
+    
+    AVLLinks *node = (AVLLinks *)memory;
+    return *_AVLFreshSlot(versions->Fresh, versions->FreshSize, node) != node;
+}
+
+// AVLRetire:
+// Frees memory, once no reader can see it anymore. Memory is freed at once
+// if the tree is not versioned.
+//
+void AVLRetire(AVL *tree, void *memory) {
+    
+    AVLVersions *versions = tree->Versions;
+    if(versions == NULL) {
+        free(memory);
+        return;
+    }
+    
+    if(versions->RetiredCount == versions->RetiredCapacity) {
+        versions->RetiredCapacity = (versions->RetiredCapacity > 0) ?
+                                    versions->RetiredCapacity * 2 : 64;
+        versions->Retired = (void **)realloc(versions->Retired,
+                                             versions->RetiredCapacity * sizeof(void *));
+    }
+    versions->Retired[versions->RetiredCount] = memory;
+    versions->RetiredCount++;
+    
+    return;
+}
+
+// AVLVersionedInsert:
+// Inserts node into the versioned tree, copying the path from the root.
+// Returns false if the key is already in the tree.
+//
+boolean AVLVersionedInsert(AVL *tree, AVLLinks *node) {
+    
+    AVLLinks *cur = tree->Root;
+    while(cur != NULL && cur->Key != node->Key) {
+        cur = (node->Key < cur->Key) ? cur->Left : cur->Right;
+    }
+    if(cur != NULL) {
+        return false;
+    }
+    
+    // Every node that rebalancing may change is on the path:
+    AVLLinks *stack[AVL_MAX_HEIGHT];
+    int topStack = -1;
+    AVLLinks **slot = &tree->Root;
+    while(*slot != NULL) {
+        cur = _AVLWritable(tree, *slot);
+        *slot = cur;
+        topStack++;
+        stack[topStack] = cur;
+        slot = (node->Key < cur->Key) ? &cur->Left : &cur->Right;
+    }
+    node->Left = NULL;
+    node->Right = NULL;
+    node->Height = 0;
+    _AVLAddFresh(tree->Versions, node);
+    *slot = node;
+    tree->Count++;
+    tree->Version++;
+    _AVLRebalance(tree, stack, topStack);
+    
     return true;
 }
 
-// AVLSearch:
-// Search and return AVL node in AVL tree using AVLKey.
+// AVLVersionedModify:
+// Returns a fresh node with the key, whose value may be changed without
+// readers seeing it before the next publish, or NULL if not found.
 //
-AVLNode *AVLSearch(AVL *tree, AVLKey key) {
+AVLLinks *AVLVersionedModify(AVL *tree, AVLKey key) {
     
-    if(tree->Root == NULL) {
+    AVLLinks *cur = tree->Root;
+    while(cur != NULL && cur->Key != key) {
+        cur = (key < cur->Key) ? cur->Left : cur->Right;
+    }
+    if(cur == NULL) {
+        return NULL;
+    }
+    
+    AVLLinks **slot = &tree->Root;
+    while(true) {
+        cur = _AVLWritable(tree, *slot);
+        *slot = cur;
+        if(cur->Key == key) {
+            break;
+        }
+        slot = (key < cur->Key) ? &cur->Left : &cur->Right;
+    }
+    tree->Version++;
+    
+    return cur;
+}
+
+// AVLPublish:
+// Makes all changes since the last publish visible to readers at once, and
+// frees memory that no reader can see anymore. Only the writer may publish.
+//
+void AVLPublish(AVL *tree) {
+    
+    AVLVersions *versions = tree->Versions;
+    if(versions == NULL || versions->Current->Tree.Version == tree->Version) {
+        return;
+    }
+    
+    AVLSnapshot *snapshot = _AVLNewSnapshot(tree);
+    
+    pthread_mutex_lock(&versions->Lock);
+    AVLSnapshot *previous = versions->Current;
+    previous->Retired = versions->Retired;
+    previous->RetiredCount = versions->RetiredCount;
+    previous->Newer = snapshot;
+    versions->Current = snapshot;
+    
+    // Free snapshots from the oldest one, up to the first pinned one:
+    while(versions->Oldest != versions->Current &&
+          atomic_load(&versions->Oldest->Readers) == 0) {
+        AVLSnapshot *newer = versions->Oldest->Newer;
+        _AVLFreeSnapshot(versions->Oldest);
+        versions->Oldest = newer;
+    }
+    pthread_mutex_unlock(&versions->Lock);
+    
+    versions->Retired = NULL;
+    versions->RetiredCount = 0;
+    versions->RetiredCapacity = 0;
+    memset(versions->Fresh, 0, versions->FreshSize * sizeof(AVLLinks *));
+    versions->FreshCount = 0;
+    
+    return;
+}
+
+// AVLAcquire:
+// Pins the last published snapshot of the tree and returns it as read-only
+// tree, or returns the tree itself if it is not versioned. Never waits for
+// the writer.
+//
+AVL *AVLAcquire(AVL *tree) {
+    
+    AVLVersions *versions = tree->Versions;
+    if(versions == NULL) {
+        return tree;
+    }
+    
+    pthread_mutex_lock(&versions->Lock);
+    AVLSnapshot *snapshot = versions->Current;
+    atomic_fetch_add(&snapshot->Readers, 1);
+    pthread_mutex_unlock(&versions->Lock);
+    
+    return &snapshot->Tree;
+}
+
+// AVLRelease:
+// Unpins the snapshot returned by AVLAcquire.
+//
+void AVLRelease(AVL *view) {
+    
+    if(view->Pinned != NULL) {
+        atomic_fetch_sub(&view->Pinned->Readers, 1);
+    }
+    
+    return;
+}
+
+// _AVLMutable:
+// Returns node itself, or a fresh copy of it if the tree is versioned.
+//
+static AVLLinks *_AVLMutable(AVL *tree, AVLLinks *node) {
+    
+    return (tree->Versions != NULL) ? _AVLWritable(tree, node) : node;
+}
+
+// _AVLRebalanceDelete:
+// Completes deletion: stack holds the path from the root down to the parent
+// of the removed leaf position (topStack is its index). Updates heights on
+// the way up, rotating at every unbalanced node, until a node keeps its
+// height. Nodes on the path must be mutable; rotated children are made so.
+//
+static void _AVLRebalanceDelete(AVL *tree, AVLLinks **stack, int topStack) {
+    
+    for(int i = topStack; i >= 0; i--) {
+        AVLLinks *cur = stack[i];
+        int hl = _height(cur->Left);
+        int hr = _height(cur->Right);
+        
+        if(abs(hl - hr) <= 1) {
+            int newH = 1 + _max2(hl, hr);
+            if(cur->Height == newH) {
+                break;
+            }
+            cur->Height = newH;
+            continue;
+        }
+        
+        // Case 1 or 2, or case 3 or 4; the lighter side lost a node:
+        AVLLinks *top = NULL;
+        if(hl > hr) {
+            AVLLinks *K = _AVLMutable(tree, cur->Left);
+            cur->Left = K;
+            if(_height(K->Left) < _height(K->Right)) {
+                K->Right = _AVLMutable(tree, K->Right);
+                cur->Left = LeftRotate(K);
+            }
+            top = RightRotate(cur);
+        } else {
+            AVLLinks *K = _AVLMutable(tree, cur->Right);
+            cur->Right = K;
+            if(_height(K->Left) > _height(K->Right)) {
+                K->Left = _AVLMutable(tree, K->Left);
+                cur->Right = RightRotate(K);
+            }
+            top = LeftRotate(cur);
+        }
+        
+        if(i == 0) {
+            tree->Root = top;
+        } else if(stack[i - 1]->Left == cur) {
+            stack[i - 1]->Left = top;
+        } else {
+            stack[i - 1]->Right = top;
+        }
+    }
+    
+    return;
+}
+
+// AVLDeleteNode:
+// Unlinks the node with the key from the tree, and returns it, or NULL if
+// not found. A node with two children is replaced by its successor. In a
+// versioned tree the path is copied, and the returned node may still be
+// seen by readers; it must be retired instead of freed.
+//
+AVLLinks *AVLDeleteNode(AVL *tree, AVLKey key) {
+    
+    AVLLinks *node = tree->Root;
+    while(node != NULL && node->Key != key) {
+        node = (key < node->Key) ? node->Left : node->Right;
+    }
+    if(node == NULL) {
         return NULL;
+    }
+    
+    AVLLinks *stack[AVL_MAX_HEIGHT];
+    int topStack = -1;
+    AVLLinks **slot = &tree->Root;
+    while(*slot != node) {
+        AVLLinks *cur = _AVLMutable(tree, *slot);
+        *slot = cur;
+        topStack++;
+        stack[topStack] = cur;
+        slot = (key < cur->Key) ? &cur->Left : &cur->Right;
+    }
+    
+    if(node->Left == NULL || node->Right == NULL) {
+        *slot = (node->Left != NULL) ? node->Left : node->Right;
     } else {
-        AVLNode *cur = tree->Root;
-        while(cur != NULL) {
-            if(AVLCompareKeys(key, cur->Key) == 0) {
-                return cur;
-            } else if(AVLCompareKeys(key, cur->Key) < 0) {
-                cur = cur->Left;
-            } else {
-                cur = cur->Right;
+        // Successor is the leftmost node of the right subtree:
+        topStack++;
+        int successorIndex = topStack;
+        AVLLinks *right = _AVLMutable(tree, node->Right);
+        AVLLinks *successor = right;
+        if(right->Left != NULL) {
+            AVLLinks *parent = right;
+            topStack++;
+            stack[topStack] = parent;
+            while(parent->Left->Left != NULL) {
+                parent->Left = _AVLMutable(tree, parent->Left);
+                parent = parent->Left;
+                topStack++;
+                stack[topStack] = parent;
             }
+            successor = _AVLMutable(tree, parent->Left);
+            parent->Left = successor->Right;
+            successor->Right = right;
         }
+        successor->Left = node->Left;
+        successor->Height = node->Height;
+        stack[successorIndex] = successor;
+        *slot = successor;
+    }
+    
+    tree->Count--;
+    tree->Version++;
+    _AVLRebalanceDelete(tree, stack, topStack);
+    
+    return node;
+}
+
+// AVLSetScanThreads:
+// Sets the number of threads used by AVLParallelScan, including the calling
+// thread. Values < 1 select the number of online processors.
+//
+void AVLSetScanThreads(int threads) {
+    
+    AVLScanShutdown();
+    
+    pthread_mutex_lock(&_scanPool.ScanLock);
+    if(threads < 1) {
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (processors > 0) ? (int)processors : 1;
+    }
+    if(threads > AVL_MAX_SCAN_THREADS) {
+        threads = AVL_MAX_SCAN_THREADS;
     }
+    _scanPool.ThreadCount = threads;
+    pthread_mutex_unlock(&_scanPool.ScanLock);
+    
+    return;
+}
+
+// AVLScanThreads:
+// Returns the number of threads used by AVLParallelScan.
+//
+int AVLScanThreads(void) {
+    
+    if(_scanPool.ThreadCount == 0) {
+        AVLSetScanThreads(0);
+    }
+    
+    return _scanPool.ThreadCount;
+}
+
+// _AVLScanSubtree:
+// Sequentially visits every node of the subtree.
+//
+static void _AVLScanSubtree(AVLLinks *root, AVLVisitor visit, void *partial, void *arg) {
+    
+    while(root != NULL) {
+        visit(root, partial, arg);
+        _AVLScanSubtree(root->Left, visit, partial, arg);
+        root = root->Right;
+    }
+    
+    return;
+}
+
+// _AVLDequePush:
+// Pushes task onto the bottom of the deque. Returns false if deque is full.
+//
+static boolean _AVLDequePush(AVLScanDeque *deque, AVLLinks *task) {
+    
+    boolean pushed = false;
+    
+    pthread_mutex_lock(&deque->Lock);
+    if(deque->Bottom < AVL_SCAN_DEQUE_SIZE) {
+        deque->Tasks[deque->Bottom] = task;
+        deque->Bottom++;
+        pushed = true;
+    }
+    pthread_mutex_unlock(&deque->Lock);
+    
+    return pushed;
+}
+
+// _AVLDequeTake:
+// Takes the newest task from the bottom of the deque (owner side), or the
+// oldest task from the top of the deque (thief side). Returns NULL if the
+// deque is empty.
+//
+static AVLLinks *_AVLDequeTake(AVLScanDeque *deque, boolean steal) {
+    
+    AVLLinks *task = NULL;
+    
+    pthread_mutex_lock(&deque->Lock);
+    if(deque->Top < deque->Bottom) {
+        if(steal) {
+            task = deque->Tasks[deque->Top];
+            deque->Top++;
+        } else {
+            deque->Bottom--;
+            task = deque->Tasks[deque->Bottom];
+        }
+        if(deque->Top == deque->Bottom) {
+            deque->Top = 0;
+            deque->Bottom = 0;
+        }
+    }
+    pthread_mutex_unlock(&deque->Lock);
+    
+    return task;
+}
+
+// _AVLScanTask:
+// Scans one subtree task, splitting right subtrees off into the worker's
+// deque while the subtree is still large.
+//
+static void _AVLScanTask(AVLScanPool *pool, int self, AVLLinks *node, void *partial) {
+    
+    while(node != NULL && node->Height > AVL_SCAN_GRAIN_HEIGHT) {
+        pool->Visit(node, partial, pool->Arg);
+        if(node->Right != NULL) {
+            atomic_fetch_add(&pool->Pending, 1);
+            if(!_AVLDequePush(&pool->Deques[self], node->Right)) {
+                _AVLScanSubtree(node->Right, pool->Visit, partial, pool->Arg);
+                atomic_fetch_sub(&pool->Pending, 1);
+            }
+        }
+        node = node->Left;
+    }
+    _AVLScanSubtree(node, pool->Visit, partial, pool->Arg);
+    
+    return;
+}
+
+// _AVLScanWork:
+// Worker loop for one scan: runs own tasks first, steals when out of work
+// and returns once no task is left anywhere.
+//
+static void _AVLScanWork(AVLScanPool *pool, int self) {
+    
+    void *partial = pool->Partials + (size_t)self * pool->PartialStride;
+    
+    while(true) {
+        AVLLinks *task = _AVLDequeTake(&pool->Deques[self], false);
+        for(int i = 1; task == NULL && i < pool->ThreadCount; i++) {
+            task = _AVLDequeTake(&pool->Deques[(self + i) % pool->ThreadCount], true);
+        }
+        
+        if(task != NULL) {
+            _AVLScanTask(pool, self, task, partial);
+            atomic_fetch_sub(&pool->Pending, 1);
+        } else if(atomic_load(&pool->Pending) == 0) {
+            break;
+        } else {
+            sched_yield();
+        }
+    }
+    
+    return;
+}
+
+// _AVLScanThread:
+// Pool thread body: waits for the next scan job and works on it, until the
+// pool is shut down.
+//
+static void *_AVLScanThread(void *arg) {
+    
+    int self = (int)(size_t)arg;
+    unsigned long seen = 0;
+    
+    pthread_mutex_lock(&_scanPool.JobLock);
+    while(true) {
+        while(_scanPool.Generation == seen && !_scanPool.ShuttingDown) {
+            pthread_cond_wait(&_scanPool.JobReady, &_scanPool.JobLock);
+        }
+        if(_scanPool.ShuttingDown) {
+            break;
+        }
+        seen = _scanPool.Generation;
+        pthread_mutex_unlock(&_scanPool.JobLock);
+        
+        _AVLScanWork(&_scanPool, self);
+        
+        pthread_mutex_lock(&_scanPool.JobLock);
+        _scanPool.Finished++;
+        pthread_cond_signal(&_scanPool.JobDone);
+    }
+    pthread_mutex_unlock(&_scanPool.JobLock);
     
     return NULL;
 }
 
+// _AVLScanStart:
+// Starts pool threads, the calling thread acts as worker 0.
+//
+static void _AVLScanStart(AVLScanPool *pool) {
+    
+    pool->ShuttingDown = false;
+    pool->Generation = 0;
+    for(int i = 0; i < pool->ThreadCount; i++) {
+        pthread_mutex_init(&pool->Deques[i].Lock, NULL);
+        pool->Deques[i].Top = 0;
+        pool->Deques[i].Bottom = 0;
+    }
+    for(int i = 1; i < pool->ThreadCount; i++) {
+        pthread_create(&pool->Threads[i], NULL, _AVLScanThread, (void *)(size_t)i);
+    }
+    pool->Started = true;
+    
+    return;
+}
+
+// AVLScanShutdown:
+// Stops pool threads used by AVLParallelScan. The pool is started again by
+// the next parallel scan.
+//
+void AVLScanShutdown(void) {
+    
+    pthread_mutex_lock(&_scanPool.ScanLock);
+    if(_scanPool.Started) {
+        pthread_mutex_lock(&_scanPool.JobLock);
+        _scanPool.ShuttingDown = true;
+        pthread_cond_broadcast(&_scanPool.JobReady);
+        pthread_mutex_unlock(&_scanPool.JobLock);
+        
+        for(int i = 1; i < _scanPool.ThreadCount; i++) {
+            pthread_join(_scanPool.Threads[i], NULL);
+        }
+        for(int i = 0; i < _scanPool.ThreadCount; i++) {
+            pthread_mutex_destroy(&_scanPool.Deques[i].Lock);
+        }
+        _scanPool.Started = false;
+    }
+    pthread_mutex_unlock(&_scanPool.ScanLock);
+    
+    return;
+}
+
+// AVLParallelScan:
+// Calls visit for every node of the tree on a work-stealing thread pool.
+// Every thread accumulates into its own zero-initialized partial buffer of
+// partialSize bytes; afterwards reduce folds each partial into result, in
+// thread order, on the calling thread. Nodes are visited in no particular
+// order, so visit must not depend on it. Scans must not be nested.
+//
+void AVLParallelScan(AVL *tree, AVLVisitor visit, void *arg,
+                     size_t partialSize, AVLReducer reduce, void *result) {
+    
+    if(tree->Root == NULL) {
+        return;
+    }
+    
+    int threads = AVLScanThreads();
+    size_t stride = (partialSize + AVL_SCAN_PARTIAL_ALIGN - 1) /
+                    AVL_SCAN_PARTIAL_ALIGN * AVL_SCAN_PARTIAL_ALIGN;
+    if(stride == 0) {
+        stride = AVL_SCAN_PARTIAL_ALIGN;
+    }
+    
+    // Small trees are not worth waking up the pool:
+    if(threads == 1 || tree->Count < AVL_SCAN_MIN_COUNT) {
+        void *partial = calloc(1, stride);
+        _AVLScanSubtree(tree->Root, visit, partial, arg);
+        reduce(result, partial, arg);
+        free(partial);
+        return;
+    }
+    
+    pthread_mutex_lock(&_scanPool.ScanLock);
+    if(!_scanPool.Started) {
+        _AVLScanStart(&_scanPool);
+    }
+    
+    _scanPool.Visit = visit;
+    _scanPool.Arg = arg;
+    _scanPool.PartialStride = stride;
+    _scanPool.Partials = (char *)calloc((size_t)threads, stride);
+    atomic_store(&_scanPool.Pending, 1);
+    _AVLDequePush(&_scanPool.Deques[0], tree->Root);
+    
+    // Wake up pool threads and work along with them:
+    pthread_mutex_lock(&_scanPool.JobLock);
+    _scanPool.Finished = 0;
+    _scanPool.Generation++;
+    pthread_cond_broadcast(&_scanPool.JobReady);
+    pthread_mutex_unlock(&_scanPool.JobLock);
+    
+    _AVLScanWork(&_scanPool, 0);
+    
+    pthread_mutex_lock(&_scanPool.JobLock);
+    while(_scanPool.Finished < threads - 1) {
+        pthread_cond_wait(&_scanPool.JobDone, &_scanPool.JobLock);
+    }
+    pthread_mutex_unlock(&_scanPool.JobLock);
+    
+    // Reduce per-thread partial results:
+    for(int i = 0; i < threads; i++) {
+        reduce(result, _scanPool.Partials + (size_t)i * stride, arg);
+    }
+    free(_scanPool.Partials);
+    _scanPool.Partials = NULL;
+    pthread_mutex_unlock(&_scanPool.ScanLock);
+    
+    return;
+}
@@ -10,6 +10,8 @@
 // make sure this header file is #include exactly once:
 #pragma once
 
+#include <stdlib.h>
+
 typedef enum boolean {
     false,
     true
@@ -32,6 +34,7 @@ typedef enum USERTYPE {
 
 typedef struct STATION {
     int  StationID;
+    int StationIndex;
     int StationDPCapacity;
     double StationLatitude;
     double StationLongitude;
@@ -41,6 +44,7 @@ typedef struct STATION {
 
 typedef struct TRIP {
     int  TripID;
+    int  TripOrdinal;
     char *TripStartTime;
     char *TripStopTime;
     int TripBikeID;
@@ -54,39 +58,51 @@ typedef struct TRIP {
     int TripUserBirthYear;
 } TRIP;
 
+// One link of a bike's trip chain; StartStamp is minutes since 1/1/1970:
+typedef struct BIKETRIP {
+    int StartStamp;
+    int TripID;
+    int FromStationID;
+    int ToStationID;
+} BIKETRIP;
+
 typedef struct BIKE {
   int  BikeID;
   int  BikeTripCount;
+  int  BikeChainLength;
+  int  BikeChainCapacity;
+  BIKETRIP *BikeChain;
 } BIKE;
 
-typedef enum UNIONTYPE {
-    STATIONTYPE,
-    TRIPTYPE,
-    BIKETYPE
-} UNIONTYPE;
-
 typedef int  AVLKey;
 
-typedef struct AVLValue {
-  UNIONTYPE Type;
-  union {
-    STATION  Station;
-    TRIP     Trip;
-    BIKE     Bike;
-  };
-} AVLValue;
+// Longest root to leaf path of any tree, AVL height is < 1.44 log2(n):
+#define AVL_MAX_HEIGHT 64
 
-typedef struct AVLNode {
+// Keys searched per AVLSearchBatch call by the typed batch searches:
+#define AVL_SEARCH_CHUNK 256
+
+// AVLLinks:
+// Tree structure part of every node. Typed nodes start with AVLLinks, so a
+// pointer to the node and a pointer to its links are interchangeable.
+typedef struct AVLLinks {
+  struct AVLLinks *Left;
+  struct AVLLinks *Right;
   AVLKey    Key;
-  AVLValue  Value;
-  struct AVLNode  *Left;
-  struct AVLNode  *Right;
   int       Height;
-} AVLNode;
+} AVLLinks;
 
+// AVL:
+// Version is bumped by every change to the tree, so results computed from
+// the tree can be stamped with it and recognized as stale later. Versions is
+// set once snapshots are enabled for the tree, and Pinned on the read-only
+// views of the tree returned by AVLAcquire.
 typedef struct AVL {
-  AVLNode *Root;
-  int      Count;
+  AVLLinks *Root;
+  int       Count;
+  unsigned long Version;
+  struct AVLVersions *Versions;
+  struct AVLSnapshot *Pinned;
 } AVL;
 
 typedef struct StationsLL {
@@ -99,17 +115,297 @@ typedef struct StationsLL {
     struct StationsLL *next;
 } StationsLL;
 
-//
-// AVL API: function prototypes
-//
+// AVLVisitor:
+// Called by AVLParallelScan once for every node of the tree. partial is the
+// calling thread's private, zero-initialized result buffer.
+typedef void (*AVLVisitor)(void *node, void *partial, void *arg);
 
-AVL *AVLCreate();
+// AVLReducer:
+// Called by AVLParallelScan after the scan to fold one thread's partial
+// result into the final result.
+typedef void (*AVLReducer)(void *result, void *partial, void *arg);
 
-void AVLFree(AVL *tree, void(*fp)(AVLKey key, AVLValue value));
+// AVLMerger:
+// Called by AVLUnion when both trees hold the same key: folds duplicate node
+// into kept node. The duplicate node itself is freed by AVLUnion afterwards.
+typedef void (*AVLMerger)(void *kept, void *duplicate);
+
+//
+// AVL API: function prototypes, shared by all tree types
+//
 
 int AVLCompareKeys(AVLKey key1, AVLKey key2);
-AVLNode *AVLSearch(AVL *tree, AVLKey key);
-boolean AVLInsert(AVL *tree, AVLKey key, AVLValue value);
 
 int AVLCount(AVL *tree);
 int AVLHeight(AVL *tree);
+unsigned long AVLVersion(AVL *tree);
+
+void _AVLRebalance(AVL *tree, AVLLinks **stack, int topStack);
+
+void AVLSearchBatch(AVL *tree, const AVLKey *keys, int count, AVLLinks **found);
+void AVLForEach(AVL *tree, void(*fp)(void *node, void *arg), void *arg);
+void AVLUnion(AVL *tree1, AVL *tree2, AVLMerger merge);
+AVLLinks *AVLDeleteNode(AVL *tree, AVLKey key);
+
+void AVLEnableSnapshots(AVL *tree, size_t nodeSize);
+void AVLFreeSnapshots(AVL *tree);
+boolean AVLVersionedInsert(AVL *tree, AVLLinks *node);
+AVLLinks *AVLVersionedModify(AVL *tree, AVLKey key);
+void AVLMarkFresh(AVL *tree, void *memory);
+boolean AVLIsShared(AVL *tree, const void *memory);
+void AVLRetire(AVL *tree, void *memory);
+void AVLPublish(AVL *tree);
+AVL *AVLAcquire(AVL *tree);
+void AVLRelease(AVL *view);
+
+void AVLSetScanThreads(int threads);
+int AVLScanThreads(void);
+void AVLParallelScan(AVL *tree, AVLVisitor visit, void *arg,
+                     size_t partialSize, AVLReducer reduce, void *result);
+void AVLScanShutdown(void);
+
+//
+// AVL_DEFINE_TREE:
+// Generates a tree type for VALUE payloads: PREFIX##AVLNode holds exactly
+// the links and one VALUE, and PREFIX##AVLSearch / PREFIX##AVLInsert compare
+// keys inline. Everything that only touches the links (rebalancing, union,
+// scans, snapshots) is shared code in avl.c.
+//
+// Once snapshots are enabled, Insert, Modify and Delete copy the path from
+// the root instead of changing nodes that readers may see, and the changes
+// become visible to readers all at once on Publish. Readers Acquire a view
+// of the last published tree, which stays unchanged until they Release it.
+// Only one thread may change the tree; it may read the tree directly.
+//
+// For AVL_DEFINE_TREE(Bike, BIKE):
+//   BikeAVL *BikeAVLCreate(void);
+//   void BikeAVLFree(BikeAVL *tree, void(*fp)(AVLKey key, BIKE value));
+//   BikeAVLNode *BikeAVLSearch(BikeAVL *tree, AVLKey key);
+//   void BikeAVLSearchBatch(BikeAVL *tree, const AVLKey *keys, int count,
+//                           BikeAVLNode **found);
+//   BikeAVLNode *BikeAVLModify(BikeAVL *tree, AVLKey key);
+//   void BikeAVLEnableSnapshots(BikeAVL *tree);
+//   void BikeAVLMarkFresh(BikeAVL *tree, void *memory);
+//   boolean BikeAVLIsShared(BikeAVL *tree, const void *memory);
+//   void BikeAVLRetire(BikeAVL *tree, void *memory);
+//   void BikeAVLPublish(BikeAVL *tree);
+//   BikeAVL *BikeAVLAcquire(BikeAVL *tree);
+//   void BikeAVLRelease(BikeAVL *view);
+//   boolean BikeAVLInsert(BikeAVL *tree, AVLKey key, BIKE value);
+//   boolean BikeAVLDelete(BikeAVL *tree, AVLKey key, BIKE *value);
+//   int BikeAVLCount(BikeAVL *tree);
+//   int BikeAVLHeight(BikeAVL *tree);
+//   unsigned long BikeAVLVersion(BikeAVL *tree);
+//   void BikeAVLForEach(BikeAVL *tree, void(*fp)(void *node, void *arg), void *arg);
+//   BikeAVL *BikeAVLUnion(BikeAVL *tree1, BikeAVL *tree2, AVLMerger merge);
+//   void BikeAVLParallelScan(BikeAVL *tree, AVLVisitor visit, void *arg,
+//                            size_t partialSize, AVLReducer reduce, void *result);
+//
+#define AVL_DEFINE_TREE(PREFIX, VALUE)                                          \
+                                                                                \
+typedef struct PREFIX##AVLNode {                                                \
+  AVLLinks  Links;                                                              \
+  VALUE     Value;                                                              \
+} PREFIX##AVLNode;                                                              \
+                                                                                \
+typedef struct PREFIX##AVL {                                                    \
+  AVL       Tree;                                                               \
+} PREFIX##AVL;                                                                  \
+                                                                                \
+/* Dynamically creates and returns an empty tree. */                            \
+static inline PREFIX##AVL *PREFIX##AVLCreate(void) {                            \
+    PREFIX##AVL *tree = (PREFIX##AVL *)malloc(sizeof(PREFIX##AVL));             \
+    tree->Tree.Root = NULL;                                                     \
+    tree->Tree.Count = 0;                                                       \
+    tree->Tree.Version = 0;                                                     \
+    tree->Tree.Versions = NULL;                                                 \
+    tree->Tree.Pinned = NULL;                                                   \
+    return tree;                                                                \
+}                                                                               \
+                                                                                \
+/* Frees nodes from the leaves up, calling fp (if any) for every value. */      \
+static inline void _##PREFIX##AVLFree(AVLLinks *root,                           \
+                                      void(*fp)(AVLKey key, VALUE value)) {     \
+    while(root != NULL) {                                                       \
+        AVLLinks *right = root->Right;                                          \
+        _##PREFIX##AVLFree(root->Left, fp);                                     \
+        if(fp != NULL) {                                                        \
+            fp(root->Key, ((PREFIX##AVLNode *)root)->Value);                    \
+        }                                                                       \
+        free(root);                                                             \
+        root = right;                                                           \
+    }                                                                           \
+}                                                                               \
+                                                                                \
+/* Frees the tree handle and nodes, fp frees data inside of values. */          \
+static inline void PREFIX##AVLFree(PREFIX##AVL *tree,                           \
+                                   void(*fp)(AVLKey key, VALUE value)) {        \
+    AVLFreeSnapshots(&tree->Tree);                                              \
+    _##PREFIX##AVLFree(tree->Tree.Root, fp);                                    \
+    free(tree);                                                                 \
+}                                                                               \
+                                                                                \
+/* Returns node with the key, or NULL if not found. */                          \
+static inline PREFIX##AVLNode *PREFIX##AVLSearch(PREFIX##AVL *tree,             \
+                                                 AVLKey key) {                  \
+    AVLLinks *cur = tree->Tree.Root;                                            \
+    while(cur != NULL && cur->Key != key) {                                     \
+        cur = (key < cur->Key) ? cur->Left : cur->Right;                        \
+    }                                                                           \
+    return (PREFIX##AVLNode *)cur;                                              \
+}                                                                               \
+                                                                                \
+/* Searches count keys at once, found[i] is the node of keys[i] or NULL. */     \
+static inline void PREFIX##AVLSearchBatch(PREFIX##AVL *tree,                    \
+                                          const AVLKey *keys, int count,        \
+                                          PREFIX##AVLNode **found) {            \
+    AVLLinks *links[AVL_SEARCH_CHUNK];                                          \
+    for(int base = 0; base < count; base += AVL_SEARCH_CHUNK) {                 \
+        int size = (count - base < AVL_SEARCH_CHUNK) ? count - base             \
+                                                     : AVL_SEARCH_CHUNK;        \
+        AVLSearchBatch(&tree->Tree, keys + base, size, links);                  \
+        for(int i = 0; i < size; i++) {                                         \
+            found[base + i] = (PREFIX##AVLNode *)links[i];                      \
+        }                                                                       \
+    }                                                                           \
+}                                                                               \
+                                                                                \
+/* Inserts new node, returns false if the key is already in the tree. */        \
+static inline boolean PREFIX##AVLInsert(PREFIX##AVL *tree, AVLKey key,          \
+                                        VALUE value) {                          \
+    if(tree->Tree.Versions != NULL) {                                           \
+        PREFIX##AVLNode *node = (PREFIX##AVLNode *)malloc(sizeof(*node));       \
+        node->Links.Key = key;                                                  \
+        node->Value = value;                                                    \
+        if(!AVLVersionedInsert(&tree->Tree, &node->Links)) {                    \
+            free(node);                                                         \
+            return false;                                                       \
+        }                                                                       \
+        return true;                                                            \
+    }                                                                           \
+    AVLLinks *stack[AVL_MAX_HEIGHT];                                            \
+    int topStack = -1;                                                          \
+    AVLLinks **slot = &tree->Tree.Root;                                         \
+    while(*slot != NULL) {                                                      \
+        AVLLinks *cur = *slot;                                                  \
+        if(key == cur->Key) {                                                   \
+            return false;                                                       \
+        }                                                                       \
+        topStack++;                                                             \
+        stack[topStack] = cur;                                                  \
+        slot = (key < cur->Key) ? &cur->Left : &cur->Right;                     \
+    }                                                                           \
+    PREFIX##AVLNode *newNode = (PREFIX##AVLNode *)malloc(sizeof(PREFIX##AVLNode)); \
+    newNode->Links.Key = key;                                                   \
+    newNode->Links.Left = NULL;                                                 \
+    newNode->Links.Right = NULL;                                                \
+    newNode->Links.Height = 0;                                                  \
+    newNode->Value = value;                                                     \
+    *slot = &newNode->Links;                                                    \
+    tree->Tree.Count++;                                                         \
+    tree->Tree.Version++;                                                       \
+    _AVLRebalance(&tree->Tree, stack, topStack);                                \
+    return true;                                                                \
+}                                                                               \
+                                                                                \
+/* Removes node with the key and stores its value into *value, if not */        \
+/* NULL; returns false if the key is not in the tree. The caller frees */       \
+/* data inside of the value, with Retire if readers may still see it. */        \
+static inline boolean PREFIX##AVLDelete(PREFIX##AVL *tree, AVLKey key,          \
+                                        VALUE *value) {                         \
+    AVLLinks *node = AVLDeleteNode(&tree->Tree, key);                           \
+    if(node == NULL) {                                                          \
+        return false;                                                           \
+    }                                                                           \
+    if(value != NULL) {                                                         \
+        *value = ((PREFIX##AVLNode *)node)->Value;                              \
+    }                                                                           \
+    AVLRetire(&tree->Tree, node);                                               \
+    return true;                                                                \
+}                                                                               \
+                                                                                \
+/* Returns node with the key whose value may be changed, or NULL. */            \
+static inline PREFIX##AVLNode *PREFIX##AVLModify(PREFIX##AVL *tree,             \
+                                                 AVLKey key) {                  \
+    if(tree->Tree.Versions != NULL) {                                           \
+        return (PREFIX##AVLNode *)AVLVersionedModify(&tree->Tree, key);         \
+    }                                                                           \
+    return PREFIX##AVLSearch(tree, key);                                        \
+}                                                                               \
+                                                                                \
+static inline void PREFIX##AVLEnableSnapshots(PREFIX##AVL *tree) {              \
+    AVLEnableSnapshots(&tree->Tree, sizeof(PREFIX##AVLNode));                   \
+}                                                                               \
+                                                                                \
+/* Marks memory allocated for values since the last Publish; readers */        \
+/* cannot see it, so it may be changed in place until then. */                  \
+static inline void PREFIX##AVLMarkFresh(PREFIX##AVL *tree, void *memory) {      \
+    AVLMarkFresh(&tree->Tree, memory);                                          \
+}                                                                               \
+                                                                                \
+/* Returns true if readers may see memory, which must then be copied */         \
+/* before it is changed. */                                                     \
+static inline boolean PREFIX##AVLIsShared(PREFIX##AVL *tree,                    \
+                                          const void *memory) {                 \
+    return AVLIsShared(&tree->Tree, memory);                                    \
+}                                                                               \
+                                                                                \
+/* Frees memory once no reader can still see it, e.g. replaced values. */       \
+static inline void PREFIX##AVLRetire(PREFIX##AVL *tree, void *memory) {         \
+    AVLRetire(&tree->Tree, memory);                                             \
+}                                                                               \
+                                                                                \
+static inline void PREFIX##AVLPublish(PREFIX##AVL *tree) {                      \
+    AVLPublish(&tree->Tree);                                                    \
+}                                                                               \
+                                                                                \
+/* Returns a read-only view of the last published tree, or the tree itself */   \
+/* if snapshots are not enabled. */                                             \
+static inline PREFIX##AVL *PREFIX##AVLAcquire(PREFIX##AVL *tree) {              \
+    return (PREFIX##AVL *)AVLAcquire(&tree->Tree);                              \
+}                                                                               \
+                                                                                \
+static inline void PREFIX##AVLRelease(PREFIX##AVL *view) {                      \
+    AVLRelease(&view->Tree);                                                    \
+}                                                                               \
+                                                                                \
+static inline int PREFIX##AVLCount(PREFIX##AVL *tree) {                         \
+    return AVLCount(&tree->Tree);                                               \
+}                                                                               \
+                                                                                \
+static inline int PREFIX##AVLHeight(PREFIX##AVL *tree) {                        \
+    return AVLHeight(&tree->Tree);                                              \
+}                                                                               \
+                                                                                \
+static inline unsigned long PREFIX##AVLVersion(PREFIX##AVL *tree) {             \
+    return AVLVersion(&tree->Tree);                                             \
+}                                                                               \
+                                                                                \
+static inline void PREFIX##AVLForEach(PREFIX##AVL *tree,                        \
+                                      void(*fp)(void *node, void *arg),         \
+                                      void *arg) {                              \
+    AVLForEach(&tree->Tree, fp, arg);                                           \
+}                                                                               \
+                                                                                \
+/* Moves all nodes of tree2 into tree1, frees tree2 handle. */                  \
+static inline PREFIX##AVL *PREFIX##AVLUnion(PREFIX##AVL *tree1,                 \
+                                            PREFIX##AVL *tree2,                 \
+                                            AVLMerger merge) {                  \
+    AVLUnion(&tree1->Tree, &tree2->Tree, merge);                                \
+    free(tree2);                                                                \
+    return tree1;                                                               \
+}                                                                               \
+                                                                                \
+static inline void PREFIX##AVLParallelScan(PREFIX##AVL *tree, AVLVisitor visit, \
+                                           void *arg, size_t partialSize,       \
+                                           AVLReducer reduce, void *result) {   \
+    AVLParallelScan(&tree->Tree, visit, arg, partialSize, reduce, result);      \
+}
+
+//
+// Tree types:
+//
+
+AVL_DEFINE_TREE(Station, STATION)
+AVL_DEFINE_TREE(Trip, TRIP)
+AVL_DEFINE_TREE(Bike, BIKE)
@@ -0,0 +1,453 @@
+/*avl_bench.c*/
+
+//
+// AVL tree microbenchmark and invariant checks.
+//
+// Builds trees from sequential, random, Zipfian and nearly-sorted key
+// streams of 10^3 keys up to the requested size, and for every stream and
+// size outputs one CSV line with insert and search throughput and the final
+// height. Searches are timed one by one and batched (AVLSearchBatch). Every
+// tree is checked for AVL invariants (key order, stored heights, balance,
+// node count) while it grows and after it is built.
+//
+// Usage: avl_bench [-n maxKeys] [-b baseline.csv] [-t tolerance%]
+//
+// With -b, results are compared against a CSV written by an earlier run;
+// throughput more than tolerance% (default 20) below the baseline, or a
+// different height or count, is reported on stderr and makes the exit
+// status 1. Invariant violations make the exit status 2.
+//
+
+// ignore stdlib warnings if working in Visual Studio:
+#define _CRT_SECURE_NO_WARNINGS 
+
+// clock_gettime() under -std=c11:
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "avl.h"
+
+AVL_DEFINE_TREE(Bench, int)
+
+#define BENCH_MIN_KEYS       1000L
+#define BENCH_DEFAULT_KEYS   1000000L
+#define BENCH_MAX_KEYS       100000000L
+#define BENCH_OPS_PER_SIZE   2000000L
+#define BENCH_MIN_ROUNDS     3
+#define BENCH_CHECKPOINTS    16
+#define BENCH_CHECK_MAX_KEYS 1000000L
+#define BENCH_TOLERANCE      20.0
+#define BENCH_MAX_RESULTS    64
+#define BENCH_BATCH          4096
+
+typedef enum BENCHSTREAM {
+    SEQUENTIAL,
+    RANDOM,
+    ZIPFIAN,
+    NEARLY_SORTED,
+    BENCH_STREAMS
+} BENCHSTREAM;
+
+static const char *StreamNames[BENCH_STREAMS] = {
+    "sequential", "random", "zipfian", "nearly-sorted"
+};
+
+typedef struct BENCHRESULT {
+    char Stream[32];
+    long Keys;
+    int Inserted;
+    int Height;
+    double InsertRate;
+    double SearchRate;
+    double BatchRate;
+    boolean Valid;
+} BENCHRESULT;
+
+// BenchNow:
+// Returns monotonic time in seconds.
+//
+double BenchNow(void) {
+    
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+// BenchRandom:
+// xorshift64 pseudo-random generator.
+//
+unsigned long long BenchRandom(unsigned long long *state) {
+    
+    unsigned long long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    
+    return x;
+}
+
+// BenchScramble:
+// Maps rank to a key, a bijection on [0, 2^31), so that ranks that are
+// close to each other do not become neighbouring keys.
+//
+int BenchScramble(long rank) {
+    
+    return (int)(((unsigned long long)rank * 2654435761ULL) & 0x7fffffffULL);
+}
+
+// FillStream:
+// Fills keys with count keys of the stream. Streams are generated from a
+// fixed seed, so every run inserts the same keys.
+//
+void FillStream(BENCHSTREAM stream, int *keys, long count) {
+    
+    unsigned long long state = 88172645463325252ULL;
+    
+    switch(stream) {
+        case SEQUENTIAL:
+            for(long i = 0; i < count; i++) {
+                keys[i] = (int)i;
+            }
+            break;
+        
+        case RANDOM:
+            for(long i = 0; i < count; i++) {
+                keys[i] = (int)(BenchRandom(&state) & 0x7fffffffULL);
+            }
+            break;
+        
+        case ZIPFIAN:
+            // Rank (n + 1)^u - 1 with uniform u has density ~ 1/rank, which
+            // is Zipf's law with exponent 1 over count ranks:
+            for(long i = 0; i < count; i++) {
+                double u = (double)(BenchRandom(&state) >> 11) / 9007199254740992.0;
+                long rank = (long)pow((double)count + 1.0, u) - 1;
+                if(rank >= count) {
+                    rank = count - 1;
+                }
+                keys[i] = BenchScramble(rank);
+            }
+            break;
+        
+        case NEARLY_SORTED:
+            // Sorted keys with 1% of them swapped with a key at most 16
+            // positions further:
+            for(long i = 0; i < count; i++) {
+                keys[i] = (int)i;
+            }
+            for(long n = 0; n < count / 100; n++) {
+                long i = (long)(BenchRandom(&state) % (unsigned long long)count);
+                long j = i + 1 + (long)(BenchRandom(&state) % 16);
+                if(j < count) {
+                    int key = keys[i];
+                    keys[i] = keys[j];
+                    keys[j] = key;
+                }
+            }
+            break;
+        
+        default:
+            break;
+    }
+    
+    return;
+}
+
+// _BenchCheck:
+// Checks AVL invariants of the subtree whose keys must be within
+// [low, high]: key order, stored heights and balance. Counts nodes into
+// *count. Returns subtree height, or -2 if an invariant does not hold.
+//
+int _BenchCheck(AVLLinks *node, long long low, long long high, int *count) {
+    
+    if(node == NULL) {
+        return -1;
+    }
+    if(node->Key < low || node->Key > high) {
+        return -2;
+    }
+    
+    int left = _BenchCheck(node->Left, low, (long long)node->Key - 1, count);
+    int right = _BenchCheck(node->Right, (long long)node->Key + 1, high, count);
+    if(left == -2 || right == -2 || left - right > 1 || right - left > 1) {
+        return -2;
+    }
+    int height = 1 + ((left > right) ? left : right);
+    if(node->Height != height) {
+        return -2;
+    }
+    (*count)++;
+    
+    return height;
+}
+
+// BenchCheck:
+// Returns true if the tree satisfies all AVL invariants and holds as many
+// nodes as it counts.
+//
+boolean BenchCheck(BenchAVL *tree) {
+    
+    int count = 0;
+    if(_BenchCheck(tree->Tree.Root, -2147483648LL, 2147483647LL, &count) == -2) {
+        return false;
+    }
+    
+    return count == BenchAVLCount(tree);
+}
+
+// BenchCheckGrowing:
+// Inserts keys into a new tree and checks invariants at checkpoints while
+// the tree grows. Returns true if all checks pass.
+//
+boolean BenchCheckGrowing(int *keys, long count) {
+    
+    BenchAVL *tree = BenchAVLCreate();
+    boolean valid = true;
+    long next = count / BENCH_CHECKPOINTS;
+    
+    for(long i = 0; i < count && valid; i++) {
+        BenchAVLInsert(tree, keys[i], (int)i);
+        if(i + 1 >= next) {
+            valid = BenchCheck(tree);
+            next += count / BENCH_CHECKPOINTS;
+        }
+    }
+    BenchAVLFree(tree, NULL);
+    
+    return valid;
+}
+
+// RunBenchmark:
+// Builds trees from count keys of the stream, repeated so that every size
+// does about BENCH_OPS_PER_SIZE inserts, and measures insert and search
+// throughput in millions of operations per second. The fastest round is
+// reported, as it is the least disturbed by the rest of the system.
+//
+void RunBenchmark(BENCHSTREAM stream, long count, BENCHRESULT *result) {
+    
+    int *keys = (int *)malloc(count * sizeof(int));
+    FillStream(stream, keys, count);
+    
+    long rounds = BENCH_OPS_PER_SIZE / count;
+    if(rounds < BENCH_MIN_ROUNDS && count <= BENCH_CHECK_MAX_KEYS) {
+        rounds = BENCH_MIN_ROUNDS;
+    } else if(rounds < 1) {
+        rounds = 1;
+    }
+    
+    strcpy(result->Stream, StreamNames[stream]);
+    result->Keys = count;
+    result->Valid = true;
+    if(count <= BENCH_CHECK_MAX_KEYS) {
+        result->Valid = BenchCheckGrowing(keys, count);
+    }
+    
+    double insertTime = 0.0;
+    double searchTime = 0.0;
+    double batchTime = 0.0;
+    double ops = (double)count / 1e6;
+    result->InsertRate = 0.0;
+    result->SearchRate = 0.0;
+    result->BatchRate = 0.0;
+    BenchAVLNode **batch = (BenchAVLNode **)malloc(BENCH_BATCH * sizeof(BenchAVLNode *));
+    for(long round = 0; round < rounds; round++) {
+        BenchAVL *tree = BenchAVLCreate();
+        
+        double start = BenchNow();
+        for(long i = 0; i < count; i++) {
+            BenchAVLInsert(tree, keys[i], (int)i);
+        }
+        insertTime = BenchNow() - start;
+        
+        long found = 0;
+        start = BenchNow();
+        for(long i = 0; i < count; i++) {
+            found += (BenchAVLSearch(tree, keys[i]) != NULL);
+        }
+        searchTime = BenchNow() - start;
+        
+        long batchFound = 0;
+        start = BenchNow();
+        for(long i = 0; i < count; i += BENCH_BATCH) {
+            int size = (count - i < BENCH_BATCH) ? (int)(count - i) : BENCH_BATCH;
+            BenchAVLSearchBatch(tree, keys + i, size, batch);
+            for(int j = 0; j < size; j++) {
+                batchFound += (batch[j] != NULL);
+            }
+        }
+        batchTime = BenchNow() - start;
+        
+        if(insertTime > 0.0 && ops / insertTime > result->InsertRate) {
+            result->InsertRate = ops / insertTime;
+        }
+        if(searchTime > 0.0 && ops / searchTime > result->SearchRate) {
+            result->SearchRate = ops / searchTime;
+        }
+        if(batchTime > 0.0 && ops / batchTime > result->BatchRate) {
+            result->BatchRate = ops / batchTime;
+        }
+        
+        if(round == 0) {
+            result->Inserted = BenchAVLCount(tree);
+            result->Height = BenchAVLHeight(tree);
+            if(found != count || batchFound != count || !BenchCheck(tree)) {
+                result->Valid = false;
+            }
+        }
+        BenchAVLFree(tree, NULL);
+    }
+    
+    free(batch);
+    free(keys);
+    
+    return;
+}
+
+// PrintResult:
+// Outputs result as one CSV line.
+//
+void PrintResult(FILE *output, BENCHRESULT *result) {
+    
+    fprintf(output, "%s,%ld,%d,%d,%.3f,%.3f,%.3f,%s\n", result->Stream, result->Keys,
+            result->Inserted, result->Height, result->InsertRate, result->SearchRate,
+            result->BatchRate, result->Valid ? "ok" : "FAILED");
+    
+    return;
+}
+
+// ReadBaseline:
+// Reads results of an earlier run from CSV file into baseline. Returns the
+// number of results read, or -1 if the file cannot be opened.
+//
+int ReadBaseline(const char *fileName, BENCHRESULT *baseline, int maxResults) {
+    
+    FILE *input = fopen(fileName, "r");
+    if(input == NULL) {
+        return -1;
+    }
+    
+    char line[256];
+    char valid[16];
+    int count = 0;
+    while(count < maxResults && fgets(line, sizeof(line), input) != NULL) {
+        BENCHRESULT *result = &baseline[count];
+        if(sscanf(line, "%31[^,],%ld,%d,%d,%lf,%lf,%lf,%15s", result->Stream, &result->Keys,
+                  &result->Inserted, &result->Height, &result->InsertRate,
+                  &result->SearchRate, &result->BatchRate, valid) == 8) {
+            result->Valid = (strcmp(valid, "ok") == 0);
+            count++;
+        }
+    }
+    fclose(input);
+    
+    return count;
+}
+
+// CompareResult:
+// Reports differences of result from the baseline result of the same
+// stream and size on stderr. Returns true if the result regressed.
+//
+boolean CompareResult(BENCHRESULT *result, BENCHRESULT *baseline, int baselineCount,
+                      double tolerance) {
+
+    for(int i = 0; i < baselineCount; i++) {
+        BENCHRESULT *base = &baseline[i];
+        if(strcmp(base->Stream, result->Stream) != 0 || base->Keys != result->Keys) {
+            continue;
+        }
+
+        boolean regressed = false;
+        double minimum = 1.0 - tolerance / 100.0;
+        if(result->InsertRate < base->InsertRate * minimum) {
+            fprintf(stderr, "** regression: %s %ld insert %.3f < baseline %.3f Mops/s\n",
+                    result->Stream, result->Keys, result->InsertRate, base->InsertRate);
+            regressed = true;
+        }
+        if(result->SearchRate < base->SearchRate * minimum) {
+            fprintf(stderr, "** regression: %s %ld search %.3f < baseline %.3f Mops/s\n",
+                    result->Stream, result->Keys, result->SearchRate, base->SearchRate);
+            regressed = true;
+        }
+        if(result->BatchRate < base->BatchRate * minimum) {
+            fprintf(stderr, "** regression: %s %ld batch search %.3f < baseline %.3f Mops/s\n",
+                    result->Stream, result->Keys, result->BatchRate, base->BatchRate);
+            regressed = true;
+        }
+        if(result->Height != base->Height || result->Inserted != base->Inserted) {
+            fprintf(stderr, "** changed: %s %ld height %d count %d, baseline height %d count %d\n",
+                    result->Stream, result->Keys, result->Height, result->Inserted,
+                    base->Height, base->Inserted);
+            regressed = true;
+        }
+        return regressed;
+    }
+
+    return false;
+}
+
+// main:
+//
+int main(int argc, char *argv[]) {
+    
+    long maxKeys = BENCH_DEFAULT_KEYS;
+    char *baselineFileName = NULL;
+    double tolerance = BENCH_TOLERANCE;
+    
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            maxKeys = atol(argv[++i]);
+        } else if(strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            baselineFileName = argv[++i];
+        } else if(strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            tolerance = atof(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [-n maxKeys] [-b baseline.csv] [-t tolerance%%]\n", argv[0]);
+            return 2;
+        }
+    }
+    if(maxKeys > BENCH_MAX_KEYS) {
+        maxKeys = BENCH_MAX_KEYS;
+    }
+    
+    BENCHRESULT baseline[BENCH_MAX_RESULTS];
+    int baselineCount = 0;
+    if(baselineFileName != NULL) {
+        baselineCount = ReadBaseline(baselineFileName, baseline, BENCH_MAX_RESULTS);
+        if(baselineCount < 0) {
+            fprintf(stderr, "** cannot open baseline %s\n", baselineFileName);
+            return 2;
+        }
+    }
+    
+    boolean valid = true;
+    boolean regressed = false;
+    printf("stream,keys,inserted,height,insert_mops,search_mops,batch_mops,invariants\n");
+    for(long count = BENCH_MIN_KEYS; count <= maxKeys; count *= 10) {
+        for(int stream = 0; stream < BENCH_STREAMS; stream++) {
+            BENCHRESULT result;
+            RunBenchmark((BENCHSTREAM)stream, count, &result);
+            PrintResult(stdout, &result);
+            fflush(stdout);
+            
+            valid = valid && result.Valid;
+            if(CompareResult(&result, baseline, baselineCount, tolerance)) {
+                regressed = true;
+            }
+        }
+    }
+    AVLScanShutdown();
+    
+    if(!valid) {
+        fprintf(stderr, "** AVL invariants do not hold\n");
+        return 2;
+    }
+    
+    return regressed ? 1 : 0;
+}
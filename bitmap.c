@@ -0,0 +1,472 @@
+/*bitmap.c*/
+
+//
+// Compressed bitmap implementation file.
+//
+
+// ignore stdlib warnings if working in Visual Studio:
+#define _CRT_SECURE_NO_WARNINGS 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+
+// Count set bits of a word, with the CPU instruction if the compiler can:
+#if defined(__GNUC__)
+#define ROARING_POPCOUNT(word) __builtin_popcountll(word)
+#else
+static int ROARING_POPCOUNT(unsigned long long word) {
+    int count = 0;
+    for(; word != 0; word &= word - 1) {
+        count++;
+    }
+    return count;
+}
+#endif
+
+#define ROARING_HAS_BIT(words, low) (((words)[(low) >> 6] >> ((low) & 63)) & 1)
+
+// RoaringInit:
+// Initializes an empty bitmap.
+//
+void RoaringInit(ROARING *bitmap) {
+    
+    bitmap->Count = 0;
+    bitmap->Capacity = 0;
+    bitmap->Containers = NULL;
+    
+    return;
+}
+
+// RoaringFree:
+// Frees the memory associated with the bitmap, and leaves it empty.
+//
+void RoaringFree(ROARING *bitmap) {
+    
+    for(int i = 0; i < bitmap->Count; i++) {
+        free(bitmap->Containers[i].Values);
+        free(bitmap->Containers[i].Words);
+    }
+    free(bitmap->Containers);
+    RoaringInit(bitmap);
+    
+    return;
+}
+
+// _RoaringFind:
+// Returns the position of the container with the key, or -(position it
+// belongs at) - 1 if there is none.
+//
+static int _RoaringFind(const ROARING *bitmap, unsigned short key) {
+    
+    int low = 0;
+    int high = bitmap->Count - 1;
+    while(low <= high) {
+        int middle = (low + high) / 2;
+        unsigned short middleKey = bitmap->Containers[middle].Key;
+        if(middleKey < key) {
+            low = middle + 1;
+        } else if(middleKey > key) {
+            high = middle - 1;
+        } else {
+            return middle;
+        }
+    }
+    
+    return -(low + 1);
+}
+
+// _RoaringInsert:
+// Inserts an empty array container with the key at position, and returns
+// it.
+//
+static ROARCONTAINER *_RoaringInsert(ROARING *bitmap, int position, unsigned short key) {
+    
+    if(bitmap->Count == bitmap->Capacity) {
+        bitmap->Capacity = (bitmap->Capacity > 0) ? bitmap->Capacity * 2 : 4;
+        bitmap->Containers = (ROARCONTAINER *)realloc(bitmap->Containers,
+                                 bitmap->Capacity * sizeof(ROARCONTAINER));
+    }
+    memmove(&bitmap->Containers[position + 1], &bitmap->Containers[position],
+            (bitmap->Count - position) * sizeof(ROARCONTAINER));
+    bitmap->Count++;
+    
+    ROARCONTAINER *container = &bitmap->Containers[position];
+    container->Key = key;
+    container->Cardinality = 0;
+    container->Capacity = 0;
+    container->Values = NULL;
+    container->Words = NULL;
+    
+    return container;
+}
+
+// _RoaringToBitmap:
+// Converts an array container into a bitmap container.
+//
+static void _RoaringToBitmap(ROARCONTAINER *container) {
+    
+    container->Words = (unsigned long long *)calloc(ROARING_WORDS, sizeof(unsigned long long));
+    for(int i = 0; i < container->Cardinality; i++) {
+        unsigned short low = container->Values[i];
+        container->Words[low >> 6] |= 1ULL << (low & 63);
+    }
+    free(container->Values);
+    container->Values = NULL;
+    container->Capacity = 0;
+    
+    return;
+}
+
+// _RoaringToArray:
+// Converts a bitmap container into an array container, if it has few enough
+// values.
+//
+static void _RoaringToArray(ROARCONTAINER *container) {
+    
+    if(container->Words == NULL || container->Cardinality > ROARING_ARRAY_MAX) {
+        return;
+    }
+    
+    container->Capacity = (container->Cardinality > 0) ? container->Cardinality : 1;
+    container->Values = (unsigned short *)malloc(container->Capacity * sizeof(unsigned short));
+    int count = 0;
+    for(int i = 0; i < ROARING_WORDS; i++) {
+        for(unsigned long long word = container->Words[i]; word != 0; word &= word - 1) {
+            int bit = ROARING_POPCOUNT((word & -word) - 1);
+            container->Values[count] = (unsigned short)(i * 64 + bit);
+            count++;
+        }
+    }
+    free(container->Words);
+    container->Words = NULL;
+    
+    return;
+}
+
+// _RoaringCountWords:
+// Returns the number of set bits of a bitmap container.
+//
+static int _RoaringCountWords(const unsigned long long *words) {
+    
+    int count = 0;
+    for(int i = 0; i < ROARING_WORDS; i++) {
+        count += ROARING_POPCOUNT(words[i]);
+    }
+    
+    return count;
+}
+
+// _RoaringContainerAdd:
+// Adds low 16 bits of a value to the container.
+//
+static void _RoaringContainerAdd(ROARCONTAINER *container, unsigned short low) {
+    
+    if(container->Words == NULL && container->Cardinality == ROARING_ARRAY_MAX) {
+        _RoaringToBitmap(container);
+    }
+    if(container->Words != NULL) {
+        if(!ROARING_HAS_BIT(container->Words, low)) {
+            container->Words[low >> 6] |= 1ULL << (low & 63);
+            container->Cardinality++;
+        }
+        return;
+    }
+    
+    // Values mostly come in ascending order, so look from the end:
+    int i = container->Cardinality;
+    while(i > 0 && container->Values[i - 1] > low) {
+        i--;
+    }
+    if(i > 0 && container->Values[i - 1] == low) {
+        return;
+    }
+    if(container->Cardinality == container->Capacity) {
+        container->Capacity = (container->Capacity > 0) ? container->Capacity * 2 : 4;
+        container->Values = (unsigned short *)realloc(container->Values,
+                                container->Capacity * sizeof(unsigned short));
+    }
+    memmove(&container->Values[i + 1], &container->Values[i],
+            (container->Cardinality - i) * sizeof(unsigned short));
+    container->Values[i] = low;
+    container->Cardinality++;
+    
+    return;
+}
+
+// RoaringAdd:
+// Adds value to the bitmap.
+//
+void RoaringAdd(ROARING *bitmap, unsigned int value) {
+    
+    unsigned short key = (unsigned short)(value >> 16);
+    ROARCONTAINER *container = NULL;
+    if(bitmap->Count > 0 && bitmap->Containers[bitmap->Count - 1].Key == key) {
+        container = &bitmap->Containers[bitmap->Count - 1];
+    } else {
+        int position = _RoaringFind(bitmap, key);
+        container = (position >= 0) ? &bitmap->Containers[position]
+                                    : _RoaringInsert(bitmap, -position - 1, key);
+    }
+    _RoaringContainerAdd(container, (unsigned short)(value & 0xFFFF));
+    
+    return;
+}
+
+// RoaringRemove:
+// Removes value from the bitmap, if it is there.
+//
+void RoaringRemove(ROARING *bitmap, unsigned int value) {
+    
+    int position = _RoaringFind(bitmap, (unsigned short)(value >> 16));
+    if(position < 0) {
+        return;
+    }
+    
+    ROARCONTAINER *container = &bitmap->Containers[position];
+    unsigned short low = (unsigned short)(value & 0xFFFF);
+    if(container->Words != NULL) {
+        if(ROARING_HAS_BIT(container->Words, low)) {
+            container->Words[low >> 6] &= ~(1ULL << (low & 63));
+            container->Cardinality--;
+            _RoaringToArray(container);
+        }
+    } else {
+        int i = 0;
+        while(i < container->Cardinality && container->Values[i] < low) {
+            i++;
+        }
+        if(i < container->Cardinality && container->Values[i] == low) {
+            memmove(&container->Values[i], &container->Values[i + 1],
+                    (container->Cardinality - i - 1) * sizeof(unsigned short));
+            container->Cardinality--;
+        }
+    }
+    
+    // Drop the container once it is empty:
+    if(container->Cardinality == 0) {
+        free(container->Values);
+        free(container->Words);
+        memmove(&bitmap->Containers[position], &bitmap->Containers[position + 1],
+                (bitmap->Count - position - 1) * sizeof(ROARCONTAINER));
+        bitmap->Count--;
+    }
+    
+    return;
+}
+
+// RoaringCount:
+// Returns the number of values in the bitmap.
+//
+unsigned int RoaringCount(const ROARING *bitmap) {
+    
+    unsigned int count = 0;
+    for(int i = 0; i < bitmap->Count; i++) {
+        count += bitmap->Containers[i].Cardinality;
+    }
+    
+    return count;
+}
+
+// _RoaringContainerOr:
+// Adds all values of src container to dest container.
+//
+static void _RoaringContainerOr(ROARCONTAINER *dest, const ROARCONTAINER *src) {
+    
+    if(dest->Words == NULL && src->Words == NULL &&
+       dest->Cardinality + src->Cardinality <= ROARING_ARRAY_MAX) {
+        int capacity = dest->Cardinality + src->Cardinality + 1;
+        unsigned short *values = (unsigned short *)malloc(capacity * sizeof(unsigned short));
+        int i = 0, j = 0, count = 0;
+        while(i < dest->Cardinality || j < src->Cardinality) {
+            if(j == src->Cardinality ||
+               (i < dest->Cardinality && dest->Values[i] < src->Values[j])) {
+                values[count++] = dest->Values[i++];
+            } else if(i == dest->Cardinality || src->Values[j] < dest->Values[i]) {
+                values[count++] = src->Values[j++];
+            } else {
+                values[count++] = dest->Values[i++];
+                j++;
+            }
+        }
+        free(dest->Values);
+        dest->Values = values;
+        dest->Capacity = capacity;
+        dest->Cardinality = count;
+        return;
+    }
+    
+    if(dest->Words == NULL) {
+        _RoaringToBitmap(dest);
+    }
+    if(src->Words != NULL) {
+        for(int i = 0; i < ROARING_WORDS; i++) {
+            dest->Words[i] |= src->Words[i];
+        }
+    } else {
+        for(int i = 0; i < src->Cardinality; i++) {
+            dest->Words[src->Values[i] >> 6] |= 1ULL << (src->Values[i] & 63);
+        }
+    }
+    dest->Cardinality = _RoaringCountWords(dest->Words);
+    _RoaringToArray(dest);
+    
+    return;
+}
+
+// RoaringOr:
+// Adds all values of src to dest.
+//
+void RoaringOr(ROARING *dest, const ROARING *src) {
+    
+    for(int i = 0; i < src->Count; i++) {
+        const ROARCONTAINER *container = &src->Containers[i];
+        int position = _RoaringFind(dest, container->Key);
+        if(position < 0) {
+            position = -position - 1;
+            _RoaringInsert(dest, position, container->Key);
+        }
+        _RoaringContainerOr(&dest->Containers[position], container);
+    }
+    
+    return;
+}
+
+// _RoaringContainerAnd:
+// Removes values of dest container that are not in src container.
+//
+static void _RoaringContainerAnd(ROARCONTAINER *dest, const ROARCONTAINER *src) {
+    
+    if(dest->Words == NULL) {
+        int count = 0;
+        int j = 0;
+        for(int i = 0; i < dest->Cardinality; i++) {
+            unsigned short low = dest->Values[i];
+            int found;
+            if(src->Words != NULL) {
+                found = ROARING_HAS_BIT(src->Words, low);
+            } else {
+                while(j < src->Cardinality && src->Values[j] < low) {
+                    j++;
+                }
+                found = (j < src->Cardinality && src->Values[j] == low);
+            }
+            if(found) {
+                dest->Values[count++] = low;
+            }
+        }
+        dest->Cardinality = count;
+        return;
+    }
+    
+    if(src->Words == NULL) {
+        unsigned short *values = (unsigned short *)malloc((src->Cardinality + 1) *
+                                                          sizeof(unsigned short));
+        int count = 0;
+        for(int i = 0; i < src->Cardinality; i++) {
+            if(ROARING_HAS_BIT(dest->Words, src->Values[i])) {
+                values[count++] = src->Values[i];
+            }
+        }
+        free(dest->Words);
+        dest->Words = NULL;
+        dest->Values = values;
+        dest->Capacity = src->Cardinality + 1;
+        dest->Cardinality = count;
+        return;
+    }
+    
+    for(int i = 0; i < ROARING_WORDS; i++) {
+        dest->Words[i] &= src->Words[i];
+    }
+    dest->Cardinality = _RoaringCountWords(dest->Words);
+    _RoaringToArray(dest);
+    
+    return;
+}
+
+// RoaringAnd:
+// Removes values of dest that are not in src.
+//
+void RoaringAnd(ROARING *dest, const ROARING *src) {
+    
+    int count = 0;
+    for(int i = 0; i < dest->Count; i++) {
+        ROARCONTAINER *container = &dest->Containers[i];
+        int position = _RoaringFind(src, container->Key);
+        if(position >= 0) {
+            _RoaringContainerAnd(container, &src->Containers[position]);
+        }
+        if(position < 0 || container->Cardinality == 0) {
+            free(container->Values);
+            free(container->Words);
+        } else {
+            dest->Containers[count++] = *container;
+        }
+    }
+    dest->Count = count;
+    
+    return;
+}
+
+// _RoaringContainerAndCount:
+// Returns the number of values in both containers.
+//
+static int _RoaringContainerAndCount(const ROARCONTAINER *container1,
+                                     const ROARCONTAINER *container2) {
+    
+    int count = 0;
+    if(container1->Words != NULL && container2->Words != NULL) {
+        for(int i = 0; i < ROARING_WORDS; i++) {
+            count += ROARING_POPCOUNT(container1->Words[i] & container2->Words[i]);
+        }
+    } else if(container1->Words != NULL || container2->Words != NULL) {
+        const ROARCONTAINER *array = (container1->Words == NULL) ? container1 : container2;
+        const ROARCONTAINER *bits = (container1->Words == NULL) ? container2 : container1;
+        for(int i = 0; i < array->Cardinality; i++) {
+            count += ROARING_HAS_BIT(bits->Words, array->Values[i]);
+        }
+    } else {
+        int i = 0, j = 0;
+        while(i < container1->Cardinality && j < container2->Cardinality) {
+            if(container1->Values[i] < container2->Values[j]) {
+                i++;
+            } else if(container1->Values[i] > container2->Values[j]) {
+                j++;
+            } else {
+                count++;
+                i++;
+                j++;
+            }
+        }
+    }
+    
+    return count;
+}
+
+// RoaringAndCount:
+// Returns the number of values in both bitmaps, without building their
+// intersection.
+//
+unsigned int RoaringAndCount(const ROARING *bitmap1, const ROARING *bitmap2) {
+    
+    unsigned int count = 0;
+    int i = 0, j = 0;
+    while(i < bitmap1->Count && j < bitmap2->Count) {
+        unsigned short key1 = bitmap1->Containers[i].Key;
+        unsigned short key2 = bitmap2->Containers[j].Key;
+        if(key1 < key2) {
+            i++;
+        } else if(key1 > key2) {
+            j++;
+        } else {
+            count += _RoaringContainerAndCount(&bitmap1->Containers[i], &bitmap2->Containers[j]);
+            i++;
+            j++;
+        }
+    }
+    
+    return count;
+}
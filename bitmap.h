@@ -0,0 +1,49 @@
+/*bitmap.h*/
+
+//
+// Compressed bitmap header file.
+//
+
+// make sure this header file is #include exactly once:
+#pragma once
+
+//
+// ROARING type declarations:
+//
+// Roaring-style compressed bitmap of unsigned ints. Values are grouped by
+// their high 16 bits into containers, kept sorted by Key. A container holds
+// the low 16 bits of its values either as a sorted array, while it has at
+// most ROARING_ARRAY_MAX values, or else as a bitmap of 2^16 bits. Unions,
+// intersections and their counts work container by container, so sparse
+// and dense bitmaps both stay small and fast.
+//
+
+#define ROARING_ARRAY_MAX 4096
+#define ROARING_WORDS     1024
+
+typedef struct ROARCONTAINER {
+    unsigned short      Key;
+    int                 Cardinality;
+    int                 Capacity;
+    unsigned short     *Values;
+    unsigned long long *Words;
+} ROARCONTAINER;
+
+typedef struct ROARING {
+    int            Count;
+    int            Capacity;
+    ROARCONTAINER *Containers;
+} ROARING;
+
+//
+// Bitmap API: function prototypes
+//
+
+void RoaringInit(ROARING *bitmap);
+void RoaringFree(ROARING *bitmap);
+void RoaringAdd(ROARING *bitmap, unsigned int value);
+void RoaringRemove(ROARING *bitmap, unsigned int value);
+unsigned int RoaringCount(const ROARING *bitmap);
+void RoaringOr(ROARING *dest, const ROARING *src);
+void RoaringAnd(ROARING *dest, const ROARING *src);
+unsigned int RoaringAndCount(const ROARING *bitmap1, const ROARING *bitmap2);
@@ -0,0 +1,256 @@
+/*cache.c*/
+
+//
+// Query result cache implementation file.
+//
+
+// ignore stdlib warnings if working in Visual Studio:
+#define _CRT_SECURE_NO_WARNINGS 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+#define CACHE_INITIAL_BUCKETS 64
+
+// CacheInit:
+// Initializes an empty cache that holds at most budget bytes of entries.
+//
+void CacheInit(QUERYCACHE *cache, size_t budget) {
+    
+    cache->BucketCount = CACHE_INITIAL_BUCKETS;
+    cache->Buckets = (CACHEENTRY **)calloc(cache->BucketCount, sizeof(CACHEENTRY *));
+    cache->Count = 0;
+    cache->Newest = NULL;
+    cache->Oldest = NULL;
+    cache->Budget = budget;
+    cache->Used = 0;
+    cache->Hits = 0;
+    cache->Misses = 0;
+    cache->Evictions = 0;
+    
+    return;
+}
+
+// CacheFree:
+// Frees all entries and the hash table of the cache.
+//
+void CacheFree(QUERYCACHE *cache) {
+    
+    CACHEENTRY *cur = cache->Newest;
+    while(cur != NULL) {
+        CACHEENTRY *older = cur->Older;
+        free(cur->Key);
+        free(cur->Value);
+        free(cur);
+        cur = older;
+    }
+    free(cache->Buckets);
+    cache->Buckets = NULL;
+    cache->BucketCount = 0;
+    cache->Count = 0;
+    cache->Newest = NULL;
+    cache->Oldest = NULL;
+    cache->Used = 0;
+    
+    return;
+}
+
+// _CacheHash:
+// Returns FNV-1a hash of the key.
+//
+static unsigned long long _CacheHash(const char *key) {
+    
+    unsigned long long hash = 14695981039346656037ULL;
+    for(; *key != '\0'; key++) {
+        hash ^= (unsigned char)*key;
+        hash *= 1099511628211ULL;
+    }
+    
+    return hash;
+}
+
+// _CacheCost:
+// Returns the number of bytes charged to the budget for the entry.
+//
+static size_t _CacheCost(const char *key, size_t size) {
+    
+    return sizeof(CACHEENTRY) + strlen(key) + 1 + size;
+}
+
+// _CacheUnlink:
+// Removes entry from the least recently used list.
+//
+static void _CacheUnlink(QUERYCACHE *cache, CACHEENTRY *entry) {
+    
+    if(entry->Newer != NULL) {
+        entry->Newer->Older = entry->Older;
+    } else {
+        cache->Newest = entry->Older;
+    }
+    if(entry->Older != NULL) {
+        entry->Older->Newer = entry->Newer;
+    } else {
+        cache->Oldest = entry->Newer;
+    }
+    
+    return;
+}
+
+// _CacheLinkNewest:
+// Links entry at the most recently used end of the list.
+//
+static void _CacheLinkNewest(QUERYCACHE *cache, CACHEENTRY *entry) {
+    
+    entry->Newer = NULL;
+    entry->Older = cache->Newest;
+    if(cache->Newest != NULL) {
+        cache->Newest->Newer = entry;
+    } else {
+        cache->Oldest = entry;
+    }
+    cache->Newest = entry;
+    
+    return;
+}
+
+// _CacheRemove:
+// Removes entry from the cache and frees it.
+//
+static void _CacheRemove(QUERYCACHE *cache, CACHEENTRY *entry) {
+    
+    CACHEENTRY **slot = &cache->Buckets[entry->Hash & (cache->BucketCount - 1)];
+    while(*slot != entry) {
+        slot = &(*slot)->Chain;
+    }
+    *slot = entry->Chain;
+    _CacheUnlink(cache, entry);
+    
+    cache->Count--;
+    cache->Used -= _CacheCost(entry->Key, entry->Size);
+    free(entry->Key);
+    free(entry->Value);
+    free(entry);
+    
+    return;
+}
+
+// _CacheFind:
+// Returns entry with the key, or NULL if not found.
+//
+static CACHEENTRY *_CacheFind(QUERYCACHE *cache, const char *key, unsigned long long hash) {
+    
+    CACHEENTRY *cur = cache->Buckets[hash & (cache->BucketCount - 1)];
+    while(cur != NULL && (cur->Hash != hash || strcmp(cur->Key, key) != 0)) {
+        cur = cur->Chain;
+    }
+    
+    return cur;
+}
+
+// _CacheGrow:
+// Doubles the number of hash buckets and rehashes all entries.
+//
+static void _CacheGrow(QUERYCACHE *cache) {
+    
+    int bucketCount = cache->BucketCount * 2;
+    CACHEENTRY **buckets = (CACHEENTRY **)calloc(bucketCount, sizeof(CACHEENTRY *));
+    
+    for(CACHEENTRY *cur = cache->Newest; cur != NULL; cur = cur->Older) {
+        CACHEENTRY **slot = &buckets[cur->Hash & (bucketCount - 1)];
+        cur->Chain = *slot;
+        *slot = cur;
+    }
+    free(cache->Buckets);
+    cache->Buckets = buckets;
+    cache->BucketCount = bucketCount;
+    
+    return;
+}
+
+// CacheGet:
+// Returns the value stored under key for the data version, and its size in
+// *size, or NULL if there is none. Entries of other versions are dropped.
+// The returned value belongs to the cache and is valid until the next
+// CachePut.
+//
+void *CacheGet(QUERYCACHE *cache, const char *key, unsigned long version, size_t *size) {
+    
+    CACHEENTRY *entry = _CacheFind(cache, key, _CacheHash(key));
+    if(entry != NULL && entry->Version != version) {
+        _CacheRemove(cache, entry);
+        entry = NULL;
+    }
+    if(entry == NULL) {
+        cache->Misses++;
+        return NULL;
+    }
+    
+    cache->Hits++;
+    _CacheUnlink(cache, entry);
+    _CacheLinkNewest(cache, entry);
+    if(size != NULL) {
+        *size = entry->Size;
+    }
+    
+    return entry->Value;
+}
+
+// CachePut:
+// Stores a copy of value under key for the data version, replacing any
+// previous value, and evicts least recently used entries to stay within the
+// budget. Values larger than the whole budget are not stored.
+//
+void CachePut(QUERYCACHE *cache, const char *key, unsigned long version,
+              const void *value, size_t size) {
+
+    unsigned long long hash = _CacheHash(key);
+    CACHEENTRY *entry = _CacheFind(cache, key, hash);
+    if(entry != NULL) {
+        _CacheRemove(cache, entry);
+    }
+
+    size_t cost = _CacheCost(key, size);
+    if(cost > cache->Budget) {
+        return;
+    }
+    while(cache->Used + cost > cache->Budget) {
+        _CacheRemove(cache, cache->Oldest);
+        cache->Evictions++;
+    }
+
+    entry = (CACHEENTRY *)malloc(sizeof(CACHEENTRY));
+    entry->Key = (char *)malloc(strlen(key) + 1);
+    strcpy(entry->Key, key);
+    entry->Hash = hash;
+    entry->Version = version;
+    entry->Value = malloc(size > 0 ? size : 1);
+    if(size > 0) {
+        memcpy(entry->Value, value, size);
+    }
+    entry->Size = size;
+
+    if(cache->Count >= cache->BucketCount) {
+        _CacheGrow(cache);
+    }
+    CACHEENTRY **slot = &cache->Buckets[hash & (cache->BucketCount - 1)];
+    entry->Chain = *slot;
+    *slot = entry;
+    _CacheLinkNewest(cache, entry);
+    cache->Count++;
+    cache->Used += cost;
+
+    return;
+}
+
+// CacheHitRate:
+// Returns the share of lookups that were answered by the cache, in percent.
+//
+double CacheHitRate(QUERYCACHE *cache) {
+    
+    unsigned long lookups = cache->Hits + cache->Misses;
+    
+    return (lookups > 0) ? (double)cache->Hits / (double)lookups * 100 : 0.0;
+}
@@ -0,0 +1,56 @@
+/*cache.h*/
+
+//
+// Query result cache header file.
+//
+
+// make sure this header file is #include exactly once:
+#pragma once
+
+#include <stddef.h>
+
+//
+// QUERYCACHE type declarations:
+//
+// Results of queries are stored under their normalized command text, in a
+// chained hash table whose entries are also linked in least recently used
+// order. Once the entries use more than Budget bytes, the least recently
+// used ones are evicted. Every entry is stamped with the data version it was
+// computed from; an entry with another version is stale and is dropped when
+// it is looked up.
+//
+
+typedef struct CACHEENTRY {
+    char               *Key;
+    unsigned long long  Hash;
+    unsigned long       Version;
+    void               *Value;
+    size_t              Size;
+    struct CACHEENTRY  *Chain;
+    struct CACHEENTRY  *Newer;
+    struct CACHEENTRY  *Older;
+} CACHEENTRY;
+
+typedef struct QUERYCACHE {
+    CACHEENTRY  **Buckets;
+    int           BucketCount;
+    int           Count;
+    CACHEENTRY   *Newest;
+    CACHEENTRY   *Oldest;
+    size_t        Budget;
+    size_t        Used;
+    unsigned long Hits;
+    unsigned long Misses;
+    unsigned long Evictions;
+} QUERYCACHE;
+
+//
+// Cache API: function prototypes
+//
+
+void CacheInit(QUERYCACHE *cache, size_t budget);
+void CacheFree(QUERYCACHE *cache);
+void *CacheGet(QUERYCACHE *cache, const char *key, unsigned long version, size_t *size);
+void CachePut(QUERYCACHE *cache, const char *key, unsigned long version,
+              const void *value, size_t size);
+double CacheHitRate(QUERYCACHE *cache);
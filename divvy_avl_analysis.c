@@ -10,552 +10,3570 @@
 // ignore stdlib warnings if working in Visual Studio:
 #define _CRT_SECURE_NO_WARNINGS 
 
+// POSIX threads and strtok_r() under -std=c11:
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <limits.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
 
 #include "avl.h"
+#include "kdtree.h"
+#include "sketch.h"
+#include "cache.h"
+#include "output.h"
+#include "bitmap.h"
+
+//
+// Activity cube declarations:
+//
+
+#define ACTIVITY_DIRECTIONS 2
+#define ACTIVITY_USERTYPES  2
+#define ACTIVITY_DAYS       7
+#define ACTIVITY_HOURS      24
+#define ACTIVITY_CELLS      (ACTIVITY_DIRECTIONS * ACTIVITY_USERTYPES * \
+                             ACTIVITY_DAYS * ACTIVITY_HOURS)
+
+typedef enum DIRECTION {
+    DEPARTURE,
+    ARRIVAL
+} DIRECTION;
+
+typedef struct DIVVYTIME {
+    int Year;
+    int Month;
+    int Day;
+    int Hour;
+    int Minute;
+    int WeekDay;
+} DIVVYTIME;
+
+// Dense station x direction x user type x weekday x hour counters. Each
+// station owns ACTIVITY_CELLS consecutive counters, so a whole station
+// profile is one contiguous block:
+typedef struct ACTIVITYCUBE {
+    int StationCount;
+    unsigned int *Counts;
+} ACTIVITYCUBE;
+
+//
+// Route statistics declarations:
+//
+
+// Aggregates of all trips from one station to another:
+typedef struct ROUTESTATS {
+    HISTOGRAM Durations;
+    HYPERLOGLOG Bikes;
+    HYPERLOGLOG Riders;
+} ROUTESTATS;
+
+// Open addressing hash table of ROUTESTATS keyed on (from, to) station
+// indexes; Keys[i] < 0 marks an empty slot:
+typedef struct ROUTETABLE {
+    int Capacity;
+    int Count;
+    long long *Keys;
+    ROUTESTATS **Stats;
+} ROUTETABLE;
+
+//
+// Stratified trip sample declarations:
+//
+
+// Destinations sampled per origin station. The estimate's 95% interval
+// is about +-20% for a route of a few hundred trips, and narrows with the
+// square root of the route's trips; +-1% would take every trip:
+#define SAMPLE_PER_STATION 64
+
+// Uniform reservoir sample of the destinations of trips from one station,
+// with the ordinals of the sampled trips; Seen is the number of trips it
+// was drawn from. RemovedIn and RemovedOut count removed trips that were,
+// or were not, in the sample, and are not yet made up for by new trips:
+typedef struct STATIONSAMPLE {
+    unsigned int Seen;
+    unsigned int RemovedIn;
+    unsigned int RemovedOut;
+    int Count;
+    int *Destinations;
+    int *Ordinals;
+} STATIONSAMPLE;
+
+//
+// Zone flow declarations:
+//
+
+#define FLOW_PI               3.14159265
+#define FLOW_MILES_PER_DEGREE 69.17
+#define FLOW_MIN_CELL_MILES   0.01
+#define FLOW_TABLE_INITIAL    1024
+#define FLOW_TOP_PAIRS        10
+
+// Stations bucketed into square cells of CellMiles miles. Cells that hold a
+// station are zones; ZoneCells[zone] is the cell as row << 32 | column,
+// counted from (MinLatitude, MinLongitude):
+typedef struct FLOWGRID {
+    double CellMiles;
+    double MinLatitude;
+    double MinLongitude;
+    double LatitudeStep;
+    double LongitudeStep;
+    int ZoneCount;
+    int *StationZone;
+    long long *ZoneCells;
+    struct FLOWGRID *Next;
+} FLOWGRID;
+
+// Trips from one zone to another:
+typedef struct FLOWCELL {
+    int FromZone;
+    int ToZone;
+    unsigned int Trips;
+} FLOWCELL;
+
+// Open addressing hash table of FLOWCELLs keyed on (from, to) zones; a cell
+// without trips marks an empty slot:
+typedef struct FLOWTABLE {
+    int Capacity;
+    int Count;
+    FLOWCELL *Cells;
+} FLOWTABLE;
+
+//
+// Trip bitmap declarations:
+//
+
+#define BITMAP_FIRST_YEAR 1900
+#define BITMAP_YEARS      130
+#define BITMAP_GENDERS    3
+
+// Bitmaps of trip ordinals by rider attribute and by station index. Trips
+// get ordinals 0, 1, 2, ... in the order they are added to the aggregates:
+typedef struct TRIPBITMAPS {
+    int TripCount;
+    ROARING UserTypes[ACTIVITY_USERTYPES];
+    ROARING Genders[BITMAP_GENDERS];
+    ROARING BirthYears[BITMAP_YEARS];
+    ROARING *Origins;
+    ROARING *Destinations;
+} TRIPBITMAPS;
+
+// Rider attributes a query is restricted to; -1 means any:
+typedef struct TRIPFILTER {
+    int UserType;
+    int Gender;
+    int FirstYear;
+    int LastYear;
+} TRIPFILTER;
+
+// Indexes and aggregates built while the data is loaded. Queries hold Lock
+// for reading; the background writer holds it for writing while it adds a
+// batch of trips to the aggregates:
+typedef struct DIVVYINDEX {
+    ACTIVITYCUBE Activity;
+    KDTree *StationPoints;
+    HISTOGRAM *OriginDurations;
+    ROUTETABLE Routes;
+    STATIONSAMPLE *OriginSamples;
+    unsigned long long SampleRandom;
+    QUERYCACHE Cache;
+    FLOWGRID *FlowGrids;
+    TRIPBITMAPS Bitmaps;
+    pthread_rwlock_t Lock;
+} DIVVYINDEX;
+
+// Default memory budget of the query result cache:
+#define QUERY_CACHE_KB 16384
+
+// Longest normalized command used as a cache key:
+#define QUERY_KEY_LENGTH 128
+
+// Trips added by the background writer between publishes:
+#define INGEST_BATCH 256
+
+static const char *WeekDayNames[ACTIVITY_DAYS] = {
+    "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
+};
+
+
+// FreeStationData:
+// Works with StationAVLFree() to free the data inside station values.
+//
+void FreeStationData(AVLKey key, STATION value) {
+    
+    free(value.StationName);
+    free(value.StationOnlineDate);
+    
+    return;
+}
+
+// FreeTripData:
+// Works with TripAVLFree() to free the data inside trip values.
+//
+void FreeTripData(AVLKey key, TRIP value) {
+    
+    free(value.TripStartTime);
+    free(value.TripStopTime);
+    free(value.TripFromStationName);
+    free(value.TripToStationName);
+    
+    return;
+}
+
+// WeekDay:
+// Returns the day of the week (0 = Sunday) of the given Gregorian date.
+// Reference: Tomohiko Sakamoto's algorithm.
+//
+int WeekDay(int year, int month, int day) {
+    
+    static const int offsets[12] = {0, 3, 2, 5, 0, 3, 5, 1, 4, 6, 2, 4};
+    
+    if(month < 3) {
+        year -= 1;
+    }
+    
+    return (year + year / 4 - year / 100 + year / 400 +
+            offsets[month - 1] + day) % 7;
+}
+
+// ParseDivvyTime:
+// Parses Divvy time stamp such as "6/30/2016 23:57" (or "2016-06-30 23:57:10")
+// into its calendar fields. Returns false if the string is malformed.
+//
+boolean ParseDivvyTime(const char *timeString, DIVVYTIME *time) {
+    
+    int fields = 0;
+    if(strchr(timeString, '-') != NULL) {
+        fields = sscanf(timeString, "%d-%d-%d %d:%d", &time->Year, &time->Month,
+                        &time->Day, &time->Hour, &time->Minute);
+    } else {
+        fields = sscanf(timeString, "%d/%d/%d %d:%d", &time->Month, &time->Day,
+                        &time->Year, &time->Hour, &time->Minute);
+    }
+    
+    if(fields != 5 || time->Month < 1 || time->Month > 12 ||
+       time->Hour < 0 || time->Hour >= ACTIVITY_HOURS) {
+        return false;
+    }
+    time->WeekDay = WeekDay(time->Year, time->Month, time->Day);
+    
+    return true;
+}
+
+// RouteTableInit:
+// Initializes an empty route table.
+//
+void RouteTableInit(ROUTETABLE *table) {
+    
+    table->Capacity = 1024;
+    table->Count = 0;
+    table->Keys = (long long *)malloc(table->Capacity * sizeof(long long));
+    table->Stats = (ROUTESTATS **)calloc(table->Capacity, sizeof(ROUTESTATS *));
+    for(int i = 0; i < table->Capacity; i++) {
+        table->Keys[i] = -1;
+    }
+    
+    return;
+}
+
+// RouteTableFree:
+// Frees the memory associated with the route table.
+//
+void RouteTableFree(ROUTETABLE *table) {
+    
+    for(int i = 0; i < table->Capacity; i++) {
+        if(table->Stats[i] != NULL) {
+            HistFree(&table->Stats[i]->Durations);
+            HLLFree(&table->Stats[i]->Bikes);
+            HLLFree(&table->Stats[i]->Riders);
+            free(table->Stats[i]);
+        }
+    }
+    free(table->Keys);
+    free(table->Stats);
+    
+    return;
+}
+
+// _RouteSlot:
+// Returns the slot of the key in the route table, or the empty slot where it
+// would be inserted.
+//
+int _RouteSlot(ROUTETABLE *table, long long key) {
+    
+    unsigned long long hash = (unsigned long long)key * 0x9E3779B97F4A7C15ULL;
+    int slot = (int)(hash >> 40) & (table->Capacity - 1);
+    while(table->Keys[slot] >= 0 && table->Keys[slot] != key) {
+        slot = (slot + 1) & (table->Capacity - 1);
+    }
+    
+    return slot;
+}
+
+// RouteStatsFind:
+// Returns the statistics of trips from fromIndex to toIndex station, or
+// NULL if there are none.
+//
+ROUTESTATS *RouteStatsFind(ROUTETABLE *table, int fromIndex, int toIndex) {
+    
+    long long key = ((long long)fromIndex << 32) | (unsigned int)toIndex;
+    
+    return table->Stats[_RouteSlot(table, key)];
+}
+
+// RouteStatsGet:
+// Returns the statistics of trips from fromIndex to toIndex station, and
+// creates empty ones first if needed. The table doubles when half full.
+//
+ROUTESTATS *RouteStatsGet(ROUTETABLE *table, int fromIndex, int toIndex) {
+    
+    long long key = ((long long)fromIndex << 32) | (unsigned int)toIndex;
+    int slot = _RouteSlot(table, key);
+    if(table->Stats[slot] != NULL) {
+        return table->Stats[slot];
+    }
+    
+    if(2 * (table->Count + 1) > table->Capacity) {
+        ROUTETABLE grown;
+        grown.Capacity = table->Capacity * 2;
+        grown.Count = table->Count;
+        grown.Keys = (long long *)malloc(grown.Capacity * sizeof(long long));
+        grown.Stats = (ROUTESTATS **)calloc(grown.Capacity, sizeof(ROUTESTATS *));
+        for(int i = 0; i < grown.Capacity; i++) {
+            grown.Keys[i] = -1;
+        }
+        for(int i = 0; i < table->Capacity; i++) {
+            if(table->Stats[i] != NULL) {
+                int newSlot = _RouteSlot(&grown, table->Keys[i]);
+                grown.Keys[newSlot] = table->Keys[i];
+                grown.Stats[newSlot] = table->Stats[i];
+            }
+        }
+        free(table->Keys);
+        free(table->Stats);
+        *table = grown;
+        slot = _RouteSlot(table, key);
+    }
+    
+    ROUTESTATS *stats = (ROUTESTATS *)malloc(sizeof(ROUTESTATS));
+    HistInit(&stats->Durations);
+    HLLInit(&stats->Bikes);
+    HLLInit(&stats->Riders);
+    table->Keys[slot] = key;
+    table->Stats[slot] = stats;
+    table->Count++;
+    
+    return stats;
+}
+
+// DivvyTimeStamp:
+// Returns the time as minutes since 1/1/1970.
+// Reference: Howard Hinnant's days_from_civil algorithm.
+//
+int DivvyTimeStamp(DIVVYTIME *time) {
+    
+    int year = (time->Month <= 2) ? time->Year - 1 : time->Year;
+    int era = (year >= 0 ? year : year - 399) / 400;
+    int yearOfEra = year - era * 400;
+    int dayOfYear = (153 * (time->Month + ((time->Month > 2) ? -3 : 9)) + 2) / 5 +
+                    time->Day - 1;
+    int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    int days = era * 146097 + dayOfEra - 719468;
+    
+    return days * 1440 + time->Hour * 60 + time->Minute;
+}
+
+// FormatDivvyTime:
+// Formats minutes since 1/1/1970 the way Divvy files do, e.g.
+// "6/30/2016 23:57", into text (room for 32 chars).
+// Reference: Howard Hinnant's civil_from_days algorithm.
+//
+void FormatDivvyTime(int stamp, char *text) {
+    
+    int days = stamp / 1440 + 719468;
+    int minutes = stamp % 1440;
+    int era = (days >= 0 ? days : days - 146096) / 146097;
+    int dayOfEra = days - era * 146097;
+    int yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    int dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    int mp = (5 * dayOfYear + 2) / 153;
+    int day = dayOfYear - (153 * mp + 2) / 5 + 1;
+    int month = mp + ((mp < 10) ? 3 : -9);
+    int year = yearOfEra + era * 400 + ((month <= 2) ? 1 : 0);
+    
+    sprintf(text, "%d/%d/%d %d:%02d", month, day, year, minutes / 60, minutes % 60);
+    
+    return;
+}
+
+// FreeFlowGrids:
+// Frees the list of grids.
+//
+void FreeFlowGrids(FLOWGRID *grid) {
+    
+    while(grid != NULL) {
+        FLOWGRID *next = grid->Next;
+        free(grid->StationZone);
+        free(grid->ZoneCells);
+        free(grid);
+        grid = next;
+    }
+    
+    return;
+}
+
+// TripBitmapsInit:
+// Initializes empty trip bitmaps for stationCount stations.
+//
+void TripBitmapsInit(TRIPBITMAPS *bitmaps, int stationCount) {
+    
+    bitmaps->TripCount = 0;
+    for(int i = 0; i < ACTIVITY_USERTYPES; i++) {
+        RoaringInit(&bitmaps->UserTypes[i]);
+    }
+    for(int i = 0; i < BITMAP_GENDERS; i++) {
+        RoaringInit(&bitmaps->Genders[i]);
+    }
+    for(int i = 0; i < BITMAP_YEARS; i++) {
+        RoaringInit(&bitmaps->BirthYears[i]);
+    }
+    bitmaps->Origins = (ROARING *)malloc((stationCount + 1) * sizeof(ROARING));
+    bitmaps->Destinations = (ROARING *)malloc((stationCount + 1) * sizeof(ROARING));
+    for(int i = 0; i < stationCount; i++) {
+        RoaringInit(&bitmaps->Origins[i]);
+        RoaringInit(&bitmaps->Destinations[i]);
+    }
+    
+    return;
+}
+
+// TripBitmapsFree:
+// Frees the memory associated with the trip bitmaps.
+//
+void TripBitmapsFree(TRIPBITMAPS *bitmaps, int stationCount) {
+    
+    for(int i = 0; i < ACTIVITY_USERTYPES; i++) {
+        RoaringFree(&bitmaps->UserTypes[i]);
+    }
+    for(int i = 0; i < BITMAP_GENDERS; i++) {
+        RoaringFree(&bitmaps->Genders[i]);
+    }
+    for(int i = 0; i < BITMAP_YEARS; i++) {
+        RoaringFree(&bitmaps->BirthYears[i]);
+    }
+    for(int i = 0; i < stationCount; i++) {
+        RoaringFree(&bitmaps->Origins[i]);
+        RoaringFree(&bitmaps->Destinations[i]);
+    }
+    free(bitmaps->Origins);
+    free(bitmaps->Destinations);
+    
+    return;
+}
+
+// CreateDivvyIndex:
+// Dynamically creates empty aggregates for stationCount stations, and an
+// empty query result cache of cacheBudget bytes.
+//
+DIVVYINDEX *CreateDivvyIndex(int stationCount, size_t cacheBudget) {
+    
+    DIVVYINDEX *index = (DIVVYINDEX *)malloc(sizeof(DIVVYINDEX));
+    index->Activity.StationCount = stationCount;
+    index->Activity.Counts = (unsigned int *)calloc((size_t)stationCount * ACTIVITY_CELLS,
+                                                    sizeof(unsigned int));
+    index->StationPoints = NULL;
+    index->OriginDurations = (HISTOGRAM *)malloc((stationCount + 1) * sizeof(HISTOGRAM));
+    for(int i = 0; i < stationCount; i++) {
+        HistInit(&index->OriginDurations[i]);
+    }
+    RouteTableInit(&index->Routes);
+    index->OriginSamples = (STATIONSAMPLE *)calloc(stationCount + 1, sizeof(STATIONSAMPLE));
+    index->SampleRandom = 88172645463325252ULL;
+    CacheInit(&index->Cache, cacheBudget);
+    index->FlowGrids = NULL;
+    TripBitmapsInit(&index->Bitmaps, stationCount);
+    pthread_rwlock_init(&index->Lock, NULL);
+    
+    return index;
+}
+
+// FreeDivvyIndex:
+// Frees the memory associated with the aggregates.
+//
+void FreeDivvyIndex(DIVVYINDEX *index) {
+    
+    free(index->Activity.Counts);
+    if(index->StationPoints != NULL) {
+        KDFree(index->StationPoints);
+    }
+    for(int i = 0; i < index->Activity.StationCount; i++) {
+        HistFree(&index->OriginDurations[i]);
+    }
+    free(index->OriginDurations);
+    RouteTableFree(&index->Routes);
+    for(int i = 0; i < index->Activity.StationCount; i++) {
+        free(index->OriginSamples[i].Destinations);
+        free(index->OriginSamples[i].Ordinals);
+    }
+    free(index->OriginSamples);
+    CacheFree(&index->Cache);
+    FreeFlowGrids(index->FlowGrids);
+    TripBitmapsFree(&index->Bitmaps, index->Activity.StationCount);
+    pthread_rwlock_destroy(&index->Lock);
+    free(index);
+    
+    return;
+}
+
+// ActivityCell:
+// Returns the offset of the counter for given station index, direction,
+// user type, weekday and hour inside of the activity cube.
+//
+size_t ActivityCell(int stationIndex, DIRECTION direction, USERTYPE userType,
+                    int weekDay, int hour) {
+    
+    return ((((size_t)stationIndex * ACTIVITY_DIRECTIONS + direction) *
+             ACTIVITY_USERTYPES + userType) * ACTIVITY_DAYS + weekDay) *
+           ACTIVITY_HOURS + hour;
+}
+
+// ActivityAddTrip:
+// Counts trip departure at its from station and arrival at its to station.
+// Station index < 0 means unknown station; unknown stations and malformed
+// times are skipped.
+//
+void ActivityAddTrip(ACTIVITYCUBE *activity, TRIP *trip, int fromIndex, int toIndex) {
+    
+    DIVVYTIME time;
+    if(fromIndex >= 0 && ParseDivvyTime(trip->TripStartTime, &time)) {
+        activity->Counts[ActivityCell(fromIndex, DEPARTURE, trip->TripUserType,
+                                      time.WeekDay, time.Hour)] += 1;
+    }
+    
+    if(toIndex >= 0 && ParseDivvyTime(trip->TripStopTime, &time)) {
+        activity->Counts[ActivityCell(toIndex, ARRIVAL, trip->TripUserType,
+                                      time.WeekDay, time.Hour)] += 1;
+    }
+    
+    return;
+}
+
+// ActivityRemoveTrip:
+// Uncounts trip departure and arrival counted by ActivityAddTrip().
+//
+void ActivityRemoveTrip(ACTIVITYCUBE *activity, TRIP *trip, int fromIndex, int toIndex) {
+    
+    DIVVYTIME time;
+    if(fromIndex >= 0 && ParseDivvyTime(trip->TripStartTime, &time)) {
+        activity->Counts[ActivityCell(fromIndex, DEPARTURE, trip->TripUserType,
+                                      time.WeekDay, time.Hour)] -= 1;
+    }
+    
+    if(toIndex >= 0 && ParseDivvyTime(trip->TripStopTime, &time)) {
+        activity->Counts[ActivityCell(toIndex, ARRIVAL, trip->TripUserType,
+                                      time.WeekDay, time.Hour)] -= 1;
+    }
+    
+    return;
+}
+
+// SampleNextRandom:
+// Advances xorshift64 generator state, and returns the new state.
+//
+unsigned long long SampleNextRandom(unsigned long long *random) {
+    
+    *random ^= *random << 13;
+    *random ^= *random >> 7;
+    *random ^= *random << 17;
+    
+    return *random;
+}
+
+// SampleAddTrip:
+// Offers trip destination to the reservoir sample of its from station
+// (Vitter's algorithm R). While removed trips are not made up for, the new
+// trip takes the place of a removed one instead (random pairing, Gemulla
+// et al.), so the sample stays uniform. random is xorshift64 generator
+// state.
+//
+void SampleAddTrip(STATIONSAMPLE *sample, int toIndex, int ordinal,
+                   unsigned long long *random) {
+    
+    sample->Seen++;
+    if(sample->Destinations == NULL) {
+        sample->Destinations = (int *)malloc(SAMPLE_PER_STATION * sizeof(int));
+        sample->Ordinals = (int *)malloc(SAMPLE_PER_STATION * sizeof(int));
+    }
+    
+    int slot = -1;
+    unsigned int removed = sample->RemovedIn + sample->RemovedOut;
+    if(removed > 0) {
+        if(SampleNextRandom(random) % removed < sample->RemovedIn) {
+            sample->RemovedIn--;
+            slot = sample->Count;
+            sample->Count++;
+        } else {
+            sample->RemovedOut--;
+        }
+    } else if(sample->Count < SAMPLE_PER_STATION) {
+        slot = sample->Count;
+        sample->Count++;
+    } else {
+        unsigned int draw = (unsigned int)(SampleNextRandom(random) % sample->Seen);
+        if(draw < SAMPLE_PER_STATION) {
+            slot = (int)draw;
+        }
+    }
+    
+    if(slot >= 0) {
+        sample->Destinations[slot] = toIndex;
+        sample->Ordinals[slot] = ordinal;
+    }
+    
+    return;
+}
+
+// SampleRemoveTrip:
+// Removes trip from the sample of its from station, if it was sampled. The
+// rest of the sample stays a uniform sample of the remaining trips.
+//
+void SampleRemoveTrip(STATIONSAMPLE *sample, int ordinal) {
+    
+    sample->Seen--;
+    for(int i = 0; i < sample->Count; i++) {
+        if(sample->Ordinals[i] == ordinal) {
+            sample->Count--;
+            sample->Destinations[i] = sample->Destinations[sample->Count];
+            sample->Ordinals[i] = sample->Ordinals[sample->Count];
+            sample->RemovedIn++;
+            return;
+        }
+    }
+    sample->RemovedOut++;
+    
+    return;
+}
+
+// RiderProfile:
+// Returns a key of the rider's user type, gender and birth year. Trips carry
+// no rider identity, so distinct profiles stand in for distinct riders.
+//
+long long RiderProfile(TRIP *trip) {
+    
+    return ((long long)trip->TripUserType << 40) |
+           ((long long)trip->TripUserGenger << 32) |
+           (unsigned int)trip->TripUserBirthYear;
+}
+
+// TripBitmapsAddTrip:
+// Gives trip the next ordinal, and adds it to the bitmaps of its rider
+// attributes and stations.
+//
+void TripBitmapsAddTrip(TRIPBITMAPS *bitmaps, TRIP *trip, int fromIndex, int toIndex) {
+    
+    trip->TripOrdinal = bitmaps->TripCount;
+    bitmaps->TripCount++;
+    
+    unsigned int ordinal = (unsigned int)trip->TripOrdinal;
+    RoaringAdd(&bitmaps->UserTypes[trip->TripUserType], ordinal);
+    RoaringAdd(&bitmaps->Genders[trip->TripUserGenger], ordinal);
+    int year = trip->TripUserBirthYear - BITMAP_FIRST_YEAR;
+    if(year >= 0 && year < BITMAP_YEARS) {
+        RoaringAdd(&bitmaps->BirthYears[year], ordinal);
+    }
+    if(fromIndex >= 0) {
+        RoaringAdd(&bitmaps->Origins[fromIndex], ordinal);
+    }
+    if(toIndex >= 0) {
+        RoaringAdd(&bitmaps->Destinations[toIndex], ordinal);
+    }
+    
+    return;
+}
+
+// TripBitmapsRemoveTrip:
+// Removes trip's ordinal from the bitmaps it was added to. Ordinals are not
+// given out again.
+//
+void TripBitmapsRemoveTrip(TRIPBITMAPS *bitmaps, TRIP *trip, int fromIndex, int toIndex) {
+    
+    unsigned int ordinal = (unsigned int)trip->TripOrdinal;
+    RoaringRemove(&bitmaps->UserTypes[trip->TripUserType], ordinal);
+    RoaringRemove(&bitmaps->Genders[trip->TripUserGenger], ordinal);
+    int year = trip->TripUserBirthYear - BITMAP_FIRST_YEAR;
+    if(year >= 0 && year < BITMAP_YEARS) {
+        RoaringRemove(&bitmaps->BirthYears[year], ordinal);
+    }
+    if(fromIndex >= 0) {
+        RoaringRemove(&bitmaps->Origins[fromIndex], ordinal);
+    }
+    if(toIndex >= 0) {
+        RoaringRemove(&bitmaps->Destinations[toIndex], ordinal);
+    }
+    
+    return;
+}
+
+// TripFilterBitmap:
+// Stores ordinals of the trips whose riders match the filter into riders,
+// by intersecting the bitmaps of the filter's attributes. Birth years of
+// the range are united first.
+//
+void TripFilterBitmap(TRIPBITMAPS *bitmaps, TRIPFILTER *filter, ROARING *riders) {
+    
+    ROARING years;
+    boolean first = true;
+    RoaringInit(riders);
+    
+    if(filter->UserType >= 0) {
+        RoaringOr(riders, &bitmaps->UserTypes[filter->UserType]);
+        first = false;
+    }
+    if(filter->Gender >= 0) {
+        if(first) {
+            RoaringOr(riders, &bitmaps->Genders[filter->Gender]);
+        } else {
+            RoaringAnd(riders, &bitmaps->Genders[filter->Gender]);
+        }
+        first = false;
+    }
+    if(filter->FirstYear >= 0) {
+        RoaringInit(&years);
+        for(int year = filter->FirstYear; year <= filter->LastYear; year++) {
+            if(year >= BITMAP_FIRST_YEAR && year < BITMAP_FIRST_YEAR + BITMAP_YEARS) {
+                RoaringOr(&years, &bitmaps->BirthYears[year - BITMAP_FIRST_YEAR]);
+            }
+        }
+        if(first) {
+            RoaringOr(riders, &years);
+        } else {
+            RoaringAnd(riders, &years);
+        }
+        RoaringFree(&years);
+    }
+    
+    return;
+}
 
+// DivvyIndexAddTrip:
+// Adds trip to all aggregates, and gives it its ordinal.
+//
+void DivvyIndexAddTrip(DIVVYINDEX *index, StationAVL *stations, TRIP *trip) {
+    
+    StationAVLNode *fromStation = StationAVLSearch(stations, trip->TripFromStationID);
+    StationAVLNode *toStation = StationAVLSearch(stations, trip->TripToStationID);
+    int fromIndex = (fromStation != NULL) ? fromStation->Value.StationIndex : -1;
+    int toIndex = (toStation != NULL) ? toStation->Value.StationIndex : -1;
+    
+    ActivityAddTrip(&index->Activity, trip, fromIndex, toIndex);
+    TripBitmapsAddTrip(&index->Bitmaps, trip, fromIndex, toIndex);
+    
+    if(fromIndex >= 0) {
+        HistAdd(&index->OriginDurations[fromIndex], trip->TripDuration);
+        if(toIndex >= 0) {
+            ROUTESTATS *route = RouteStatsGet(&index->Routes, fromIndex, toIndex);
+            HistAdd(&route->Durations, trip->TripDuration);
+            HLLAdd(&route->Bikes, trip->TripBikeID);
+            HLLAdd(&route->Riders, RiderProfile(trip));
+            SampleAddTrip(&index->OriginSamples[fromIndex], toIndex, trip->TripOrdinal,
+                          &index->SampleRandom);
+        }
+    }
+    
+    return;
+}
 
-// DistBetween2Points:
-// Returns the distance in miles between 2 points (lat1, long1) and (lat2, long2).
-// Reference: http://www8.nau.edu/cvm/latlon_formula.html
+// DivvyIndexRemoveTrip:
+// Removes trip from the aggregates. Distinct bike and rider estimates of
+// routes cannot forget a trip, and keep it.
 //
-double DistBetween2Points(double lat1, double long1, double lat2, double long2) {
+void DivvyIndexRemoveTrip(DIVVYINDEX *index, StationAVL *stations, TRIP *trip) {
+    
+    StationAVLNode *fromStation = StationAVLSearch(stations, trip->TripFromStationID);
+    StationAVLNode *toStation = StationAVLSearch(stations, trip->TripToStationID);
+    int fromIndex = (fromStation != NULL) ? fromStation->Value.StationIndex : -1;
+    int toIndex = (toStation != NULL) ? toStation->Value.StationIndex : -1;
+    
+    ActivityRemoveTrip(&index->Activity, trip, fromIndex, toIndex);
+    TripBitmapsRemoveTrip(&index->Bitmaps, trip, fromIndex, toIndex);
+    
+    if(fromIndex >= 0) {
+        HistRemove(&index->OriginDurations[fromIndex], trip->TripDuration);
+        if(toIndex >= 0) {
+            ROUTESTATS *route = RouteStatsFind(&index->Routes, fromIndex, toIndex);
+            if(route != NULL) {
+                HistRemove(&route->Durations, trip->TripDuration);
+            }
+            SampleRemoveTrip(&index->OriginSamples[fromIndex], trip->TripOrdinal);
+        }
+    }
+    
+    return;
+}
+
+// ActivityCount:
+// Returns number of departures or arrivals at station index during given
+// weekday and hour. userType < 0 means all user types together.
+//
+unsigned int ActivityCount(ACTIVITYCUBE *activity, int stationIndex,
+                           DIRECTION direction, int userType, int weekDay, int hour) {
+    
+    if(userType >= 0) {
+        return activity->Counts[ActivityCell(stationIndex, direction,
+                                             (USERTYPE)userType, weekDay, hour)];
+    }
+    
+    return activity->Counts[ActivityCell(stationIndex, direction, SUBSCRIBER, weekDay, hour)] +
+           activity->Counts[ActivityCell(stationIndex, direction, CUSTOMER, weekDay, hour)];
+}
+
+// CompareInts:
+// qsort and bsearch comparator for ints.
+//
+int CompareInts(const void *a, const void *b) {
+    
+    return AVLCompareKeys(*(const int *)a, *(const int *)b);
+}
+
+// FreeBikeData:
+// Works with BikeAVLFree() to free the data inside bike values.
+//
+void FreeBikeData(AVLKey key, BIKE value) {
+    
+    free(value.BikeChain);
+    
+    return;
+}
+
+// FreeStationsLL:
+//
+//
+void FreeStationsLL(StationsLL **root) {
+    
+    StationsLL *cur = *root;
+    StationsLL *del = NULL;
+    while(cur != NULL) {
+        del = cur;
+        cur = cur->next;
+        free(del);
+    }
+    
+    return;
+}
+
+// GetFileName:
+// Inputs a filename from the keyboard, make sure the file can be
+// opened, and returns the filename if so.  If the file cannot be 
+// opened, an error message is output and the program is exited.
+//
+char *GetFileName() {
+    
+    char filename[512];
+    int  fnsize = sizeof(filename) / sizeof(filename[0]);
+
+    // Input filename from the keyboard:
+    fgets(filename, fnsize, stdin);
+    filename[strcspn(filename, "\r\n")] = '\0';  // strip EOL char(s):
+
+    // Make sure filename exists and can be opened:
+    FILE *infile = fopen(filename, "r");
+    if (infile == NULL) {
+        printf("**Error: unable to open '%s'\n\n", filename);
+        exit(-1);
+    }
+
+    fclose(infile);
+
+    // Duplicate and return filename:
+    char *s = (char *)malloc((strlen(filename) + 1) * sizeof(char));
+    strcpy(s, filename);
+
+    return s;
+}
+
+// GetFileNames:
+// Inputs a list of filenames, separated by spaces, from the keyboard and
+// returns them, storing the number of names into count. A line that opens
+// as a file by itself is taken as one filename. If any file cannot be opened,
+// an error message is output and the program is exited.
+//
+char **GetFileNames(int *count) {
+    
+    char line[4096];
+    int  lineSize = sizeof(line) / sizeof(line[0]);
+    
+    // Input filenames from the keyboard:
+    fgets(line, lineSize, stdin);
+    line[strcspn(line, "\r\n")] = '\0';  // strip EOL char(s):
+    
+    char **names = (char **)malloc((strlen(line) / 2 + 2) * sizeof(char *));
+    *count = 0;
+    
+    FILE *infile = fopen(line, "r");
+    if(infile != NULL) {
+        fclose(infile);
+        names[*count] = (char *)malloc((strlen(line) + 1) * sizeof(char));
+        strcpy(names[*count], line);
+        *count += 1;
+        return names;
+    }
+    
+    for(char *name = strtok(line, " \t"); name != NULL; name = strtok(NULL, " \t")) {
+        
+        // Make sure filename exists and can be opened:
+        infile = fopen(name, "r");
+        if (infile == NULL) {
+            printf("**Error: unable to open '%s'\n\n", name);
+            exit(-1);
+        }
+        fclose(infile);
+        
+        names[*count] = (char *)malloc((strlen(name) + 1) * sizeof(char));
+        strcpy(names[*count], name);
+        *count += 1;
+    }
+    
+    if(*count == 0) {
+        printf("**Error: unable to open '%s'\n\n", line);
+        exit(-1);
+    }
+    
+    return names;
+}
+
+// SkipRestOfInput:
+// Inputs and discards the remainder of the current line for the 
+// given input stream, including the EOL character(s).
+//
+void SkipRestOfInput(FILE *stream) {
+    
+    char restOfLine[256];
+    int rolLength = sizeof(restOfLine) / sizeof(restOfLine[0]);
+
+    fgets(restOfLine, rolLength, stream);
+    
+    return;
+}
+
+// GetRestOfInput:
+// Inputs the remainder of the current line for the given input stream,
+// without the EOL character(s).
+//
+void GetRestOfInput(FILE *stream, char *restOfLine, int rolLength) {
+    
+    restOfLine[0] = '\0';
+    fgets(restOfLine, rolLength, stream);
+    restOfLine[strcspn(restOfLine, "\r\n")] = '\0';
+    
+    return;
+}
+
+// GetRestOfInputInts:
+// Inputs the remainder of the current line for the given input stream as a
+// list of ints, including the EOL character(s). Words that are not numbers
+// are skipped. Returns dynamically allocated list, and its length in *count.
+//
+int *GetRestOfInputInts(FILE *stream, int *count) {
+    
+    int capacity = 16;
+    int *values = (int *)malloc(capacity * sizeof(int));
+    int c;
+    
+    *count = 0;
+    while((c = getc(stream)) != EOF && c != '\n') {
+        if(c == ' ' || c == '\t' || c == '\r' || c == ',') {
+            continue;
+        }
+        ungetc(c, stream);
+        
+        int value;
+        if(fscanf(stream, "%d", &value) == 1) {
+            if(*count == capacity) {
+                capacity *= 2;
+                values = (int *)realloc(values, capacity * sizeof(int));
+            }
+            values[(*count)++] = value;
+            continue;
+        }
+        
+        // Skip the word that is not a number:
+        while((c = getc(stream)) != EOF && c != '\n' && c != ' ' && c != '\t') {
+        }
+        if(c == EOF || c == '\n') {
+            break;
+        }
+    }
+    
+    return values;
+}
+
+// ParseUserTypeFilter:
+// Returns SUBSCRIBER or CUSTOMER if options mention the user type, or -1
+// when all user types are requested.
+//
+int ParseUserTypeFilter(const char *options) {
+    
+    if(strstr(options, "subscriber") != NULL) {
+        return SUBSCRIBER;
+    } else if(strstr(options, "customer") != NULL) {
+        return CUSTOMER;
+    }
+    
+    return -1;
+}
+
+// ParseTripFilter:
+// Parses rider attributes from options: subscriber or customer, male,
+// female or unknown, and a birth year or range of years such as 1980-1990.
+// Other words are skipped. Returns true if any attribute was given.
+//
+boolean ParseTripFilter(const char *options, TRIPFILTER *filter) {
+    
+    char words[256];
+    char *save = NULL;
+    filter->UserType = -1;
+    filter->Gender = -1;
+    filter->FirstYear = -1;
+    filter->LastYear = -1;
+    
+    strncpy(words, options, sizeof(words) - 1);
+    words[sizeof(words) - 1] = '\0';
+    for(char *word = strtok_r(words, " \t", &save); word != NULL;
+        word = strtok_r(NULL, " \t", &save)) {
+        int firstYear = 0;
+        int lastYear = 0;
+        if(strcmp(word, "subscriber") == 0) {
+            filter->UserType = SUBSCRIBER;
+        } else if(strcmp(word, "customer") == 0) {
+            filter->UserType = CUSTOMER;
+        } else if(strcmp(word, "male") == 0) {
+            filter->Gender = MALE;
+        } else if(strcmp(word, "female") == 0) {
+            filter->Gender = FEMALE;
+        } else if(strcmp(word, "unknown") == 0) {
+            filter->Gender = UNKNOWN;
+        } else if(sscanf(word, "%d-%d", &firstYear, &lastYear) == 2) {
+            filter->FirstYear = firstYear;
+            filter->LastYear = lastYear;
+        } else if(sscanf(word, "%d", &firstYear) == 1) {
+            filter->FirstYear = firstYear;
+            filter->LastYear = firstYear;
+        }
+    }
+    
+    return filter->UserType >= 0 || filter->Gender >= 0 || filter->FirstYear >= 0;
+}
+
+// FormatTripFilter:
+// Stores the rider attributes of the filter as words, e.g.
+// "subscriber female 1980-1990".
+//
+void FormatTripFilter(TRIPFILTER *filter, char *text, int textLength) {
+    
+    static const char *userTypes[ACTIVITY_USERTYPES] = {"subscriber", "customer"};
+    static const char *genders[BITMAP_GENDERS] = {"male", "female", "unknown"};
+    int length = 0;
+    
+    text[0] = '\0';
+    if(filter->UserType >= 0) {
+        length += snprintf(text + length, textLength - length, "%s ",
+                           userTypes[filter->UserType]);
+    }
+    if(filter->Gender >= 0 && length < textLength) {
+        length += snprintf(text + length, textLength - length, "%s ",
+                           genders[filter->Gender]);
+    }
+    if(filter->FirstYear >= 0 && length < textLength) {
+        if(filter->FirstYear == filter->LastYear) {
+            length += snprintf(text + length, textLength - length, "%d ", filter->FirstYear);
+        } else {
+            length += snprintf(text + length, textLength - length, "%d-%d ",
+                               filter->FirstYear, filter->LastYear);
+        }
+    }
+    if(length > 0 && length <= textLength) {
+        text[length - 1] = '\0';
+    }
+    
+    return;
+}
+
+// PopulateStations:
+// Read each record from stationsFileName csv file and build stations
+// AVL tree.
+//
+void PopulateStations(char *stationsFileName, StationAVL *stations) {
+    
+    char tempString[512];
+    int tempStringLength = sizeof(tempString)/sizeof(tempString[0]);
+    char tData[256];
+    
+    // Open File and read its data:
+    FILE *file = fopen(stationsFileName, "r");
+    
+    // Read and ignore first line of the input file:
+    fgets(tempString, tempStringLength, file);
+    
+    // Read,parse and insert into AVL tree the rest of the input file:
+    fgets(tempString, tempStringLength, file);
+    
+    while (!feof(file)) {
+        
+        STATION stationValue;
+        stationValue.StationID = atoi(strtok(tempString, ","));
+        strcpy(tData, strtok(NULL, ","));
+        stationValue.StationName = (char *)malloc((strlen(tData) + 1) * sizeof(char));
+        strcpy(stationValue.StationName, tData);
+        stationValue.StationLatitude = atof(strtok(NULL, ","));
+        stationValue.StationLongitude = atof(strtok(NULL, ","));
+        stationValue.StationDPCapacity = atoi(strtok(NULL, ","));
+        strcpy(tData, strtok(NULL, "\r\n"));
+        stationValue.StationOnlineDate = (char *)malloc((strlen(tData) + 1) * sizeof(char));
+        strcpy(stationValue.StationOnlineDate, tData);
+        stationValue.StationIndex = StationAVLCount(stations);
+
+        StationAVLInsert(stations, stationValue.StationID, stationValue);
+        
+        fgets(tempString, tempStringLength, file);
+    }
+    
+    fclose(file);
+    free(stationsFileName);
+    
+    return;
+}
+
+// PopulateTripsAnsBikes:
+// Read each record from tripsFileName csv file and build trips and bikes
+// AVL trees. Uses strtok_r(), since several files are loaded at once.
+//
+void PopulateTripsAnsBikes(char *tripsFileName, TripAVL *trips, BikeAVL *bikes) {
+    
+    char tempString[512];
+    int tempStringLength = sizeof(tempString)/sizeof(tempString[0]);
+    char tData[256];
+    char *save = NULL;
+    
+    // Open File and read its data:
+    FILE *file = fopen(tripsFileName, "r");
+    
+    // Read and ignore first line of the input file:
+    fgets(tempString, tempStringLength, file);
+    
+    // Read,parse and insert into AVL tree the rest of the input file:
+    fgets(tempString, tempStringLength, file);
+    while (!feof(file)) {
+        
+        // Create and instert into AVL tree each trip data:
+        TRIP tripValue;
+        tripValue.TripID = atoi(strtok_r(tempString, ",", &save));
+        tripValue.TripOrdinal = -1;
+        strcpy(tData, strtok_r(NULL, ",", &save));
+        tripValue.TripStartTime = (char *)malloc((strlen(tData) + 1) * sizeof(char));
+        strcpy(tripValue.TripStartTime, tData);
+        strcpy(tData, strtok_r(NULL, ",", &save));
+        tripValue.TripStopTime = (char *)malloc((strlen(tData) + 1) * sizeof(char));
+        strcpy(tripValue.TripStopTime, tData);
+        tripValue.TripBikeID = atoi(strtok_r(NULL, ",", &save));
+        tripValue.TripDuration = atoi(strtok_r(NULL, ",", &save));
+        tripValue.TripFromStationID = atoi(strtok_r(NULL, ",", &save));
+        strcpy(tData, strtok_r(NULL, ",", &save));
+        tripValue.TripFromStationName = (char *)malloc((strlen(tData) + 1) * sizeof(char));
+        strcpy(tripValue.TripFromStationName, tData);
+        tripValue.TripToStationID = atoi(strtok_r(NULL, ",", &save));
+        strcpy(tData, strtok_r(NULL, ",", &save));
+        tripValue.TripToStationName = (char *)malloc((strlen(tData) + 1) * sizeof(char));
+        strcpy(tripValue.TripToStationName, tData);
+        tripValue.TripUserType = (strcmp(strtok_r(NULL, ",", &save), "Subscriber")) ? CUSTOMER : SUBSCRIBER;
+        strcpy(tData, strtok_r(NULL, ",", &save));
+        if(tData[0] == '\r' || tData[0] == '\n') {
+            tripValue.TripUserGenger = UNKNOWN;
+            tripValue.TripUserBirthYear = -1;
+        } else if(tData[0] == 'M' || tData[0] == 'F'){
+            tripValue.TripUserGenger = (strncmp(tData, "Male", 4)) ? FEMALE : MALE;
+            char *birthYear = strtok_r(NULL, "\r\n", &save);
+            tripValue.TripUserBirthYear = (birthYear != NULL) ? atoi(birthYear) : -1;
+        } else if(tData[0] == '1' || tData[0] == '2') {
+            tripValue.TripUserGenger = UNKNOWN;
+            tripValue.TripUserBirthYear = atoi(tData);
+        } else {
+            tripValue.TripUserGenger = UNKNOWN;
+            tripValue.TripUserBirthYear = -1;
+        }
+        
+        // A trip listed twice is counted once:
+        if(!TripAVLInsert(trips, tripValue.TripID, tripValue)) {
+            FreeTripData(tripValue.TripID, tripValue);
+            fgets(tempString, tempStringLength, file);
+            continue;
+        }
+        
+        // Create and instert into AVL tree each bike data:
+        BIKE bikeValue;
+        bikeValue.BikeID = tripValue.TripBikeID;
+        bikeValue.BikeTripCount = 1;
+        bikeValue.BikeChainLength = 0;
+        bikeValue.BikeChainCapacity = 0;
+        bikeValue.BikeChain = NULL;
+        
+        if(!BikeAVLInsert(bikes, bikeValue.BikeID, bikeValue)) {
+            BikeAVLNode *tBike = BikeAVLSearch(bikes, bikeValue.BikeID);
+            tBike->Value.BikeTripCount += 1;
+        }
+        
+        fgets(tempString, tempStringLength, file);
+    }
+    
+    fclose(file);
+    free(tripsFileName);
+    
+    return;
+}
+
+// TRIPLOADJOB:
+// One trips file loaded on its own thread into its own trees.
+//
+typedef struct TRIPLOADJOB {
+    char *FileName;
+    TripAVL *Trips;
+    BikeAVL *Bikes;
+} TRIPLOADJOB;
+
+// _PopulateTripsJob:
+// Thread body that loads one trips file.
+//
+void *_PopulateTripsJob(void *arg) {
+    
+    TRIPLOADJOB *job = (TRIPLOADJOB *)arg;
+    PopulateTripsAnsBikes(job->FileName, job->Trips, job->Bikes);
+    
+    return NULL;
+}
+
+// MergeTrips:
+// AVLUnion merger for trips: the same trip in several files is kept once.
+//
+void MergeTrips(void *kept, void *duplicate) {
+    
+    TripAVLNode *trip = (TripAVLNode *)duplicate;
+    FreeTripData(trip->Links.Key, trip->Value);
+    
+    return;
+}
+
+// MergeBikes:
+// AVLUnion merger for bikes: trip counts of the same bike are added up.
+// Trips in several files are counted again by RecountBikeTrips().
+//
+void MergeBikes(void *kept, void *duplicate) {
+    
+    ((BikeAVLNode *)kept)->Value.BikeTripCount += ((BikeAVLNode *)duplicate)->Value.BikeTripCount;
+    
+    return;
+}
+
+// _ClearBikeTrips:
+// BikeAVLForEach callback that sets the bike's trip count to 0.
+//
+void _ClearBikeTrips(void *node, void *arg) {
+    
+    ((BikeAVLNode *)node)->Value.BikeTripCount = 0;
+    
+    return;
+}
+
+// _CountBikeTrip:
+// TripAVLForEach callback that counts the trip for its bike.
+//
+void _CountBikeTrip(void *node, void *arg) {
+    
+    TRIP *trip = &((TripAVLNode *)node)->Value;
+    BikeAVLSearch((BikeAVL *)arg, trip->TripBikeID)->Value.BikeTripCount++;
+    
+    return;
+}
+
+// RecountBikeTrips:
+// Counts trips of every bike again from the trips tree, after files that
+// shared trips were united.
+//
+void RecountBikeTrips(TripAVL *trips, BikeAVL *bikes) {
+    
+    BikeAVLForEach(bikes, _ClearBikeTrips, NULL);
+    TripAVLForEach(trips, _CountBikeTrip, bikes);
+    
+    return;
+}
+
+// PopulateTrips:
+// Loads every trips file into its own trips and bikes trees in parallel,
+// then unions them into trips and bikes trees. Frees the filenames.
+//
+void PopulateTrips(char **tripsFileNames, int fileCount, TripAVL *trips, BikeAVL *bikes) {
+    
+    TRIPLOADJOB *jobs = (TRIPLOADJOB *)malloc(fileCount * sizeof(TRIPLOADJOB));
+    pthread_t *threads = (pthread_t *)malloc(fileCount * sizeof(pthread_t));
+    
+    // The first file is loaded by this thread:
+    jobs[0].FileName = tripsFileNames[0];
+    jobs[0].Trips = trips;
+    jobs[0].Bikes = bikes;
+    for(int i = 1; i < fileCount; i++) {
+        jobs[i].FileName = tripsFileNames[i];
+        jobs[i].Trips = TripAVLCreate();
+        jobs[i].Bikes = BikeAVLCreate();
+        pthread_create(&threads[i], NULL, _PopulateTripsJob, &jobs[i]);
+    }
+    _PopulateTripsJob(&jobs[0]);
+    
+    for(int i = 1; i < fileCount; i++) {
+        pthread_join(threads[i], NULL);
+        TripAVLUnion(trips, jobs[i].Trips, MergeTrips);
+        BikeAVLUnion(bikes, jobs[i].Bikes, MergeBikes);
+    }
+    if(fileCount > 1) {
+        RecountBikeTrips(trips, bikes);
+    }
+    
+    free(threads);
+    free(jobs);
+    free(tripsFileNames);
+    
+    return;
+}
+
+// BikeChainAddTrip:
+// Appends trip to the bike's trip chain, keeping the chain ordered by start
+// time. Trips come in trip ID order, which is nearly chronological, so the
+// new link rarely moves back more than a few places. Trips with malformed
+// start time are skipped. The chain must not be shared with readers.
+//
+void BikeChainAddTrip(BIKE *bike, TRIP *trip) {
+    
+    DIVVYTIME time;
+    if(!ParseDivvyTime(trip->TripStartTime, &time)) {
+        return;
+    }
+    
+    // Loaded bikes get room for all of their trips at once; chains of
+    // ingested trips double:
+    if(bike->BikeChainLength == bike->BikeChainCapacity) {
+        bike->BikeChainCapacity = (bike->BikeChainCapacity > 0) ?
+                                  bike->BikeChainCapacity * 2 : bike->BikeTripCount;
+        if(bike->BikeChainCapacity <= bike->BikeChainLength) {
+            bike->BikeChainCapacity = bike->BikeChainLength + 1;
+        }
+        bike->BikeChain = (BIKETRIP *)realloc(bike->BikeChain,
+                                              bike->BikeChainCapacity * sizeof(BIKETRIP));
+    }
+    
+    BIKETRIP link;
+    link.StartStamp = DivvyTimeStamp(&time);
+    link.TripID = trip->TripID;
+    link.FromStationID = trip->TripFromStationID;
+    link.ToStationID = trip->TripToStationID;
+    
+    int i = bike->BikeChainLength;
+    while(i > 0 && bike->BikeChain[i - 1].StartStamp > link.StartStamp) {
+        bike->BikeChain[i] = bike->BikeChain[i - 1];
+        i--;
+    }
+    bike->BikeChain[i] = link;
+    bike->BikeChainLength++;
+    
+    return;
+}
+
+// _IndexAddTripNode:
+// TripAVLForEach callback that adds trip node to the aggregates.
+//
+void _IndexAddTripNode(void *node, void *arg) {
+    
+    void **args = (void **)arg;
+    TRIP *trip = &((TripAVLNode *)node)->Value;
+    DivvyIndexAddTrip((DIVVYINDEX *)args[0], (StationAVL *)args[1], trip);
+    
+    BikeAVLNode *bike = BikeAVLSearch((BikeAVL *)args[2], trip->TripBikeID);
+    BikeChainAddTrip(&bike->Value, trip);
+    
+    return;
+}
+
+// _CollectStationPoint:
+// StationAVLForEach callback that stores station coordinates into the array,
+// at the station's index.
+//
+void _CollectStationPoint(void *node, void *arg) {
+    
+    StationAVLNode *station = (StationAVLNode *)node;
+    KDPoint *point = &((KDPoint *)arg)[station->Value.StationIndex];
+    point->ID = station->Value.StationID;
+    point->Latitude = station->Value.StationLatitude;
+    point->Longitude = station->Value.StationLongitude;
+    
+    return;
+}
+
+// BuildDivvyIndex:
+// Builds the station coordinates index, and fills the aggregates and bike
+// trip chains from the loaded trips in one pass over trips tree.
+//
+void BuildDivvyIndex(DIVVYINDEX *index, StationAVL *stations, TripAVL *trips,
+                     BikeAVL *bikes) {
+    
+    int stationCount = StationAVLCount(stations);
+    KDPoint *points = (KDPoint *)malloc((stationCount + 1) * sizeof(KDPoint));
+    StationAVLForEach(stations, _CollectStationPoint, points);
+    index->StationPoints = KDCreate(points, stationCount);
+    free(points);
+    
+    void *args[3] = {index, stations, bikes};
+    TripAVLForEach(trips, _IndexAddTripNode, args);
+    
+    return;
+}
+
+// INGESTJOB:
+// Trips file added by a background writer while queries run. New trips are
+// added to the trees, bike chains and aggregates in batches; every batch is
+// published to readers at once. With a retention window, the writer then
+// evicts trips that started more than RetainDays before the newest trip,
+// also in published batches.
+//
+typedef struct INGESTJOB {
+    pthread_t   Thread;
+    boolean     Started;
+    atomic_int  Running;
+    atomic_int  Added;
+    atomic_int  Skipped;
+    atomic_int  Evicted;
+    int         RetainDays;
+    char       *FileName;
+    StationAVL *Stations;
+    TripAVL    *Trips;
+    BikeAVL    *Bikes;
+    DIVVYINDEX *Index;
+    TRIP       *Batch[INGEST_BATCH];
+    int         BatchCount;
+} INGESTJOB;
+
+// _IngestPublish:
+// Adds the batch of new trips to the aggregates, and publishes the changed
+// trees, while readers are locked out.
+//
+void _IngestPublish(INGESTJOB *job) {
+    
+    pthread_rwlock_wrlock(&job->Index->Lock);
+    for(int i = 0; i < job->BatchCount; i++) {
+        DivvyIndexAddTrip(job->Index, job->Stations, job->Batch[i]);
+    }
+    TripAVLPublish(job->Trips);
+    BikeAVLPublish(job->Bikes);
+    pthread_rwlock_unlock(&job->Index->Lock);
+    
+    atomic_fetch_add(&job->Added, job->BatchCount);
+    job->BatchCount = 0;
+    
+    return;
+}
+
+// _IngestTripNode:
+// TripAVLForEach callback that adds trip of the loaded file to the trees.
+// Trips already in the trees are skipped. The bike's chain is copied
+// before it is changed if readers may still see it, i.e. once per bike
+// and batch; the copy grows in place until the batch is published.
+//
+void _IngestTripNode(void *node, void *arg) {
+    
+    INGESTJOB *job = (INGESTJOB *)arg;
+    TRIP *trip = &((TripAVLNode *)node)->Value;
+    if(!TripAVLInsert(job->Trips, trip->TripID, *trip)) {
+        FreeTripData(trip->TripID, *trip);
+        atomic_fetch_add(&job->Skipped, 1);
+        return;
+    }
+    
+    BikeAVLNode *bike = BikeAVLModify(job->Bikes, trip->TripBikeID);
+    if(bike == NULL) {
+        BIKE bikeValue;
+        bikeValue.BikeID = trip->TripBikeID;
+        bikeValue.BikeTripCount = 0;
+        bikeValue.BikeChainLength = 0;
+        bikeValue.BikeChainCapacity = 0;
+        bikeValue.BikeChain = NULL;
+        BikeAVLInsert(job->Bikes, bikeValue.BikeID, bikeValue);
+        bike = BikeAVLSearch(job->Bikes, bikeValue.BikeID);
+    }
+    BIKETRIP *chain = bike->Value.BikeChain;
+    if(chain != NULL && BikeAVLIsShared(job->Bikes, chain)) {
+        bike->Value.BikeChain = (BIKETRIP *)malloc(bike->Value.BikeChainCapacity *
+                                                   sizeof(BIKETRIP));
+        memcpy(bike->Value.BikeChain, chain, bike->Value.BikeChainLength * sizeof(BIKETRIP));
+        BikeAVLRetire(job->Bikes, chain);
+        BikeAVLMarkFresh(job->Bikes, bike->Value.BikeChain);
+    }
+    bike->Value.BikeTripCount++;
+    chain = bike->Value.BikeChain;
+    BikeChainAddTrip(&bike->Value, trip);
+    if(bike->Value.BikeChain != chain) {
+        BikeAVLMarkFresh(job->Bikes, bike->Value.BikeChain);
+    }
+    
+    // New nodes are not copied again before the batch is published:
+    job->Batch[job->BatchCount] = &TripAVLSearch(job->Trips, trip->TripID)->Value;
+    job->BatchCount++;
+    if(job->BatchCount == INGEST_BATCH) {
+        _IngestPublish(job);
+    }
+    
+    return;
+}
+
+// EVICTION:
+// Trips the background writer evicts, grouped by bike. Every bike's chain
+// is ordered by start time, so its evicted trips are a prefix of the chain.
+//
+typedef struct EVICTION {
+    int  Cutoff;
+    int  BikeCount;
+    int  BikeCapacity;
+    int *BikeIDs;
+    int *TripCounts;
+    TRIP *Batch;
+    int  BatchCount;
+    int  BatchCapacity;
+} EVICTION;
+
+// _NewestStartVisit:
+// BikeAVLForEach callback that finds the latest trip start of all chains.
+//
+void _NewestStartVisit(void *node, void *arg) {
+    
+    BIKE *bike = &((BikeAVLNode *)node)->Value;
+    int *newest = (int *)arg;
+    if(bike->BikeChainLength > 0 &&
+       bike->BikeChain[bike->BikeChainLength - 1].StartStamp > *newest) {
+        *newest = bike->BikeChain[bike->BikeChainLength - 1].StartStamp;
+    }
+    
+    return;
+}
+
+// _EvictBikeVisit:
+// BikeAVLForEach callback that counts the trips of the bike that started
+// before the cutoff.
+//
+void _EvictBikeVisit(void *node, void *arg) {
+    
+    BIKE *bike = &((BikeAVLNode *)node)->Value;
+    EVICTION *eviction = (EVICTION *)arg;
+    int count = 0;
+    while(count < bike->BikeChainLength &&
+          bike->BikeChain[count].StartStamp < eviction->Cutoff) {
+        count++;
+    }
+    if(count == 0) {
+        return;
+    }
+    
+    if(eviction->BikeCount == eviction->BikeCapacity) {
+        eviction->BikeCapacity = (eviction->BikeCapacity > 0) ? eviction->BikeCapacity * 2 : 64;
+        eviction->BikeIDs = (int *)realloc(eviction->BikeIDs,
+                                           eviction->BikeCapacity * sizeof(int));
+        eviction->TripCounts = (int *)realloc(eviction->TripCounts,
+                                              eviction->BikeCapacity * sizeof(int));
+    }
+    eviction->BikeIDs[eviction->BikeCount] = bike->BikeID;
+    eviction->TripCounts[eviction->BikeCount] = count;
+    eviction->BikeCount++;
+    
+    return;
+}
+
+// _EvictPublish:
+// Removes the batch of evicted trips from the aggregates, and publishes the
+// changed trees, while readers are locked out. Strings of the trips are
+// retired, since readers of older trees may still use them.
+//
+void _EvictPublish(INGESTJOB *job, EVICTION *eviction) {
+    
+    pthread_rwlock_wrlock(&job->Index->Lock);
+    for(int i = 0; i < eviction->BatchCount; i++) {
+        DivvyIndexRemoveTrip(job->Index, job->Stations, &eviction->Batch[i]);
+        TripAVLRetire(job->Trips, eviction->Batch[i].TripStartTime);
+        TripAVLRetire(job->Trips, eviction->Batch[i].TripStopTime);
+        TripAVLRetire(job->Trips, eviction->Batch[i].TripFromStationName);
+        TripAVLRetire(job->Trips, eviction->Batch[i].TripToStationName);
+    }
+    TripAVLPublish(job->Trips);
+    BikeAVLPublish(job->Bikes);
+    pthread_rwlock_unlock(&job->Index->Lock);
+    
+    atomic_fetch_add(&job->Evicted, eviction->BatchCount);
+    eviction->BatchCount = 0;
+    
+    return;
+}
+
+// _EvictBikeTrips:
+// Evicts the first count trips of the bike's chain: they are deleted from
+// the trips tree into the batch, and the rest of the chain moves to the
+// front, or to a copy if readers may still see the chain. A bike whose
+// chain is left empty is deleted.
+//
+void _EvictBikeTrips(INGESTJOB *job, EVICTION *eviction, int bikeID, int count) {
+    
+    BikeAVLNode *bike = BikeAVLModify(job->Bikes, bikeID);
+    BIKETRIP *chain = bike->Value.BikeChain;
+    
+    if(eviction->BatchCount + count > eviction->BatchCapacity) {
+        eviction->BatchCapacity = eviction->BatchCount + count + INGEST_BATCH;
+        eviction->Batch = (TRIP *)realloc(eviction->Batch,
+                                          eviction->BatchCapacity * sizeof(TRIP));
+    }
+    for(int i = 0; i < count; i++) {
+        if(TripAVLDelete(job->Trips, chain[i].TripID, &eviction->Batch[eviction->BatchCount])) {
+            eviction->BatchCount++;
+        }
+    }
+    
+    bike->Value.BikeTripCount -= count;
+    bike->Value.BikeChainLength -= count;
+    if(bike->Value.BikeChainLength == 0) {
+        BIKE value;
+        BikeAVLDelete(job->Bikes, bikeID, &value);
+        BikeAVLRetire(job->Bikes, chain);
+    } else if(BikeAVLIsShared(job->Bikes, chain)) {
+        bike->Value.BikeChainCapacity = bike->Value.BikeChainLength;
+        bike->Value.BikeChain = (BIKETRIP *)malloc(bike->Value.BikeChainLength * sizeof(BIKETRIP));
+        memcpy(bike->Value.BikeChain, chain + count,
+               bike->Value.BikeChainLength * sizeof(BIKETRIP));
+        BikeAVLRetire(job->Bikes, chain);
+        BikeAVLMarkFresh(job->Bikes, bike->Value.BikeChain);
+    } else {
+        memmove(chain, chain + count, bike->Value.BikeChainLength * sizeof(BIKETRIP));
+    }
+    
+    // Trips of a bike are published together:
+    if(eviction->BatchCount >= INGEST_BATCH) {
+        _EvictPublish(job, eviction);
+    }
+    
+    return;
+}
+
+// _EvictOldTrips:
+// Evicts trips that started more than RetainDays days before the newest
+// trip. Trips with malformed start time are not in bike chains, and are
+// kept.
+//
+void _EvictOldTrips(INGESTJOB *job) {
+    
+    EVICTION eviction;
+    memset(&eviction, 0, sizeof(EVICTION));
+    
+    int newest = INT_MIN;
+    BikeAVLForEach(job->Bikes, _NewestStartVisit, &newest);
+    if(newest == INT_MIN) {
+        return;
+    }
+    
+    // A window reaching back before any possible start time keeps all trips:
+    long long cutoff = (long long)newest - (long long)job->RetainDays * 1440;
+    if(cutoff <= INT_MIN) {
+        return;
+    }
+    eviction.Cutoff = (int)cutoff;
+    BikeAVLForEach(job->Bikes, _EvictBikeVisit, &eviction);
+    
+    for(int i = 0; i < eviction.BikeCount; i++) {
+        _EvictBikeTrips(job, &eviction, eviction.BikeIDs[i], eviction.TripCounts[i]);
+    }
+    if(eviction.BatchCount > 0 || eviction.BikeCount > 0) {
+        _EvictPublish(job, &eviction);
+    }
+    
+    free(eviction.BikeIDs);
+    free(eviction.TripCounts);
+    free(eviction.Batch);
+    
+    // Memory of evicted nodes was freed once readers let go of it; give the
+    // free pages back to the system:
+#if defined(__GLIBC__)
+    malloc_trim(0);
+#endif
+    
+    return;
+}
+
+// _IngestJob:
+// Thread body of the background writer: loads the trips file, if any, into
+// trees of its own, then adds the trips in batches, and finally evicts
+// trips outside of the retention window. Frees the filename.
+//
+void *_IngestJob(void *arg) {
+    
+    INGESTJOB *job = (INGESTJOB *)arg;
+    if(job->FileName != NULL) {
+        TripAVL *trips = TripAVLCreate();
+        BikeAVL *bikes = BikeAVLCreate();
+        PopulateTripsAnsBikes(job->FileName, trips, bikes);
+        job->FileName = NULL;
+        
+        job->BatchCount = 0;
+        TripAVLForEach(trips, _IngestTripNode, job);
+        if(job->BatchCount > 0) {
+            _IngestPublish(job);
+        }
+        
+        // Trip data now belongs to the trips tree, or was freed if skipped:
+        TripAVLFree(trips, NULL);
+        BikeAVLFree(bikes, NULL);
+    }
+    
+    if(job->RetainDays > 0) {
+        _EvictOldTrips(job);
+    }
+    atomic_store(&job->Running, false);
+    
+    return NULL;
+}
+
+// _StartWriter:
+// Starts the background writer for the file, or for eviction only if
+// fileName is NULL. The previous writer must have finished.
+//
+void _StartWriter(INGESTJOB *job, const char *fileName, StationAVL *stations,
+                  TripAVL *trips, BikeAVL *bikes, DIVVYINDEX *index) {
+    
+    if(job->Started) {
+        pthread_join(job->Thread, NULL);
+    }
+    job->FileName = NULL;
+    if(fileName != NULL) {
+        job->FileName = (char *)malloc((strlen(fileName) + 1) * sizeof(char));
+        strcpy(job->FileName, fileName);
+    }
+    job->Stations = stations;
+    job->Trips = trips;
+    job->Bikes = bikes;
+    job->Index = index;
+    atomic_store(&job->Running, true);
+    atomic_store(&job->Added, 0);
+    atomic_store(&job->Skipped, 0);
+    atomic_store(&job->Evicted, 0);
+    job->Started = true;
+    pthread_create(&job->Thread, NULL, _IngestJob, job);
+    
+    return;
+}
+
+// StartIngest:
+// Starts adding trips of the file in the background, unless the previous
+// file is still being added.
+//
+void StartIngest(INGESTJOB *job, const char *fileName, StationAVL *stations,
+                 TripAVL *trips, BikeAVL *bikes, DIVVYINDEX *index) {
+    
+    if(job->Started && atomic_load(&job->Running)) {
+        OutPrintf("**ingest is running, try again later...\n");
+        return;
+    }
+    
+    FILE *file = fopen(fileName, "r");
+    if(file == NULL) {
+        OutPrintf("**Error: unable to open '%s'\n", fileName);
+        return;
+    }
+    fclose(file);
+    
+    _StartWriter(job, fileName, stations, trips, bikes, index);
+    OutPrintf("** Ingesting '%s' **\n", fileName);
+    
+    return;
+}
+
+// StartRetain:
+// Sets the retention window to days, or removes it if days <= 0, and
+// starts evicting trips outside of it in the background. Trips ingested
+// later are evicted as they leave the window.
+//
+void StartRetain(INGESTJOB *job, int days, StationAVL *stations,
+                 TripAVL *trips, BikeAVL *bikes, DIVVYINDEX *index) {
+    
+    if(job->Started && atomic_load(&job->Running)) {
+        OutPrintf("**ingest is running, try again later...\n");
+        return;
+    }
+    
+    job->RetainDays = (days > 0) ? days : 0;
+    if(job->RetainDays == 0) {
+        OutPrintf("** Keeping all trips **\n");
+        return;
+    }
+    
+    _StartWriter(job, NULL, stations, trips, bikes, index);
+    OutPrintf("** Keeping trips of the last %d days **\n", job->RetainDays);
+    
+    return;
+}
+
+// PrintIngest:
+// Print progress of the background writer.
+//
+void PrintIngest(INGESTJOB *job) {
+    
+    int running = atomic_load(&job->Running);
+    int added = atomic_load(&job->Added);
+    int skipped = atomic_load(&job->Skipped);
+    int evicted = atomic_load(&job->Evicted);
+    
+    if(OutGetFormat() != OUT_TEXT) {
+        OutRecordBegin("ingest");
+        OutFieldInt("running", running);
+        OutFieldInt("added", added);
+        OutFieldInt("skipped", skipped);
+        OutFieldInt("evicted", evicted);
+        OutFieldInt("retain_days", job->RetainDays);
+        OutRecordEnd();
+        return;
+    }
+    
+    OutPrintf("** Ingest:\n");
+    OutPrintf("   %s: added = %d, skipped = %d, evicted = %d\n",
+              running ? "Running" : "Done", added, skipped, evicted);
+    if(job->RetainDays > 0) {
+        OutPrintf("   Retaining trips of the last %d days\n", job->RetainDays);
+    }
+    
+    return;
+}
+
+// PrintNotFound:
+// Print that the requested ID was not found.
+//
+void PrintNotFound(int id) {
+    
+    if(OutGetFormat() == OUT_TEXT) {
+        OutText("**not found\n");
+        return;
+    }
+    
+    OutRecordBegin("not_found");
+    OutFieldInt("id", id);
+    OutRecordEnd();
+    
+    return;
+}
+
+// PrintStats:
+// Print statistics about stations, trips and bikes AVL trees, such as:
+// cound of nodes and tree heights, and query result cache usage.
+//
+void PrintStats(StationAVL *stations, TripAVL *trips, BikeAVL *bikes, QUERYCACHE *cache) {
+    
+    if(OutGetFormat() != OUT_TEXT) {
+        const char *names[3] = {"stations", "trips", "bikes"};
+        int counts[3] = {StationAVLCount(stations), TripAVLCount(trips), BikeAVLCount(bikes)};
+        int heights[3] = {StationAVLHeight(stations), TripAVLHeight(trips), BikeAVLHeight(bikes)};
+        for(int i = 0; i < 3; i++) {
+            OutRecordBegin("tree");
+            OutFieldString("name", names[i]);
+            OutFieldInt("count", counts[i]);
+            OutFieldInt("height", heights[i]);
+            OutRecordEnd();
+        }
+        OutRecordBegin("cache");
+        OutFieldInt("hits", (long long)cache->Hits);
+        OutFieldInt("misses", (long long)cache->Misses);
+        OutFieldFixed("hit_rate", CacheHitRate(cache), 6);
+        OutFieldInt("entries", cache->Count);
+        OutFieldInt("used_kb", (long long)(cache->Used / 1024));
+        OutFieldInt("budget_kb", (long long)(cache->Budget / 1024));
+        OutFieldInt("evictions", (long long)cache->Evictions);
+        OutRecordEnd();
+        return;
+    }
+    
+    OutPrintf("** Trees:\n");
+    OutPrintf("   Stations: count = %d, height = %d\n",
+              StationAVLCount(stations), StationAVLHeight(stations));
+    OutPrintf("   Trips:    count = %d, height = %d\n",
+              TripAVLCount(trips), TripAVLHeight(trips));
+    OutPrintf("   Bikes:    count = %d, height = %d\n",
+              BikeAVLCount(bikes), BikeAVLHeight(bikes));
+    OutPrintf("** Cache:\n");
+    OutPrintf("   Hits: %lu, misses: %lu, hit rate = %f%%\n",
+              cache->Hits, cache->Misses, CacheHitRate(cache));
+    OutPrintf("   Entries: %d, used = %zu of %zu KB, evictions = %lu\n",
+              cache->Count, cache->Used / 1024, cache->Budget / 1024, cache->Evictions);
+    
+    return;
+}
+
+// _TripsAtStationVisit:
+// TripsAtStation visitor: counts trip once for each end at the station.
+//
+void _TripsAtStationVisit(void *node, void *partial, void *arg) {
+    
+    TripAVLNode *trip = (TripAVLNode *)node;
+    int stationID = *(int *)arg;
+    int *num = (int *)partial;
+    
+    if(trip->Value.TripFromStationID == stationID) {
+        *num += 1;
+    }
+    if(trip->Value.TripToStationID == stationID) {
+        *num += 1;
+    }
+    
+    return;
+}
+
+// _SumIntReduce:
+// Parallel scan reducer for int counters.
+//
+void _SumIntReduce(void *result, void *partial, void *arg) {
+    
+    *(int *)result += *(int *)partial;
+    
+    return;
+}
+
+// TripsAtStation:
+// Returns the number of trips that originated, or ended at requested station ID.
+// The count is kept in cache until the trips tree changes.
+//
+int TripsAtStation(TripAVL *trips, QUERYCACHE *cache, int stationID) {
+    
+    char key[QUERY_KEY_LENGTH];
+    snprintf(key, sizeof(key), "station %d", stationID);
+    int *cached = (int *)CacheGet(cache, key, TripAVLVersion(trips), NULL);
+    if(cached != NULL) {
+        return *cached;
+    }
+    
+    int num = 0;
+    TripAVLParallelScan(trips, _TripsAtStationVisit, &stationID, sizeof(int),
+                    _SumIntReduce, &num);
+    CachePut(cache, key, TripAVLVersion(trips), &num, sizeof(int));
+    
+    return num;
+}
+
+// PrintStationHours:
+// Print departures and arrivals of the station for every hour of the day,
+// summed over all weekdays and user types.
+//
+void PrintStationHours(ACTIVITYCUBE *activity, int stationID, int stationIndex) {
+    
+    if(OutGetFormat() == OUT_TEXT) {
+        OutPrintf("  By hour:    departures / arrivals\n");
+    }
+    for(int hour = 0; hour < ACTIVITY_HOURS; hour++) {
+        unsigned int departures = 0;
+        unsigned int arrivals = 0;
+        for(int day = 0; day < ACTIVITY_DAYS; day++) {
+            departures += ActivityCount(activity, stationIndex, DEPARTURE, -1, day, hour);
+            arrivals += ActivityCount(activity, stationIndex, ARRIVAL, -1, day, hour);
+        }
+        if(OutGetFormat() == OUT_TEXT) {
+            OutPrintf("    %02d:00     %u / %u\n", hour, departures, arrivals);
+        } else {
+            OutRecordBegin("station_hour");
+            OutFieldInt("station", stationID);
+            OutFieldInt("hour", hour);
+            OutFieldInt("departures", departures);
+            OutFieldInt("arrivals", arrivals);
+            OutRecordEnd();
+        }
+    }
+    
+    return;
+}
+
+// PrintFilteredStationInfo:
+// Print station info, with the trip count of riders that match the filter
+// only. The count is taken from the bitmaps of the station's trips and of
+// the riders.
+//
+void PrintFilteredStationInfo(StationAVLNode *stationNode, DIVVYINDEX *index,
+                              TRIPFILTER *filter) {
+    
+    char riderText[64];
+    ROARING riders;
+    FormatTripFilter(filter, riderText, sizeof(riderText));
+    TripFilterBitmap(&index->Bitmaps, filter, &riders);
+    int stationIndex = stationNode->Value.StationIndex;
+    int tripCount = RoaringAndCount(&index->Bitmaps.Origins[stationIndex], &riders) +
+                    RoaringAndCount(&index->Bitmaps.Destinations[stationIndex], &riders);
+    RoaringFree(&riders);
+    
+    if(OutGetFormat() != OUT_TEXT) {
+        OutRecordBegin("station");
+        OutFieldInt("id", stationNode->Value.StationID);
+        OutFieldString("name", stationNode->Value.StationName);
+        OutFieldFixed("latitude", stationNode->Value.StationLatitude, 6);
+        OutFieldFixed("longitude", stationNode->Value.StationLongitude, 6);
+        OutFieldInt("capacity", stationNode->Value.StationDPCapacity);
+        OutFieldString("riders", riderText);
+        OutFieldInt("trips", tripCount);
+        OutRecordEnd();
+        return;
+    }
+    
+    OutPrintf("**Station %d:\n", stationNode->Value.StationID);
+    OutPrintf("  Name: '%s'\n", stationNode->Value.StationName);
+    OutPrintf("  %-11s (%f,%f)\n", "Location:", stationNode->Value.StationLatitude,
+                                             stationNode->Value.StationLongitude);
+    OutPrintf("  %-11s %d\n", "Capacity:", stationNode->Value.StationDPCapacity);
+    OutPrintf("  %-11s %d (%s)\n", "Trip count:", tripCount, riderText);
+    
+    return;
+}
+
+// PrintStationInfo:
+// Print requested station information: station ID, station name, station bike
+// capacity and trip count that start or eneded at requested station. With
+// byHour set, hourly departures and arrivals are printed as well. With a
+// filter, only trips of matching riders are counted.
+//
+void PrintStationInfo(StationAVL *stations, TripAVL *trips, DIVVYINDEX *index,
+                      int stationID, boolean byHour, TRIPFILTER *filter) {
+    
+    StationAVLNode *stationNode = StationAVLSearch(stations, stationID);
+    if(stationNode != NULL && filter != NULL) {
+        PrintFilteredStationInfo(stationNode, index, filter);
+        if(byHour) {
+            PrintStationHours(&index->Activity, stationID, stationNode->Value.StationIndex);
+        }
+    } else if(stationNode != NULL && OutGetFormat() != OUT_TEXT) {
+        OutRecordBegin("station");
+        OutFieldInt("id", stationID);
+        OutFieldString("name", stationNode->Value.StationName);
+        OutFieldFixed("latitude", stationNode->Value.StationLatitude, 6);
+        OutFieldFixed("longitude", stationNode->Value.StationLongitude, 6);
+        OutFieldInt("capacity", stationNode->Value.StationDPCapacity);
+        OutFieldInt("trips", TripsAtStation(trips, &index->Cache, stationID));
+        OutRecordEnd();
+        if(byHour) {
+            PrintStationHours(&index->Activity, stationID, stationNode->Value.StationIndex);
+        }
+    } else if(stationNode != NULL) {
+        OutPrintf("**Station %d:\n", stationID);
+        OutPrintf("  Name: '%s'\n", stationNode->Value.StationName);
+        OutPrintf("  %-11s (%f,%f)\n", "Location:", stationNode->Value.StationLatitude,
+                                                 stationNode->Value.StationLongitude);
+        OutPrintf("  %-11s %d\n", "Capacity:", stationNode->Value.StationDPCapacity);
+        OutPrintf("  %-11s %d\n", "Trip count:", TripsAtStation(trips, &index->Cache, stationID));
+        if(byHour) {
+            PrintStationHours(&index->Activity, stationID, stationNode->Value.StationIndex);
+        }
+    } else {
+        PrintNotFound(stationID);
+    }
+    
+    return;
+}
+
+// PrintStationActivity:
+// Print departures and arrivals of requested station as hour-of-day by
+// day-of-week tables. userType < 0 means all user types together.
+//
+void PrintStationActivity(StationAVL *stations, DIVVYINDEX *index, int stationID, int userType) {
+    
+    StationAVLNode *stationNode = StationAVLSearch(stations, stationID);
+    if(stationNode == NULL) {
+        PrintNotFound(stationID);
+        return;
+    }
+    
+    int stationIndex = stationNode->Value.StationIndex;
+    if(OutGetFormat() != OUT_TEXT) {
+        const char *riderType = "all";
+        if(userType == SUBSCRIBER) {
+            riderType = "subscriber";
+        } else if(userType == CUSTOMER) {
+            riderType = "customer";
+        }
+        for(int direction = DEPARTURE; direction <= ARRIVAL; direction++) {
+            for(int day = 0; day < ACTIVITY_DAYS; day++) {
+                for(int hour = 0; hour < ACTIVITY_HOURS; hour++) {
+                    OutRecordBegin("activity");
+                    OutFieldInt("station", stationID);
+                    OutFieldString("riders", riderType);
+                    OutFieldString("direction",
+                                   (direction == DEPARTURE) ? "departure" : "arrival");
+                    OutFieldString("day", WeekDayNames[day]);
+                    OutFieldInt("hour", hour);
+                    OutFieldInt("count", ActivityCount(&index->Activity, stationIndex,
+                                                       (DIRECTION)direction, userType,
+                                                       day, hour));
+                    OutRecordEnd();
+                }
+            }
+        }
+        return;
+    }
+    
+    const char *riders = "all riders";
+    if(userType == SUBSCRIBER) {
+        riders = "subscribers";
+    } else if(userType == CUSTOMER) {
+        riders = "customers";
+    }
+    OutPrintf("**Station %d activity (%s):\n", stationID, riders);
+    
+    for(int direction = DEPARTURE; direction <= ARRIVAL; direction++) {
+        OutPrintf("  %s:\n", (direction == DEPARTURE) ? "Departures" : "Arrivals");
+        OutPrintf("  Hour");
+        for(int day = 0; day < ACTIVITY_DAYS; day++) {
+            OutPrintf(" %5s", WeekDayNames[day]);
+        }
+        OutPrintf("\n");
+        for(int hour = 0; hour < ACTIVITY_HOURS; hour++) {
+            OutPrintf("  %4d", hour);
+            for(int day = 0; day < ACTIVITY_DAYS; day++) {
+                OutPrintf(" %5u", ActivityCount(&index->Activity, stationIndex,
+                                             (DIRECTION)direction, userType, day, hour));
+            }
+            OutPrintf("\n");
+        }
+    }
+    
+    return;
+}
+
+// PrintBikeInfo:
+// Print number of trips of requested bike ID; bikeNode is NULL if the bike
+// was not found.
+//
+void PrintBikeInfo(BikeAVLNode *bikeNode, int bikeID) {
+    
+    if(bikeNode == NULL) {
+        PrintNotFound(bikeID);
+    } else if(OutGetFormat() != OUT_TEXT) {
+        OutRecordBegin("bike");
+        OutFieldInt("id", bikeID);
+        OutFieldInt("trips", bikeNode->Value.BikeTripCount);
+        OutRecordEnd();
+    } else {
+        OutText("**Bike ");
+        OutInt(bikeID);
+        OutText(":\n  Trip count: ");
+        OutInt(bikeNode->Value.BikeTripCount);
+        OutChar('\n');
+    }
+    
+    return;
+}
+
+// PrintBikesInfo:
+// Print number of trips of every requested bike, in the requested order.
+// All bikes are searched at once.
+//
+void PrintBikesInfo(BikeAVL *bikes, int *bikeIDs, int count) {
+    
+    if(count == 0) {
+        PrintNotFound(-1);
+        return;
+    }
+    
+    BikeAVLNode **bikeNodes = (BikeAVLNode **)malloc(count * sizeof(BikeAVLNode *));
+    BikeAVLSearchBatch(bikes, bikeIDs, count, bikeNodes);
+    for(int i = 0; i < count; i++) {
+        PrintBikeInfo(bikeNodes[i], bikeIDs[i]);
+    }
+    free(bikeNodes);
+    
+    return;
+}
+
+// PrintPercentiles:
+// Print p50, p90 and p99 of the durations histogram, using prefix in front
+// of every line; records name the durations they belong to by scope.
+//
+void PrintPercentiles(const char *prefix, const char *scope, HISTOGRAM *durations) {
+    
+    static const double percents[3] = {50.0, 90.0, 99.0};
+    
+    for(int i = 0; i < 3; i++) {
+        int duration = HistPercentile(durations, percents[i]);
+        if(OutGetFormat() == OUT_TEXT) {
+            OutPrintf("%sp%.0f: %d min, %d secs\n", prefix, percents[i],
+                      duration / 60, duration % 60);
+        } else {
+            OutRecordBegin("percentile");
+            OutFieldString("scope", scope);
+            OutFieldInt("percent", (long long)percents[i]);
+            OutFieldInt("seconds", duration);
+            OutRecordEnd();
+        }
+    }
+    
+    return;
+}
+
+// PrintDurations:
+// Print trip duration percentiles of the trips from one station to another,
+// and of all trips from the from station.
+//
+void PrintDurations(StationAVL *stations, DIVVYINDEX *index, int fromID, int toID) {
+    
+    StationAVLNode *fromStation = StationAVLSearch(stations, fromID);
+    StationAVLNode *toStation = StationAVLSearch(stations, toID);
+    if(fromStation == NULL || toStation == NULL) {
+        PrintNotFound((fromStation == NULL) ? fromID : toID);
+        return;
+    }
+    
+    int fromIndex = fromStation->Value.StationIndex;
+    ROUTESTATS *route = RouteStatsFind(&index->Routes, fromIndex,
+                                       toStation->Value.StationIndex);
+    
+    HISTOGRAM *origin = &index->OriginDurations[fromIndex];
+    if(OutGetFormat() != OUT_TEXT) {
+        OutRecordBegin("durations");
+        OutFieldString("scope", "route");
+        OutFieldInt("from", fromID);
+        OutFieldInt("to", toID);
+        OutFieldInt("trips", (route != NULL) ? route->Durations.Count : 0);
+        OutRecordEnd();
+        if(route != NULL && route->Durations.Count > 0) {
+            PrintPercentiles("  ", "route", &route->Durations);
+        }
+        OutRecordBegin("durations");
+        OutFieldString("scope", "origin");
+        OutFieldInt("from", fromID);
+        OutFieldInt("to", -1);
+        OutFieldInt("trips", origin->Count);
+        OutRecordEnd();
+        if(origin->Count > 0) {
+            PrintPercentiles("  ", "origin", origin);
+        }
+        return;
+    }
+    
+    OutPrintf("**Durations: from station #%d to station #%d\n", fromID, toID);
+    OutPrintf("  Trip count: %u\n", (route != NULL) ? route->Durations.Count : 0);
+    if(route != NULL && route->Durations.Count > 0) {
+        PrintPercentiles("  ", "route", &route->Durations);
+    }
+    
+    OutPrintf("**Durations: from station #%d to any station\n", fromID);
+    OutPrintf("  Trip count: %u\n", origin->Count);
+    if(origin->Count > 0) {
+        PrintPercentiles("  ", "origin", origin);
+    }
+    
+    return;
+}
+
+// BikeLastStation:
+// Returns the ID of the station where the bike was last docked, or -1 if
+// the bike has no trips.
+//
+int BikeLastStation(BIKE *bike) {
+    
+    if(bike->BikeChainLength == 0) {
+        return -1;
+    }
+    
+    return bike->BikeChain[bike->BikeChainLength - 1].ToStationID;
+}
+
+// PrintBikeHistory:
+// Print trips of requested bike in order of start time, and where it was
+// moved between trips without a rider.
+//
+void PrintBikeHistory(BikeAVL *bikes, int bikeID) {
+    
+    BikeAVLNode *bikeNode = BikeAVLSearch(bikes, bikeID);
+    if(bikeNode == NULL) {
+        PrintNotFound(bikeID);
+        return;
+    }
+    
+    BIKE *bike = &bikeNode->Value;
+    char startTime[32];
+    boolean text = (OutGetFormat() == OUT_TEXT);
+    
+    if(text) {
+        OutPrintf("**Bike %d history:\n", bikeID);
+        OutPrintf("  Trip count: %d\n", bike->BikeTripCount);
+        OutPrintf("  Last station: %d\n", BikeLastStation(bike));
+    } else {
+        OutRecordBegin("bike_history");
+        OutFieldInt("id", bikeID);
+        OutFieldInt("trips", bike->BikeTripCount);
+        OutFieldInt("last_station", BikeLastStation(bike));
+        OutRecordEnd();
+    }
+    for(int i = 0; i < bike->BikeChainLength; i++) {
+        BIKETRIP *link = &bike->BikeChain[i];
+        if(i > 0 && bike->BikeChain[i - 1].ToStationID != link->FromStationID) {
+            if(text) {
+                OutPrintf("  %-16s moved: %d -> %d\n", "",
+                          bike->BikeChain[i - 1].ToStationID, link->FromStationID);
+            } else {
+                OutRecordBegin("bike_move");
+                OutFieldInt("bike", bikeID);
+                OutFieldInt("from", bike->BikeChain[i - 1].ToStationID);
+                OutFieldInt("to", link->FromStationID);
+                OutRecordEnd();
+            }
+        }
+        FormatDivvyTime(link->StartStamp, startTime);
+        if(text) {
+            OutPrintf("  %-16s trip %d: %d -> %d\n", startTime, link->TripID,
+                      link->FromStationID, link->ToStationID);
+        } else {
+            OutRecordBegin("bike_trip");
+            OutFieldInt("bike", bikeID);
+            OutFieldString("start", startTime);
+            OutFieldInt("trip", link->TripID);
+            OutFieldInt("from", link->FromStationID);
+            OutFieldInt("to", link->ToStationID);
+            OutRecordEnd();
+        }
+    }
+    
+    return;
+}
+
+// REBALANCEREPORT:
+// Rebalancing moves found in bike trip chains, with moves counted by
+// station index they were taken from and brought to.
+//
+typedef struct REBALANCEREPORT {
+    StationAVL *Stations;
+    long Gaps;
+    long Moves;
+    int BikesMoved;
+    unsigned int *MovedFrom;
+    unsigned int *MovedTo;
+} REBALANCEREPORT;
+
+// _RebalanceBike:
+// BikeAVLForEach callback: counts moves between consecutive trips of the
+// bike, where one trip ends at another station than the next one starts.
+//
+void _RebalanceBike(void *node, void *arg) {
+    
+    BIKE *bike = &((BikeAVLNode *)node)->Value;
+    REBALANCEREPORT *report = (REBALANCEREPORT *)arg;
+    boolean moved = false;
+    
+    for(int i = 1; i < bike->BikeChainLength; i++) {
+        int from = bike->BikeChain[i - 1].ToStationID;
+        int to = bike->BikeChain[i].FromStationID;
+        report->Gaps++;
+        if(from == to) {
+            continue;
+        }
+        
+        report->Moves++;
+        moved = true;
+        StationAVLNode *station = StationAVLSearch(report->Stations, from);
+        if(station != NULL) {
+            report->MovedFrom[station->Value.StationIndex]++;
+        }
+        station = StationAVLSearch(report->Stations, to);
+        if(station != NULL) {
+            report->MovedTo[station->Value.StationIndex]++;
+        }
+    }
+    if(moved) {
+        report->BikesMoved++;
+    }
+    
+    return;
+}
+
+// _CollectStationIDs:
+// StationAVLForEach callback that stores station ID at station's index.
+//
+void _CollectStationIDs(void *node, void *arg) {
+    
+    StationAVLNode *station = (StationAVLNode *)node;
+    ((int *)arg)[station->Value.StationIndex] = station->Value.StationID;
+    
+    return;
+}
+
+// PrintTopStations:
+// Print up to top stations with the highest nonzero counts; records name
+// the counts by direction.
+//
+void PrintTopStations(const char *direction, unsigned int *counts, int *stationIDs,
+                      int stationCount, int top) {
+    
+    char *printed = (char *)calloc(stationCount + 1, sizeof(char));
+    for(int n = 0; n < top; n++) {
+        int best = -1;
+        for(int i = 0; i < stationCount; i++) {
+            if(!printed[i] && counts[i] > 0 && (best < 0 || counts[i] > counts[best])) {
+                best = i;
+            }
+        }
+        if(best < 0) {
+            break;
+        }
+        printed[best] = 1;
+        if(OutGetFormat() == OUT_TEXT) {
+            OutPrintf("     Station %d: %u\n", stationIDs[best], counts[best]);
+        } else {
+            OutRecordBegin("rebalancing_station");
+            OutFieldString("direction", direction);
+            OutFieldInt("station", stationIDs[best]);
+            OutFieldInt("moves", counts[best]);
+            OutRecordEnd();
+        }
+    }
+    free(printed);
+    
+    return;
+}
+
+// PrintRebalancing:
+// Print rebalancing moves found in all bike trip chains, and the stations
+// bikes were moved from and to most often.
+//
+void PrintRebalancing(StationAVL *stations, BikeAVL *bikes) {
+    
+    int stationCount = StationAVLCount(stations);
+    REBALANCEREPORT report;
+    report.Stations = stations;
+    report.Gaps = 0;
+    report.Moves = 0;
+    report.BikesMoved = 0;
+    report.MovedFrom = (unsigned int *)calloc(stationCount + 1, sizeof(unsigned int));
+    report.MovedTo = (unsigned int *)calloc(stationCount + 1, sizeof(unsigned int));
+    BikeAVLForEach(bikes, _RebalanceBike, &report);
+    
+    int *stationIDs = (int *)malloc((stationCount + 1) * sizeof(int));
+    StationAVLForEach(stations, _CollectStationIDs, stationIDs);
+    
+    double movedPercent = (report.Gaps > 0) ? (double)report.Moves / (double)report.Gaps * 100 : 0.0;
+    if(OutGetFormat() != OUT_TEXT) {
+        OutRecordBegin("rebalancing");
+        OutFieldInt("transitions", report.Gaps);
+        OutFieldInt("moves", report.Moves);
+        OutFieldFixed("moves_percent", movedPercent, 6);
+        OutFieldInt("bikes_moved", report.BikesMoved);
+        OutFieldInt("bikes", BikeAVLCount(bikes));
+        OutRecordEnd();
+    } else {
+        OutPrintf("** Rebalancing:\n");
+        OutPrintf("   Consecutive trips: %ld\n", report.Gaps);
+        OutPrintf("   Moves: %ld (%f%%)\n", report.Moves, movedPercent);
+        OutPrintf("   Bikes moved: %d of %d\n", report.BikesMoved, BikeAVLCount(bikes));
+        OutPrintf("   Moved from:\n");
+    }
+    PrintTopStations("from", report.MovedFrom, stationIDs, stationCount, 5);
+    if(OutGetFormat() == OUT_TEXT) {
+        OutPrintf("   Moved to:\n");
+    }
+    PrintTopStations("to", report.MovedTo, stationIDs, stationCount, 5);
+    
+    free(stationIDs);
+    free(report.MovedFrom);
+    free(report.MovedTo);
+    
+    return;
+}
+
+// PrintTripInfo:
+// Print requested trip inforamtion: bike ID, from station ID, to station ID and
+// duration of the requested trip; tripNode is NULL if the trip was not found.
+//
+void PrintTripInfo(TripAVLNode *tripNode, int tripID) {
+    
+    if(tripNode == NULL) {
+        PrintNotFound(tripID);
+    } else if(OutGetFormat() != OUT_TEXT) {
+        OutRecordBegin("trip");
+        OutFieldInt("id", tripID);
+        OutFieldInt("bike", tripNode->Value.TripBikeID);
+        OutFieldInt("from", tripNode->Value.TripFromStationID);
+        OutFieldInt("to", tripNode->Value.TripToStationID);
+        OutFieldInt("duration", tripNode->Value.TripDuration);
+        OutRecordEnd();
+    } else {
+        int tripDuratiuonMin = tripNode->Value.TripDuration / 60;
+        int tripDurationSec = tripNode->Value.TripDuration - (tripDuratiuonMin * 60);
+        OutText("**Trip ");
+        OutInt(tripID);
+        OutText(":\n  Bike: ");
+        OutInt(tripNode->Value.TripBikeID);
+        OutText("\n  From: ");
+        OutInt(tripNode->Value.TripFromStationID);
+        OutText("\n  To:   ");
+        OutInt(tripNode->Value.TripToStationID);
+        OutText("\n  Duration: ");
+        OutInt(tripDuratiuonMin);
+        OutText(" min, ");
+        OutInt(tripDurationSec);
+        OutText(" secs\n");
+    }
+    
+    return;
+}
+
+// PrintTripsInfo:
+// Print inforamtion of every requested trip, in the requested order. All
+// trips are searched at once.
+//
+void PrintTripsInfo(TripAVL *trips, int *tripIDs, int count) {
+    
+    if(count == 0) {
+        PrintNotFound(-1);
+        return;
+    }
+    
+    TripAVLNode **tripNodes = (TripAVLNode **)malloc(count * sizeof(TripAVLNode *));
+    TripAVLSearchBatch(trips, tripIDs, count, tripNodes);
+    for(int i = 0; i < count; i++) {
+        PrintTripInfo(tripNodes[i], tripIDs[i]);
+    }
+    free(tripNodes);
+    
+    return;
+}
+
+// NEARBYSEARCH:
+// FindNearbyStations scan arguments and per-thread partial result.
+//
+typedef struct NEARBYSEARCH {
+    double Latitude;
+    double Longitude;
+    double Distance;
+} NEARBYSEARCH;
+
+typedef struct NEARBYLIST {
+    StationsLL *Head;
+    int Count;
+} NEARBYLIST;
+
+// _FindNearbyVisit:
+// FindNearbyStations visitor: prepends station to the thread's list if it
+// is within the searched distance.
+//
+void _FindNearbyVisit(void *node, void *partial, void *arg) {
+    
+    StationAVLNode *station = (StationAVLNode *)node;
+    NEARBYSEARCH *search = (NEARBYSEARCH *)arg;
+    NEARBYLIST *list = (NEARBYLIST *)partial;
+    
+    double milage = DistBetween2Points(station->Value.StationLatitude,
+                                       station->Value.StationLongitude,
+                                       search->Latitude, search->Longitude);
+    if((milage - search->Distance) < 0.0000001) {
+        StationsLL *newNode = (StationsLL *)malloc(sizeof(StationsLL));
+        newNode->stationID = station->Value.StationID;
+        newNode->milage = milage;
+        newNode->next = list->Head;
+        list->Head = newNode;
+        list->Count++;
+    }
+    
+    return;
+}
+
+// _FindNearbyReduce:
+// FindNearbyStations reducer: appends thread's list to the result list.
+//
+void _FindNearbyReduce(void *result, void *partial, void *arg) {
+    
+    NEARBYLIST *total = (NEARBYLIST *)result;
+    NEARBYLIST *list = (NEARBYLIST *)partial;
+    
+    if(list->Head != NULL) {
+        StationsLL *last = list->Head;
+        while(last->next != NULL) {
+            last = last->next;
+        }
+        last->next = total->Head;
+        total->Head = list->Head;
+        total->Count += list->Count;
+    }
+    
+    return;
+}
+
+// CompareNearbyStations:
+// qsort comparator, orders stations by distance and then by station ID.
+//
+int CompareNearbyStations(const void *a, const void *b) {
+    
+    const StationsLL *s1 = *(const StationsLL **)a;
+    const StationsLL *s2 = *(const StationsLL **)b;
+    
+    if(s1->milage < s2->milage) {
+        return -1;
+    } else if(s1->milage > s2->milage) {
+        return 1;
+    } else {
+        return AVLCompareKeys(s1->stationID, s2->stationID);
+    }
+}
+
+// NEARBYSTATION:
+// Found station as kept in the query result cache.
+//
+typedef struct NEARBYSTATION {
+    int StationID;
+    double Milage;
+} NEARBYSTATION;
+
+// _LinkNearbyStations:
+// Links new list nodes for cached stations, in the same order, in front of
+// nerbyStations.
+//
+void _LinkNearbyStations(NEARBYSTATION *found, int count, StationsLL **nerbyStations) {
+    
+    for(int i = count - 1; i >= 0; i--) {
+        StationsLL *newNode = (StationsLL *)malloc(sizeof(StationsLL));
+        newNode->stationID = found[i].StationID;
+        newNode->milage = found[i].Milage;
+        newNode->next = *nerbyStations;
+        *nerbyStations = newNode;
+    }
+    
+    return;
+}
+
+// FindNearbyStations:
+// Find station from requested latitude and lonfiture in radius of requested
+// distance. Found stations are appended to nerbyStations list in ascending
+// order of distance; stations at the same distance are ordered by ID. The
+// found stations are kept in cache until the stations tree changes.
+//
+void FindNearbyStations(StationAVL *stations, QUERYCACHE *cache, double latitude,
+                        double longitude, double distance, StationsLL **nerbyStations) {
+    
+    char key[QUERY_KEY_LENGTH];
+    size_t size = 0;
+    snprintf(key, sizeof(key), "find %.17g %.17g %.17g", latitude, longitude, distance);
+    NEARBYSTATION *cached = (NEARBYSTATION *)CacheGet(cache, key,
+                                StationAVLVersion(stations), &size);
+    if(cached != NULL) {
+        _LinkNearbyStations(cached, (int)(size / sizeof(NEARBYSTATION)), nerbyStations);
+        return;
+    }
+    
+    NEARBYSEARCH search = {latitude, longitude, distance};
+    NEARBYLIST found = {NULL, 0};
+    StationAVLParallelScan(stations, _FindNearbyVisit, &search, sizeof(NEARBYLIST),
+                    _FindNearbyReduce, &found);
+    if(found.Head == NULL) {
+        CachePut(cache, key, StationAVLVersion(stations), NULL, 0);
+        return;
+    }
+    
+    // Sort found stations and link them in front of nerbyStations:
+    StationsLL **sorted = (StationsLL **)malloc(found.Count * sizeof(StationsLL *));
+    StationsLL *cur = found.Head;
+    for(int i = 0; i < found.Count; i++) {
+        sorted[i] = cur;
+        cur = cur->next;
+    }
+    qsort(sorted, found.Count, sizeof(StationsLL *), CompareNearbyStations);
+    NEARBYSTATION *result = (NEARBYSTATION *)malloc(found.Count * sizeof(NEARBYSTATION));
+    for(int i = 0; i < found.Count; i++) {
+        result[i].StationID = sorted[i]->stationID;
+        result[i].Milage = sorted[i]->milage;
+    }
+    CachePut(cache, key, StationAVLVersion(stations), result,
+             found.Count * sizeof(NEARBYSTATION));
+    free(result);
+    for(int i = 0; i < found.Count - 1; i++) {
+        sorted[i]->next = sorted[i + 1];
+    }
+    sorted[found.Count - 1]->next = *nerbyStations;
+    *nerbyStations = sorted[0];
+    free(sorted);
+    
+    return;
+}
+
+// PrintStationDistance:
+// Print one station found by find or nearest, and its distance in miles.
+//
+void PrintStationDistance(int stationID, double milage) {
+    
+    if(OutGetFormat() != OUT_TEXT) {
+        OutRecordBegin("station_distance");
+        OutFieldInt("id", stationID);
+        OutFieldFixed("miles", milage, 6);
+        OutRecordEnd();
+        return;
+    }
+    
+    OutText("Station ");
+    OutInt(stationID);
+    OutText(": distance ");
+    OutFixed(milage, 6);
+    OutText(" miles\n");
+    
+    return;
+}
+
+// PrintNearbyStations:
+// Prints the ascending list (from shortest to longest) of nearest stations
+// from requested coordinates and maximum distange from these coordinates.
+//
+void PrintNearbyStations(StationAVL *stations, QUERYCACHE *cache, double latitude,
+                         double longitude, double distance) {
+    
+    // Find and create the list of nearest stations:
+    StationsLL *nerbyStations = NULL;
+    FindNearbyStations(stations, cache, latitude, longitude, distance, &nerbyStations);
+    
+    // Print the list of found stations:
+    StationsLL *cur = nerbyStations;
+    if(cur != NULL) {
+        while(cur != NULL) {
+            PrintStationDistance(cur->stationID, cur->milage);
+            cur= cur->next;
+        }
+    }
+    FreeStationsLL(&nerbyStations);
+    return;
+}
+
+// PrintNearestStations:
+// Prints the k stations closest to requested coordinates, from shortest to
+// longest distance.
+//
+void PrintNearestStations(DIVVYINDEX *index, double latitude, double longitude, int k) {
+    
+    if(k < 1) {
+        OutPrintf("**k must be at least 1, try again...\n");
+        return;
+    }
+    
+    // There are never more neighbors than stations:
+    if(k > index->StationPoints->Count) {
+        k = index->StationPoints->Count;
+    }
+    
+    KDNeighbor *nearest = (KDNeighbor *)malloc((k + 1) * sizeof(KDNeighbor));
+    if(nearest == NULL) {
+        OutPrintf("**Error: out of memory\n");
+        return;
+    }
+    int found = KDNearest(index->StationPoints, latitude, longitude, k, nearest);
+    for(int i = 0; i < found; i++) {
+        PrintStationDistance(nearest[i].ID, nearest[i].Distance);
+    }
+    free(nearest);
+    
+    return;
+}
+
+// StationsLLToIDs:
+// Returns sorted array of station IDs from the stations list, and stores the
+// number of IDs into count.
+//
+int *StationsLLToIDs(StationsLL *list, int *count) {
+    
+    *count = 0;
+    for(StationsLL *cur = list; cur != NULL; cur = cur->next) {
+        *count += 1;
+    }
+    
+    int *ids = (int *)malloc((*count + 1) * sizeof(int));
+    int i = 0;
+    for(StationsLL *cur = list; cur != NULL; cur = cur->next) {
+        ids[i++] = cur->stationID;
+    }
+    qsort(ids, *count, sizeof(int), CompareInts);
+    
+    return ids;
+}
+
+// ROUTESEARCH:
+// MatchStarionsFromID scan arguments: sorted from and to station IDs.
+//
+typedef struct ROUTESEARCH {
+    int *FromIDs;
+    int FromCount;
+    int *ToIDs;
+    int ToCount;
+} ROUTESEARCH;
+
+// _MatchRouteVisit:
+// MatchStarionsFromID visitor: counts trip if it starts at one of the from
+// stations and ends at one of the to stations.
+//
+void _MatchRouteVisit(void *node, void *partial, void *arg) {
+    
+    TripAVLNode *trip = (TripAVLNode *)node;
+    ROUTESEARCH *search = (ROUTESEARCH *)arg;
+    
+    if(bsearch(&trip->Value.TripFromStationID, search->FromIDs,
+               search->FromCount, sizeof(int), CompareInts) != NULL &&
+       bsearch(&trip->Value.TripToStationID, search->ToIDs,
+               search->ToCount, sizeof(int), CompareInts) != NULL) {
+        *(int *)partial += 1;
+    }
+    
+    return;
+}
+
+// MatchStarionsFromID:
+// Returns the number of trips that start from any of fromStations and end at
+// any of toStations.
+//
+int MatchStarionsFromID(TripAVL *trips, StationsLL *fromStations, StationsLL *toStations) {
+    
+    ROUTESEARCH search;
+    search.FromIDs = StationsLLToIDs(fromStations, &search.FromCount);
+    search.ToIDs = StationsLLToIDs(toStations, &search.ToCount);
+    
+    int tripCount = 0;
+    if(search.FromCount > 0 && search.ToCount > 0) {
+        TripAVLParallelScan(trips, _MatchRouteVisit, &search, sizeof(int),
+                        _SumIntReduce, &tripCount);
+    }
+    
+    free(search.FromIDs);
+    free(search.ToIDs);
+    
+    return tripCount;
+}
+
+// MergeRouteDurations:
+// Merges duration histograms of all routes from any of fromStations to any
+// of toStations into durations.
+//
+void MergeRouteDurations(StationAVL *stations, DIVVYINDEX *index,
+                         StationsLL *fromStations, StationsLL *toStations,
+                         HISTOGRAM *durations) {
+    
+    for(StationsLL *from = fromStations; from != NULL; from = from->next) {
+        int fromIndex = StationAVLSearch(stations, from->stationID)->Value.StationIndex;
+        for(StationsLL *to = toStations; to != NULL; to = to->next) {
+            int toIndex = StationAVLSearch(stations, to->stationID)->Value.StationIndex;
+            ROUTESTATS *route = RouteStatsFind(&index->Routes, fromIndex, toIndex);
+            if(route != NULL) {
+                HistMerge(durations, &route->Durations);
+            }
+        }
+    }
+    
+    return;
+}
+
+// PrintApproxRouteAnalysis:
+// print an estimate of how many trips are taken along a given route, with
+// 95% confidence interval, from the per-station trip samples instead of the
+// trips tree; and estimated distinct bikes and rider profiles from the
+// route sketches.
+//
+void PrintApproxRouteAnalysis(StationAVL *stations, TripAVL *trips, DIVVYINDEX *index,
+                              int tripID, double distance) {
+    
+    TripAVLNode *tripNode = TripAVLSearch(trips, tripID);
+    if(tripNode == NULL) {
+        PrintNotFound(tripID);
+        return;
+    }
+    
+    StationAVLNode *stationA = StationAVLSearch(stations, tripNode->Value.TripFromStationID);
+    StationAVLNode *stationB = StationAVLSearch(stations, tripNode->Value.TripToStationID);
+    
+    StationsLL *nearbyStationsA = NULL;
+    FindNearbyStations(stations, &index->Cache, stationA->Value.StationLatitude,
+                       stationA->Value.StationLongitude, distance, &nearbyStationsA);
+    StationsLL *nearbyStationsB = NULL;
+    FindNearbyStations(stations, &index->Cache, stationB->Value.StationLatitude,
+                       stationB->Value.StationLongitude, distance, &nearbyStationsB);
+    
+    // Mark destination stations:
+    char *isDestination = (char *)calloc(index->Activity.StationCount + 1, sizeof(char));
+    for(StationsLL *cur = nearbyStationsB; cur != NULL; cur = cur->next) {
+        isDestination[StationAVLSearch(stations, cur->stationID)->Value.StationIndex] = 1;
+    }
+    
+    // Stratified estimate: every origin station is a stratum, its sampled
+    // share of trips into D' is scaled up to all of its trips:
+    double estimate = 0.0;
+    double variance = 0.0;
+    unsigned int sampled = 0;
+    for(StationsLL *cur = nearbyStationsA; cur != NULL; cur = cur->next) {
+        int fromIndex = StationAVLSearch(stations, cur->stationID)->Value.StationIndex;
+        STATIONSAMPLE *sample = &index->OriginSamples[fromIndex];
+        if(sample->Count == 0) {
+            continue;
+        }
+        
+        int matches = 0;
+        for(int i = 0; i < sample->Count; i++) {
+            matches += isDestination[sample->Destinations[i]];
+        }
+        
+        double N = sample->Seen;
+        double n = sample->Count;
+        double p = matches / n;
+        estimate += N * p;
+        if(N > n && n > 1.0) {
+            variance += N * N * (1.0 - n / N) * p * (1.0 - p) / (n - 1.0);
+        } else if(N > n) {
+            // One sampled trip tells nothing of the spread; assume the widest:
+            variance += N * N * (1.0 - n / N) * 0.25;
+        }
+        sampled += sample->Count;
+    }
+    free(isDestination);
+    
+    // Distinct counts from merged S' x D' sketches:
+    HYPERLOGLOG bikes;
+    HYPERLOGLOG riders;
+    HLLInit(&bikes);
+    HLLInit(&riders);
+    for(StationsLL *from = nearbyStationsA; from != NULL; from = from->next) {
+        int fromIndex = StationAVLSearch(stations, from->stationID)->Value.StationIndex;
+        for(StationsLL *to = nearbyStationsB; to != NULL; to = to->next) {
+            int toIndex = StationAVLSearch(stations, to->stationID)->Value.StationIndex;
+            ROUTESTATS *route = RouteStatsFind(&index->Routes, fromIndex, toIndex);
+            if(route != NULL) {
+                HLLMerge(&bikes, &route->Bikes);
+                HLLMerge(&riders, &route->Riders);
+            }
+        }
+    }
+    
+    double margin = 1.96 * sqrt(variance);
+    double low = (estimate - margin > 0.0) ? estimate - margin : 0.0;
+    double high = estimate + margin;
+    double total = (double)TripAVLCount(trips);
+    
+    if(OutGetFormat() != OUT_TEXT) {
+        OutRecordBegin("route_estimate");
+        OutFieldInt("from", stationA->Value.StationID);
+        OutFieldInt("to", stationB->Value.StationID);
+        OutFieldFixed("trips", estimate, 0);
+        OutFieldFixed("trips_low", low, 0);
+        OutFieldFixed("trips_high", high, 0);
+        OutFieldFixed("percent", estimate / total * 100, 6);
+        OutFieldFixed("percent_low", low / total * 100, 6);
+        OutFieldFixed("percent_high", high / total * 100, 6);
+        OutFieldFixed("bikes", HLLEstimate(&bikes), 0);
+        OutFieldFixed("riders", HLLEstimate(&riders), 0);
+        OutFieldInt("sampled", sampled);
+        OutRecordEnd();
+    } else {
+        OutPrintf("** Route (approximate): from station #%d to station #%d\n",
+                  stationA->Value.StationID, stationB->Value.StationID);
+        OutPrintf("** Trip count: ~%.0f (95%% CI %.0f - %.0f)\n", estimate, low, high);
+        OutPrintf("** Percentage: ~%f%% (95%% CI %f%% - %f%%)\n", estimate / total * 100,
+                  low / total * 100, high / total * 100);
+        OutPrintf("** Distinct bikes: ~%.0f\n", HLLEstimate(&bikes));
+        OutPrintf("** Distinct rider profiles: ~%.0f\n", HLLEstimate(&riders));
+        OutPrintf("** Sampled trips: %u\n", sampled);
+    }
+    
+    HLLFree(&bikes);
+    HLLFree(&riders);
+    FreeStationsLL(&nearbyStationsA);
+    FreeStationsLL(&nearbyStationsB);
+    
+    return;
+}
+
+// FilteredRouteTrips:
+// Returns the number of trips of riders that start at one of fromStations
+// and end at one of toStations: the union of the origin bitmaps of
+// fromStations, intersected with the union of the destination bitmaps of
+// toStations and with riders.
+//
+int FilteredRouteTrips(StationAVL *stations, TRIPBITMAPS *bitmaps, StationsLL *fromStations,
+                       StationsLL *toStations, ROARING *riders) {
+    
+    ROARING starts;
+    ROARING ends;
+    RoaringInit(&starts);
+    RoaringInit(&ends);
+    
+    for(StationsLL *cur = fromStations; cur != NULL; cur = cur->next) {
+        StationAVLNode *station = StationAVLSearch(stations, cur->stationID);
+        RoaringOr(&starts, &bitmaps->Origins[station->Value.StationIndex]);
+    }
+    for(StationsLL *cur = toStations; cur != NULL; cur = cur->next) {
+        StationAVLNode *station = StationAVLSearch(stations, cur->stationID);
+        RoaringOr(&ends, &bitmaps->Destinations[station->Value.StationIndex]);
+    }
+    RoaringAnd(&starts, &ends);
+    int tripCount = RoaringAndCount(&starts, riders);
+    
+    RoaringFree(&starts);
+    RoaringFree(&ends);
+    
+    return tripCount;
+}
+
+// PrintFilteredRoute:
+// Print the number of trips of riders matching the filter along the route,
+// and their percentage of all trips of those riders.
+//
+void PrintFilteredRoute(StationAVL *stations, DIVVYINDEX *index, int fromID, int toID,
+                        StationsLL *fromStations, StationsLL *toStations,
+                        TRIPFILTER *filter) {
+    
+    char riderText[64];
+    ROARING riders;
+    FormatTripFilter(filter, riderText, sizeof(riderText));
+    TripFilterBitmap(&index->Bitmaps, filter, &riders);
+    int tripCount = FilteredRouteTrips(stations, &index->Bitmaps, fromStations,
+                                       toStations, &riders);
+    unsigned int riderTrips = RoaringCount(&riders);
+    double percent = (riderTrips > 0) ? (double)tripCount / (double)riderTrips * 100 : 0.0;
+    RoaringFree(&riders);
+    
+    if(OutGetFormat() != OUT_TEXT) {
+        OutRecordBegin("route");
+        OutFieldInt("from", fromID);
+        OutFieldInt("to", toID);
+        OutFieldString("riders", riderText);
+        OutFieldInt("trips", tripCount);
+        OutFieldFixed("percent", percent, 6);
+        OutRecordEnd();
+        return;
+    }
+    
+    OutPrintf("** Route: from station #%d to station #%d\n", fromID, toID);
+    OutPrintf("** Riders: %s\n", riderText);
+    OutPrintf("** Trip count: %d\n", tripCount);
+    OutPrintf("** Percentage: %f%%\n", percent);
+    
+    return;
+}
+
+// PrintRouuteAnalysis:
+// print an analysis to see how many trips are taken along a given route.
+//
+void PrintRouteAnalysis(StationAVL *stations, TripAVL *trips, DIVVYINDEX *index,
+                        int tripID, double distance, TRIPFILTER *filter) {
+    
+    // Find trip:
+    TripAVLNode *tripNode = TripAVLSearch(trips, tripID);
+    
+    if(tripNode != NULL) {
+        
+        // Find information about trip from station and trip to stations:
+        StationAVLNode *stationA = StationAVLSearch(stations,
+                                      tripNode->Value.TripFromStationID);
+        StationAVLNode *stationB = StationAVLSearch(stations,
+                                      tripNode->Value.TripToStationID);
+        
+        // Find all nearby stations from trip's from station ID:
+        StationsLL *nearbyStationsA = NULL;
+        FindNearbyStations(stations, &index->Cache,
+                           stationA->Value.StationLatitude,
+                           stationA->Value.StationLongitude,
+                           distance, &nearbyStationsA);
+        
+        // Find all nearby stations from trip's to station ID:
+        StationsLL *nearbyStationsB = NULL;
+        FindNearbyStations(stations, &index->Cache,
+                           stationB->Value.StationLatitude,
+                           stationB->Value.StationLongitude,
+                           distance, &nearbyStationsB);
+        
+        // Count trips of matching riders only from the bitmaps:
+        if(filter != NULL) {
+            PrintFilteredRoute(stations, index, stationA->Value.StationID,
+                               stationB->Value.StationID, nearbyStationsA,
+                               nearbyStationsB, filter);
+            FreeStationsLL(&nearbyStationsA);
+            FreeStationsLL(&nearbyStationsB);
+            return;
+        }
+        
+        // Count all trips in "trips" AVL that start near stationA and end
+        // near stationB, unless counted since the trees last changed:
+        char key[QUERY_KEY_LENGTH];
+        snprintf(key, sizeof(key), "route %d %.17g", tripID, distance);
+        unsigned long version = StationAVLVersion(stations) + TripAVLVersion(trips);
+        int *cached = (int *)CacheGet(&index->Cache, key, version, NULL);
+        int tripCount = 0;
+        if(cached != NULL) {
+            tripCount = *cached;
+        } else {
+            tripCount = MatchStarionsFromID(trips, nearbyStationsA, nearbyStationsB);
+            CachePut(&index->Cache, key, version, &tripCount, sizeof(int));
+        }
+        
+        double percent = ((double)tripCount / (double)TripAVLCount(trips)) * 100;
+        if(OutGetFormat() != OUT_TEXT) {
+            OutRecordBegin("route");
+            OutFieldInt("from", stationA->Value.StationID);
+            OutFieldInt("to", stationB->Value.StationID);
+            OutFieldInt("trips", tripCount);
+            OutFieldFixed("percent", percent, 6);
+            OutRecordEnd();
+        } else {
+            OutPrintf("** Route: from station #%d to station #%d\n",
+                      stationA->Value.StationID,
+                      stationB->Value.StationID);
+            OutPrintf("** Trip count: %d\n", tripCount);
+            OutPrintf("** Percentage: %f%%\n", percent);
+        }
+        
+        // Duration percentiles of all S' x D' routes:
+        HISTOGRAM durations;
+        HistInit(&durations);
+        MergeRouteDurations(stations, index, nearbyStationsA, nearbyStationsB, &durations);
+        if(durations.Count > 0) {
+            PrintPercentiles("** Duration ", "route", &durations);
+        }
+        HistFree(&durations);
+        
+        FreeStationsLL(&nearbyStationsA);
+        FreeStationsLL(&nearbyStationsB);
+        
+    } else {
+        PrintNotFound(tripID);
+    }
     
-    double PI = 3.14159265;
-    double earth_rad = 3963.1;
-
-    double lat1_rad = lat1 * PI / 180.0;
-    double long1_rad = long1 * PI / 180.0;
-    double lat2_rad = lat2 * PI / 180.0;
-    double long2_rad = long2 * PI / 180.0;
+    return;
+}
 
-    double dist = earth_rad * acos(
-           (cos(lat1_rad)*cos(long1_rad)*cos(lat2_rad)*cos(long2_rad)) +
-           (cos(lat1_rad)*sin(long1_rad)*cos(lat2_rad)*sin(long2_rad)) +
-           (sin(lat1_rad)*sin(lat2_rad))
-           );
 
-  return dist;
-}
+// FLOWSEARCH:
+// Arguments of the zone flow scan.
+//
+typedef struct FLOWSEARCH {
+    StationAVL *Stations;
+    FLOWGRID *Grid;
+} FLOWSEARCH;
 
-// FreeAVLNodeData:
-// Works with AVLFree() to free the data inside (key, value) pairs.
+// _FlowSlot:
+// Returns the slot of (from, to) zone pair in the flow table, or the empty
+// slot where it belongs.
 //
-void FreeAVLNodeData(AVLKey key, AVLValue value) {
+int _FlowSlot(FLOWTABLE *table, int fromZone, int toZone) {
     
-    // What we free depends on what type of value we have:
-    if (value.Type == STATIONTYPE) {
-        free(value.Station.StationName);
-        free(value.Station.StationOnlineDate);
-    } else if (value.Type == TRIPTYPE) {
-        free(value.Trip.TripStartTime);
-        free(value.Trip.TripStopTime);
-        free(value.Trip.TripFromStationName);
-        free(value.Trip.TripToStationName);
-    } else if (value.Type == BIKETYPE) {
-        return;
-    } else {
-        printf("**ERROR: unexpected value type in freeAVLNodeData!\n\n");
-        exit(-1);
+    unsigned long long hash = ((unsigned long long)fromZone << 32 | (unsigned int)toZone) *
+                              0x9E3779B97F4A7C15ULL;
+    int i = (int)(hash >> 32) & (table->Capacity - 1);
+    while(table->Cells[i].Trips != 0 &&
+          (table->Cells[i].FromZone != fromZone || table->Cells[i].ToZone != toZone)) {
+        i = (i + 1) & (table->Capacity - 1);
     }
     
-    return;
+    return i;
 }
 
-// FreeStationsLL:
+// FlowTableAdd:
+// Adds trips to the (from, to) zone pair, growing the table when it gets
+// half full.
 //
-//
-void FreeStationsLL(StationsLL **root) {
+void FlowTableAdd(FLOWTABLE *table, int fromZone, int toZone, unsigned int trips) {
     
-    StationsLL *cur = *root;
-    StationsLL *del = NULL;
-    while(cur != NULL) {
-        del = cur;
-        cur = cur->next;
-        free(del);
+    if(2 * (table->Count + 1) > table->Capacity) {
+        FLOWTABLE grown;
+        grown.Capacity = (table->Capacity > 0) ? table->Capacity * 2 : FLOW_TABLE_INITIAL;
+        grown.Count = table->Count;
+        grown.Cells = (FLOWCELL *)calloc(grown.Capacity, sizeof(FLOWCELL));
+        for(int i = 0; i < table->Capacity; i++) {
+            if(table->Cells[i].Trips != 0) {
+                grown.Cells[_FlowSlot(&grown, table->Cells[i].FromZone,
+                                      table->Cells[i].ToZone)] = table->Cells[i];
+            }
+        }
+        free(table->Cells);
+        *table = grown;
     }
     
+    int i = _FlowSlot(table, fromZone, toZone);
+    if(table->Cells[i].Trips == 0) {
+        table->Cells[i].FromZone = fromZone;
+        table->Cells[i].ToZone = toZone;
+        table->Count++;
+    }
+    table->Cells[i].Trips += trips;
+    
     return;
 }
 
-// GetFileName:
-// Inputs a filename from the keyboard, make sure the file can be
-// opened, and returns the filename if so.  If the file cannot be 
-// opened, an error message is output and the program is exited.
+// STATIONCELL:
+// Grid cell of a station, as row << 32 | column.
 //
-char *GetFileName() {
-    
-    char filename[512];
-    int  fnsize = sizeof(filename) / sizeof(filename[0]);
-
-    // Input filename from the keyboard:
-    fgets(filename, fnsize, stdin);
-    filename[strcspn(filename, "\r\n")] = '\0';  // strip EOL char(s):
-
-    // Make sure filename exists and can be opened:
-    FILE *infile = fopen(filename, "r");
-    if (infile == NULL) {
-        printf("**Error: unable to open '%s'\n\n", filename);
-        exit(-1);
-    }
-
-    fclose(infile);
-
-    // Duplicate and return filename:
-    char *s = (char *)malloc((strlen(filename) + 1) * sizeof(char));
-    strcpy(s, filename);
-
-    return s;
-}
+typedef struct STATIONCELL {
+    long long Cell;
+    int StationIndex;
+} STATIONCELL;
 
-// SkipRestOfInput:
-// Inputs and discards the remainder of the current line for the 
-// given input stream, including the EOL character(s).
+// CompareStationCells:
+// qsort comparator, orders stations by grid cell.
 //
-void SkipRestOfInput(FILE *stream) {
+int CompareStationCells(const void *a, const void *b) {
     
-    char restOfLine[256];
-    int rolLength = sizeof(restOfLine) / sizeof(restOfLine[0]);
-
-    fgets(restOfLine, rolLength, stream);
+    long long cell1 = ((const STATIONCELL *)a)->Cell;
+    long long cell2 = ((const STATIONCELL *)b)->Cell;
     
-    return;
+    return (cell1 > cell2) - (cell1 < cell2);
 }
 
-// PopulateStations:
-// Read each record from stationsFileName csv file and build stations
-// AVL tree.
+// CreateFlowGrid:
+// Buckets stations into square cells of cellMiles miles, and numbers the
+// cells that hold a station as zones, row by row from south-west.
 //
-void PopulateStations(char *stationsFileName, AVL *stations) {
-    
-    char tempString[512];
-    int tempStringLength = sizeof(tempString)/sizeof(tempString[0]);
-    char tData[256];
+FLOWGRID *CreateFlowGrid(StationAVL *stations, double cellMiles) {
     
-    // Open File and read its data:
-    FILE *file = fopen(stationsFileName, "r");
+    int stationCount = StationAVLCount(stations);
+    KDPoint *points = (KDPoint *)malloc((stationCount + 1) * sizeof(KDPoint));
+    StationAVLForEach(stations, _CollectStationPoint, points);
     
-    // Read and ignore first line of the input file:
-    fgets(tempString, tempStringLength, file);
+    FLOWGRID *grid = (FLOWGRID *)malloc(sizeof(FLOWGRID));
+    grid->CellMiles = cellMiles;
+    grid->MinLatitude = 0.0;
+    grid->MinLongitude = 0.0;
+    double meanLatitude = 0.0;
+    for(int i = 0; i < stationCount; i++) {
+        if(i == 0 || points[i].Latitude < grid->MinLatitude) {
+            grid->MinLatitude = points[i].Latitude;
+        }
+        if(i == 0 || points[i].Longitude < grid->MinLongitude) {
+            grid->MinLongitude = points[i].Longitude;
+        }
+        meanLatitude += points[i].Latitude / stationCount;
+    }
+    grid->LatitudeStep = cellMiles / FLOW_MILES_PER_DEGREE;
+    grid->LongitudeStep = cellMiles / (FLOW_MILES_PER_DEGREE *
+                                       fmax(cos(meanLatitude * FLOW_PI / 180.0), 0.01));
     
-    // Read,parse and insert into AVL tree the rest of the input file:
-    fgets(tempString, tempStringLength, file);
+    // Cell of every station, sorted by cell:
+    STATIONCELL *cells = (STATIONCELL *)malloc((stationCount + 1) * sizeof(STATIONCELL));
+    for(int i = 0; i < stationCount; i++) {
+        long long row = (long long)floor((points[i].Latitude - grid->MinLatitude) /
+                                         grid->LatitudeStep);
+        long long column = (long long)floor((points[i].Longitude - grid->MinLongitude) /
+                                            grid->LongitudeStep);
+        cells[i].Cell = row << 32 | column;
+        cells[i].StationIndex = i;
+    }
+    qsort(cells, stationCount, sizeof(STATIONCELL), CompareStationCells);
     
-    while (!feof(file)) {
-        
-        AVLValue stationValue;
-        stationValue.Type = STATIONTYPE;
-        stationValue.Station.StationID = atoi(strtok(tempString, ","));
-        strcpy(tData, strtok(NULL, ","));
-        stationValue.Station.StationName = (char *)malloc((strlen(tData) + 1) * sizeof(char));
-        strcpy(stationValue.Station.StationName, tData);
-        stationValue.Station.StationLatitude = atof(strtok(NULL, ","));
-        stationValue.Station.StationLongitude = atof(strtok(NULL, ","));
-        stationValue.Station.StationDPCapacity = atoi(strtok(NULL, ","));
-        strcpy(tData, strtok(NULL, "\r\n"));
-        stationValue.Station.StationOnlineDate = (char *)malloc((strlen(tData) + 1) * sizeof(char));
-        strcpy(stationValue.Station.StationOnlineDate, tData);
-
-        AVLInsert(stations, stationValue.Station.StationID, stationValue);
-        
-        fgets(tempString, tempStringLength, file);
+    grid->StationZone = (int *)malloc((stationCount + 1) * sizeof(int));
+    grid->ZoneCells = (long long *)malloc((stationCount + 1) * sizeof(long long));
+    grid->ZoneCount = 0;
+    for(int i = 0; i < stationCount; i++) {
+        if(i == 0 || cells[i].Cell != cells[i - 1].Cell) {
+            grid->ZoneCells[grid->ZoneCount] = cells[i].Cell;
+            grid->ZoneCount++;
+        }
+        grid->StationZone[cells[i].StationIndex] = grid->ZoneCount - 1;
     }
+    grid->Next = NULL;
     
-    fclose(file);
-    free(stationsFileName);
+    free(cells);
+    free(points);
     
-    return;
+    return grid;
 }
 
-// PopulateTripsAnsBikes:
-// Read each record from tripsFileName csv file and build trips and bikes
-// AVL trees.
+// GetFlowGrid:
+// Returns the grid of cellMiles cells, built on first use and kept with the
+// other indexes.
 //
-void PopulateTripsAnsBikes(char *tripsFileName, AVL *trips, AVL *bikes) {
-    
-    char tempString[512];
-    int tempStringLength = sizeof(tempString)/sizeof(tempString[0]);
-    char tData[256];
-    
-    // Open File and read its data:
-    FILE *file = fopen(tripsFileName, "r");
+FLOWGRID *GetFlowGrid(StationAVL *stations, DIVVYINDEX *index, double cellMiles) {
     
-    // Read and ignore first line of the input file:
-    fgets(tempString, tempStringLength, file);
-    
-    // Read,parse and insert into AVL tree the rest of the input file:
-    fgets(tempString, tempStringLength, file);
-    while (!feof(file)) {
-        
-        // Create and instert into AVL tree each trip data:
-        AVLValue tripValue;
-        tripValue.Type = TRIPTYPE;
-        tripValue.Trip.TripID = atoi(strtok(tempString, ","));
-        strcpy(tData, strtok(NULL, ","));
-        tripValue.Trip.TripStartTime = (char *)malloc((strlen(tData) + 1) * sizeof(char));
-        strcpy(tripValue.Trip.TripStartTime, tData);
-        strcpy(tData, strtok(NULL, ","));
-        tripValue.Trip.TripStopTime = (char *)malloc((strlen(tData) + 1) * sizeof(char));
-        strcpy(tripValue.Trip.TripStopTime, tData);
-        tripValue.Trip.TripBikeID = atoi(strtok(NULL, ","));
-        tripValue.Trip.TripDuration = atoi(strtok(NULL, ","));
-        tripValue.Trip.TripFromStationID = atoi(strtok(NULL, ","));
-        strcpy(tData, strtok(NULL, ","));
-        tripValue.Trip.TripFromStationName = (char *)malloc((strlen(tData) + 1) * sizeof(char));
-        strcpy(tripValue.Trip.TripFromStationName, tData);
-        tripValue.Trip.TripToStationID = atoi(strtok(NULL, ","));
-        strcpy(tData, strtok(NULL, ","));
-        tripValue.Trip.TripToStationName = (char *)malloc((strlen(tData) + 1) * sizeof(char));
-        strcpy(tripValue.Trip.TripToStationName, tData);
-        tripValue.Trip.TripUserType = (strcmp(strtok(NULL, ","), "Subscriber")) ? CUSTOMER : SUBSCRIBER;
-        strcpy(tData, strtok(NULL, ","));
-        if(tData[0] == '\r' || tData[0] == '\n') {
-            tripValue.Trip.TripUserGenger = UNKNOWN;
-            tripValue.Trip.TripUserBirthYear = -1;
-        } else if(tData[0] == 'M' || tData[0] == 'F'){
-            tripValue.Trip.TripUserGenger = (strcmp(tData, "Male")) ? FEMALE : MALE;
-            strcpy(tData, strtok(NULL, "\r\n"));
-        } else if(tData[0] == '1' || tData[0] == '2') {
-            tripValue.Trip.TripUserBirthYear = atoi(tData);
-        } else {
-            tripValue.Trip.TripUserBirthYear = -1;
-        }
-        
-        AVLInsert(trips, tripValue.Station.StationID, tripValue);
-        
-        // Create and instert into AVL tree each bike data:
-        AVLValue bikeValue;
-        bikeValue.Type = BIKETYPE;
-        bikeValue.Bike.BikeID = tripValue.Trip.TripBikeID;
-        bikeValue.Bike.BikeTripCount = 1;
-        
-        if(!AVLInsert(bikes, bikeValue.Bike.BikeID, bikeValue)) {
-            AVLNode *tBike = AVLSearch(bikes, bikeValue.Bike.BikeID);
-            tBike->Value.Bike.BikeTripCount += 1;
+    for(FLOWGRID *grid = index->FlowGrids; grid != NULL; grid = grid->Next) {
+        if(grid->CellMiles == cellMiles) {
+            return grid;
         }
-        
-        fgets(tempString, tempStringLength, file);
     }
     
-    fclose(file);
-    free(tripsFileName);
+    FLOWGRID *grid = CreateFlowGrid(stations, cellMiles);
+    grid->Next = index->FlowGrids;
+    index->FlowGrids = grid;
     
-    return;
+    return grid;
 }
 
-// PrintStats:
-// Print statistics about stations, trips and bikes AVL trees, such as:
-// cound of nodes and tree heights.
+// ZoneCenter:
+// Stores the coordinates of the center of the zone.
 //
-void PrintStats(AVL *stations, AVL *trips, AVL *bikes) {
+void ZoneCenter(FLOWGRID *grid, int zone, double *latitude, double *longitude) {
     
-    printf("** Trees:\n");
-    printf("   Stations: count = %d, height = %d\n",
-           AVLCount(stations), AVLHeight(stations));
-    printf("   Trips:    count = %d, height = %d\n",
-           AVLCount(trips), AVLHeight(trips));
-    printf("   Bikes:    count = %d, height = %d\n",
-           AVLCount(bikes), AVLHeight(bikes));
+    long long row = grid->ZoneCells[zone] >> 32;
+    long long column = grid->ZoneCells[zone] & 0xFFFFFFFF;
+    *latitude = grid->MinLatitude + (row + 0.5) * grid->LatitudeStep;
+    *longitude = grid->MinLongitude + (column + 0.5) * grid->LongitudeStep;
     
     return;
 }
 
-// TripsAtStation:
-// Returns the number of trips that originated, or ended at requested station ID.
+// _FlowVisit:
+// CountZoneFlows visitor: adds trip to the thread's flow table, unless one
+// of its stations is unknown.
 //
-int TripsAtStation(AVLNode *root, int stationID) {
+void _FlowVisit(void *node, void *partial, void *arg) {
     
-    if(root == NULL) {
-        return 0;
-    } else {
-        int num = 0;
-        if(root->Value.Trip.TripFromStationID == stationID) {
-            num += 1;
-        }
-        if(root->Value.Trip.TripToStationID == stationID) {
-            num +=1;
-        }
-        return num + TripsAtStation(root->Left, stationID) +
-                     TripsAtStation(root->Right, stationID);
+    TRIP *trip = &((TripAVLNode *)node)->Value;
+    FLOWSEARCH *search = (FLOWSEARCH *)arg;
+    
+    StationAVLNode *fromStation = StationAVLSearch(search->Stations, trip->TripFromStationID);
+    StationAVLNode *toStation = StationAVLSearch(search->Stations, trip->TripToStationID);
+    if(fromStation != NULL && toStation != NULL) {
+        FlowTableAdd((FLOWTABLE *)partial,
+                     search->Grid->StationZone[fromStation->Value.StationIndex],
+                     search->Grid->StationZone[toStation->Value.StationIndex], 1);
     }
+    
+    return;
 }
 
-// PrintStationInfo:
-// Print requested station information: station ID, station name, station bike
-// capacity and trip count that start or eneded at requested station.
-//
-void PrintStationInfo(AVL *stations, AVL *trips, int stationID) {
-    
-    AVLNode *stationNode = AVLSearch(stations, stationID);
-    if(stationNode != NULL) {
-        printf("**Station %d:\n", stationID);
-        printf("  Name: '%s'\n", stationNode->Value.Station.StationName);
-        printf("  %-11s (%f,%f)\n", "Location:", stationNode->Value.Station.StationLatitude,
-                                                 stationNode->Value.Station.StationLongitude);
-        printf("  %-11s %d\n", "Capacity:", stationNode->Value.Station.StationDPCapacity);
-        printf("  %-11s %d\n", "Trip count:", TripsAtStation(trips->Root, stationID));
-    } else {
-        printf("**not found\n");
+// _FlowReduce:
+// CountZoneFlows reducer: adds thread's flow table to the result, and frees
+// it.
+//
+void _FlowReduce(void *result, void *partial, void *arg) {
+    
+    FLOWTABLE *table = (FLOWTABLE *)partial;
+    for(int i = 0; i < table->Capacity; i++) {
+        if(table->Cells[i].Trips != 0) {
+            FlowTableAdd((FLOWTABLE *)result, table->Cells[i].FromZone,
+                         table->Cells[i].ToZone, table->Cells[i].Trips);
+        }
     }
+    free(table->Cells);
     
     return;
 }
 
-// PrintBikeInfo:
-// Print number of trips of requested bike ID.
+// CompareFlowCells:
+// qsort comparator, orders zone pairs by origin and then by destination zone.
 //
-void PrintBikeInfo(AVL *bikes, int bikeID) {
+int CompareFlowCells(const void *a, const void *b) {
     
-    AVLNode *bikeNode = AVLSearch(bikes, bikeID);
-    if(bikeNode != NULL) {
-        printf("**Bike %d:\n", bikeID);
-        printf("  Trip count: %d\n", bikeNode->Value.Bike.BikeTripCount);
-    } else {
-        printf("**not found\n");
+    const FLOWCELL *c1 = (const FLOWCELL *)a;
+    const FLOWCELL *c2 = (const FLOWCELL *)b;
+    
+    if(c1->FromZone != c2->FromZone) {
+        return AVLCompareKeys(c1->FromZone, c2->FromZone);
     }
     
-    return;
+    return AVLCompareKeys(c1->ToZone, c2->ToZone);
 }
 
-// PrintTripInfo:
-// Print requested trip inforamtion: bike ID, from station ID, to station ID and
-// duration of the requested trip.
+// CompareFlowTrips:
+// qsort comparator, orders zone pairs by descending trips, then by zones.
 //
-void PrintTripInfo(AVL *trips, int tripID) {
+int CompareFlowTrips(const void *a, const void *b) {
     
-    AVLNode *tripNode = AVLSearch(trips, tripID);
-    if(tripNode != NULL) {
-        printf("**Trip %d:\n", tripID);
-        printf("  %-5s %d\n", "Bike:", tripNode->Value.Trip.TripBikeID);
-        printf("  %-5s %d\n", "From:", tripNode->Value.Trip.TripFromStationID);
-        printf("  %-5s %d\n", "To:", tripNode->Value.Trip.TripToStationID);
-        int tripDuratiuonMin = tripNode->Value.Trip.TripDuration / 60;
-        int tripDurationSec = tripNode->Value.Trip.TripDuration - (tripDuratiuonMin * 60);
-        printf("  Duration: %d min, %d secs\n", tripDuratiuonMin, tripDurationSec);
-    } else {
-        printf("**not found\n");
+    const FLOWCELL *c1 = (const FLOWCELL *)a;
+    const FLOWCELL *c2 = (const FLOWCELL *)b;
+    
+    if(c1->Trips != c2->Trips) {
+        return (c1->Trips < c2->Trips) ? 1 : -1;
     }
     
-    return;
+    return CompareFlowCells(a, b);
 }
 
-// FindNearbyStations:
-// Find station from requested latitude and lonfiture in radius of requested
-// distance:
+// CountZoneFlows:
+// Counts trips between every pair of zones of the grid in one parallel scan
+// of trips tree. Returns the nonzero zone pairs ordered by zones, and their
+// number in *count. The pairs are kept in cache until the trees change.
 //
-void FindNearbyStations(AVLNode *root, double latitude, double longitude,
-                        double distance, StationsLL **nerbyStations) {
+FLOWCELL *CountZoneFlows(StationAVL *stations, TripAVL *trips, DIVVYINDEX *index,
+                         FLOWGRID *grid, int *count) {
     
-    // Do nothing:
-    if(root == NULL) {
-        return;
+    char key[QUERY_KEY_LENGTH];
+    size_t size = 0;
+    snprintf(key, sizeof(key), "flows %.17g", grid->CellMiles);
+    unsigned long version = StationAVLVersion(stations) + TripAVLVersion(trips);
+    FLOWCELL *cached = (FLOWCELL *)CacheGet(&index->Cache, key, version, &size);
+    if(cached != NULL) {
+        *count = (int)(size / sizeof(FLOWCELL));
+        FLOWCELL *flows = (FLOWCELL *)malloc(size + sizeof(FLOWCELL));
+        memcpy(flows, cached, size);
+        return flows;
     }
     
-    // Check if root node is in searched distance nad if so, append it in
-    // ascending order to the nerbyStations list:
-    else {
-        double milage = DistBetween2Points(root->Value.Station.StationLatitude,
-                                           root->Value.Station.StationLongitude,
-                                           latitude, longitude);
-        if((milage - distance) < 0.0000001) {
-            
-            
-            // Finf the location, where to append station ID and distance:
-            StationsLL *cur = *nerbyStations;
-            StationsLL *prev = NULL;
-            while(cur != NULL && (cur->milage - milage) < 0.0000001) {
-                prev = cur;
-                cur = cur->next;
-            }
-            
-            // Creare new nerbyStations node:
-            StationsLL *newNode = (StationsLL *)malloc(sizeof(StationsLL));
-            newNode->stationID = root->Value.Station.StationID;
-            newNode->milage = milage;
-            newNode->next = cur;
-            
-            // Append if only one node:
-            if(prev == NULL) {
-                *nerbyStations = newNode;
-            }
-            // Append after the longest distance:
-            else {
-                
-                prev->next =newNode;
-            }
+    FLOWSEARCH search = {stations, grid};
+    FLOWTABLE table = {0, 0, NULL};
+    TripAVLParallelScan(trips, _FlowVisit, &search, sizeof(FLOWTABLE), _FlowReduce, &table);
+    
+    FLOWCELL *flows = (FLOWCELL *)malloc((table.Count + 1) * sizeof(FLOWCELL));
+    *count = 0;
+    for(int i = 0; i < table.Capacity; i++) {
+        if(table.Cells[i].Trips != 0) {
+            flows[*count] = table.Cells[i];
+            (*count)++;
         }
-        
-        // Continue search recursively:
-        FindNearbyStations(root->Left, latitude, longitude, distance, nerbyStations);
-        FindNearbyStations(root->Right, latitude, longitude, distance, nerbyStations);
     }
+    free(table.Cells);
+    qsort(flows, *count, sizeof(FLOWCELL), CompareFlowCells);
+    CachePut(&index->Cache, key, version, flows, *count * sizeof(FLOWCELL));
     
-    return;
+    return flows;
 }
 
-// PrintNearbyStations:
-// Prints the ascending list (from shortest to longest) of nearest stations
-// from requested coordinates and maximum distange from these coordinates.
+// PrintFlow:
+// Print trips between two zones, and the centers of the zones.
 //
-void PrintNearbyStations(AVL *stations, double latitude, double longitude, double distance) {
+void PrintFlow(FLOWGRID *grid, FLOWCELL *flow) {
     
-    // Find and create the list of nearest stations:
-    StationsLL *nerbyStations = NULL;
-    FindNearbyStations(stations->Root, latitude, longitude, distance, &nerbyStations);
+    double fromLatitude, fromLongitude, toLatitude, toLongitude;
+    ZoneCenter(grid, flow->FromZone, &fromLatitude, &fromLongitude);
+    ZoneCenter(grid, flow->ToZone, &toLatitude, &toLongitude);
     
-    // Print the list of found stations:
-    StationsLL *cur = nerbyStations;
-    if(cur != NULL) {
-        while(cur != NULL) {
-            printf("Station %d: distance %f miles\n", cur->stationID, cur->milage);
-            cur= cur->next;
-        }
+    if(OutGetFormat() != OUT_TEXT) {
+        OutRecordBegin("flow");
+        OutFieldInt("from_zone", flow->FromZone);
+        OutFieldFixed("from_latitude", fromLatitude, 6);
+        OutFieldFixed("from_longitude", fromLongitude, 6);
+        OutFieldInt("to_zone", flow->ToZone);
+        OutFieldFixed("to_latitude", toLatitude, 6);
+        OutFieldFixed("to_longitude", toLongitude, 6);
+        OutFieldInt("trips", flow->Trips);
+        OutRecordEnd();
+        return;
     }
-    FreeStationsLL(&nerbyStations);
+    
+    OutPrintf("   zone %d (%f,%f) -> zone %d (%f,%f): %u trips\n",
+              flow->FromZone, fromLatitude, fromLongitude,
+              flow->ToZone, toLatitude, toLongitude, flow->Trips);
+    
     return;
 }
 
-// FromToTrips:
-// Match all trips that starts from requested statin ID:
+// PrintZoneFlows:
+// Print trips between zones of cellMiles square cells. Text output lists
+// the busiest zone pairs; the other formats list every nonzero pair of the
+// zone x zone matrix, ordered by zones.
 //
-void MatchStarionsFromID(AVLNode *root, StationsLL **routeList, int fromStationID) {
+void PrintZoneFlows(StationAVL *stations, TripAVL *trips, DIVVYINDEX *index,
+                    double cellMiles) {
     
-    if(root == NULL) {
+    if(!(cellMiles >= FLOW_MIN_CELL_MILES)) {
+        OutPrintf("**cell size must be at least %g miles...\n", FLOW_MIN_CELL_MILES);
         return;
-    } else {
-        if(root->Value.Trip.TripFromStationID == fromStationID) {
-            StationsLL *newNode = (StationsLL *)malloc(sizeof(StationsLL));
-            newNode->stationToID = root->Value.Trip.TripToStationID;
-            newNode->milage = 0.0;
-            if(routeList == NULL) {
-                newNode->next = NULL;
-                *routeList = newNode;
-            } else {
-                newNode->next = *routeList;
-                *routeList = newNode;
-            }
-        }
-        MatchStarionsFromID(root->Left, routeList, fromStationID);
-        MatchStarionsFromID(root->Right, routeList, fromStationID);
     }
-}
-
-// PrintRouuteAnalysis:
-// print an analysis to see how many trips are taken along a given route.
-//
-void PrintRouteAnalysis(AVL *stations, AVL *trips, int tripID, double distance) {
     
-    // Find trip:
-    AVLNode *tripNode = AVLSearch(trips, tripID);
+    FLOWGRID *grid = GetFlowGrid(stations, index, cellMiles);
+    int count = 0;
+    FLOWCELL *flows = CountZoneFlows(stations, trips, index, grid, &count);
     
-    if(tripNode != NULL) {
-        
-        // Find information about trip from station and trip to stations:
-        AVLNode *stationA = AVLSearch(stations,
-                                      tripNode->Value.Trip.TripFromStationID);
-        AVLNode *stationB = AVLSearch(stations,
-                                      tripNode->Value.Trip.TripToStationID);
-        
-        // Find all nearby stations from trip's from station ID:
-        StationsLL *nearbyStationsA = NULL;
-        FindNearbyStations(stations->Root,
-                           stationA->Value.Station.StationLatitude,
-                           stationA->Value.Station.StationLongitude,
-                           distance, &nearbyStationsA);
-        
-        // Find all nearby stations from trip's to station ID:
-        StationsLL *nearbyStationsB = NULL;
-        FindNearbyStations(stations->Root,
-                           stationB->Value.Station.StationLatitude,
-                           stationB->Value.Station.StationLongitude,
-                           distance, &nearbyStationsB);
-        
-        int tripCount = 0;
-        
-        // Find all trips matched in "trips" AVL of all trip that start and end
-        // with data from stationA and stationB:
-        StationsLL *curA = nearbyStationsA;
-        StationsLL *curB = nearbyStationsB;
-        StationsLL *routeList = NULL;
-        while(curA != NULL) {
-            MatchStarionsFromID(trips->Root, &routeList, curA->stationID);
-            curA = curA->next;
-        }
-        StationsLL *curC = routeList;
-        while(curB != NULL) {
-            while(curC != NULL) {
-                if(curB->stationFromID == curC->stationFromID) {
-                    tripCount++;
-                }
-                curC = curC->next;
-            }
-            curB = curB->next;
-            curC = routeList;
+    if(OutGetFormat() != OUT_TEXT) {
+        for(int i = 0; i < count; i++) {
+            PrintFlow(grid, &flows[i]);
         }
-        
-        printf("** Route: from station #%d to station #%d\n",
-               stationA->Value.Station.StationID,
-               stationB->Value.Station.StationID);
-        printf("** Trip count: %d\n", tripCount);
-        printf("** Percentage: %f%%\n",
-               ((double)tripCount / (double)AVLCount(trips)) * 100);
-        
-        FreeStationsLL(&routeList);
-        FreeStationsLL(&nearbyStationsA);
-        FreeStationsLL(&nearbyStationsB);
-        
-    } else {
-        printf("**not found\n");
+        free(flows);
+        return;
+    }
+    
+    unsigned long total = 0;
+    for(int i = 0; i < count; i++) {
+        total += flows[i].Trips;
     }
+    OutPrintf("** Flows: %g mile cells, %d zones, %d zone pairs, %lu trips\n",
+              cellMiles, grid->ZoneCount, count, total);
+    if(count > 0) {
+        qsort(flows, count, sizeof(FLOWCELL), CompareFlowTrips);
+        OutPrintf("** Busiest zone pairs:\n");
+        for(int i = 0; i < count && i < FLOW_TOP_PAIRS; i++) {
+            PrintFlow(grid, &flows[i]);
+        }
+    }
+    free(flows);
     
     return;
 }
 
-
 // UserInput:
 // All commands that user can use in order to look and search infromation
-// about stations, trips and bikes.
+// about stations, trips and bikes. Every command reads the trips and bikes
+// published when it started, while the background writer adds new ones.
 //
-void UserInput(AVL *stations, AVL *trips, AVL *bikes) {
+void UserInput(StationAVL *stations, TripAVL *allTrips, BikeAVL *allBikes, DIVVYINDEX *index) {
     
     char  cmd[64];
-    printf("** Ready **\n");
+    INGESTJOB *ingest = (INGESTJOB *)calloc(1, sizeof(INGESTJOB));
+    OutPrintf("** Ready **\n");
+    OutFlush();
     scanf("%s", cmd);
     
     while (strcmp(cmd, "exit") != 0) {
         
+        // Pin published trees and aggregates for the whole command:
+        pthread_rwlock_rdlock(&index->Lock);
+        TripAVL *trips = TripAVLAcquire(allTrips);
+        BikeAVL *bikes = BikeAVLAcquire(allBikes);
+        
         // Output some stats about our data structures:
         if (strcmp(cmd, "stats") == 0) {
             SkipRestOfInput(stdin);
-            PrintStats(stations, trips, bikes);
+            PrintStats(stations, trips, bikes, &index->Cache);
+            if(ingest->Started) {
+                PrintIngest(ingest);
+            }
         }
         
         // Output station info:
         else if(strcmp(cmd, "station") == 0) {
             int stationID = -1;
+            char options[256];
             scanf("%d", &stationID);
-            SkipRestOfInput(stdin);
-            PrintStationInfo(stations, trips, stationID);
+            GetRestOfInput(stdin, options, sizeof(options) / sizeof(options[0]));
+            TRIPFILTER filter;
+            boolean filtered = ParseTripFilter(options, &filter);
+            PrintStationInfo(stations, trips, index, stationID,
+                             strstr(options, "--by-hour") != NULL,
+                             filtered ? &filter : NULL);
+        }
+        
+        // Output station activity by hour and weekday:
+        else if(strcmp(cmd, "station-activity") == 0) {
+            int stationID = -1;
+            char options[256];
+            scanf("%d", &stationID);
+            GetRestOfInput(stdin, options, sizeof(options) / sizeof(options[0]));
+            PrintStationActivity(stations, index, stationID, ParseUserTypeFilter(options));
         }
         
         // Output trip info:
         else if(strcmp(cmd, "trip") == 0) {
-            int tripID = -1;
-            scanf("%d", &tripID);
-            SkipRestOfInput(stdin);
-            PrintTripInfo(trips, tripID);
+            int tripCount = 0;
+            int *tripIDs = GetRestOfInputInts(stdin, &tripCount);
+            PrintTripsInfo(trips, tripIDs, tripCount);
+            free(tripIDs);
         }
         
         // Output bike info:
         else if(strcmp(cmd, "bike") == 0){
+            int bikeCount = 0;
+            int *bikeIDs = GetRestOfInputInts(stdin, &bikeCount);
+            PrintBikesInfo(bikes, bikeIDs, bikeCount);
+            free(bikeIDs);
+        }
+        
+        // Output bike trips in order of time:
+        else if(strcmp(cmd, "bike-history") == 0){
             int bikeID = -1;
             scanf("%d", &bikeID);
             SkipRestOfInput(stdin);
-            PrintBikeInfo(bikes, bikeID);
+            PrintBikeHistory(bikes, bikeID);
+        }
+        
+        // Output rebalancing moves of all bikes:
+        else if(strcmp(cmd, "rebalancing") == 0){
+            SkipRestOfInput(stdin);
+            PrintRebalancing(stations, bikes);
         }
         
         // Output nearby stations:
@@ -565,25 +3583,104 @@ void UserInput(AVL *stations, AVL *trips, AVL *bikes) {
             double distance = 0.0;
             scanf("%lf %lf %lf", &latitude, &longitude, &distance);
             SkipRestOfInput(stdin);
-            PrintNearbyStations(stations, latitude, longitude, distance);
+            PrintNearbyStations(stations, &index->Cache, latitude, longitude, distance);
+        }
+        
+        // Output k nearest stations:
+        else if(strcmp(cmd, "nearest") == 0){
+            double latitude = 0.0;
+            double longitude = 0.0;
+            int k = 0;
+            scanf("%lf %lf %d", &latitude, &longitude, &k);
+            SkipRestOfInput(stdin);
+            PrintNearestStations(index, latitude, longitude, k);
         }
         
         // Output analysis of the route:
         else if(strcmp(cmd, "route") == 0){
             int tripID = -1;
             double distance = 0.0;
-            scanf("%d %lf", &tripID, &distance);
-            PrintRouteAnalysis(stations, trips, tripID, distance);
+            char args[256];
+            GetRestOfInput(stdin, args, sizeof(args) / sizeof(args[0]));
+            char *approximate = strchr(args, '~');
+            if(approximate != NULL) {
+                sscanf(approximate + 1, "%d %lf", &tripID, &distance);
+                PrintApproxRouteAnalysis(stations, trips, index, tripID, distance);
+            } else {
+                int used = 0;
+                TRIPFILTER filter;
+                sscanf(args, "%d %lf%n", &tripID, &distance, &used);
+                boolean filtered = ParseTripFilter(args + used, &filter);
+                PrintRouteAnalysis(stations, trips, index, tripID, distance,
+                                   filtered ? &filter : NULL);
+            }
+        }
+        
+        // Output trips between zones of a grid:
+        else if(strcmp(cmd, "flows") == 0){
+            double cellMiles = 0.0;
+            scanf("%lf", &cellMiles);
+            SkipRestOfInput(stdin);
+            PrintZoneFlows(stations, trips, index, cellMiles);
+        }
+        
+        // Select format of results:
+        else if(strcmp(cmd, "format") == 0){
+            char name[64] = "";
+            scanf("%63s", name);
+            SkipRestOfInput(stdin);
+            int format = OutParseFormat(name);
+            if(format < 0) {
+                OutPrintf("**unknown format, try text, csv, jsonl or binary...\n");
+            } else {
+                OutSetFormat((OUTFORMAT)format);
+            }
+        }
+        
+        // Output trip duration percentiles between two stations:
+        else if(strcmp(cmd, "durations") == 0){
+            int fromID = -1;
+            int toID = -1;
+            scanf("%d %d", &fromID, &toID);
+            SkipRestOfInput(stdin);
+            PrintDurations(stations, index, fromID, toID);
+        }
+        
+        // Add trips from a file in the background:
+        else if(strcmp(cmd, "ingest") == 0){
+            char fileName[512] = "";
+            GetRestOfInput(stdin, fileName, sizeof(fileName) / sizeof(fileName[0]));
+            StartIngest(ingest, fileName + strspn(fileName, " \t"), stations,
+                        allTrips, allBikes, index);
+        }
+        
+        // Evict trips older than the retention window in the background:
+        else if(strcmp(cmd, "retain") == 0){
+            int days = 0;
+            scanf("%d", &days);
+            SkipRestOfInput(stdin);
+            StartRetain(ingest, days, stations, allTrips, allBikes, index);
         }
         
         // If command wasn't found, print error message:
         else {
-            printf("**unknown cmd, try again...\n");
+            OutPrintf("**unknown cmd, try again...\n");
         }
         
+        BikeAVLRelease(bikes);
+        TripAVLRelease(trips);
+        pthread_rwlock_unlock(&index->Lock);
+        
+        OutFlush();
         scanf("%s", cmd);
     }
     
+    // Wait for the background writer:
+    if(ingest->Started) {
+        pthread_join(ingest->Thread, NULL);
+    }
+    free(ingest);
+    
     return;
 }
 
@@ -595,25 +3692,48 @@ int main(void) {
 
     // Get filenames from the user/stdin:
     char *stationsFileName = GetFileName();
-    char *tripsFileName = GetFileName();
+    int tripsFileCount = 0;
+    char **tripsFileNames = GetFileNames(&tripsFileCount);
+
+    // Use DIVVY_THREADS threads for tree scans, if set:
+    char *threads = getenv("DIVVY_THREADS");
+    AVLSetScanThreads((threads != NULL) ? atoi(threads) : 0);
+    
+    // Write results in DIVVY_FORMAT format, if set:
+    char *format = getenv("DIVVY_FORMAT");
+    if(format != NULL && OutParseFormat(format) >= 0) {
+        OutSetFormat((OUTFORMAT)OutParseFormat(format));
+    }
+    
+    // Use DIVVY_CACHE_KB KB for query results, if set:
+    char *cacheKB = getenv("DIVVY_CACHE_KB");
+    size_t cacheBudget = (size_t)((cacheKB != NULL) ? atol(cacheKB) : QUERY_CACHE_KB) * 1024;
 
     // Create AVL trees:
-    AVL *stations = AVLCreate();
-    AVL *trips = AVLCreate();
-    AVL *bikes = AVLCreate();
+    StationAVL *stations = StationAVLCreate();
+    TripAVL *trips = TripAVLCreate();
+    BikeAVL *bikes = BikeAVLCreate();
     
     // Populate AVL trees with data from input files:
     PopulateStations(stationsFileName, stations);
-    PopulateTripsAnsBikes(tripsFileName, trips, bikes);
+    PopulateTrips(tripsFileNames, tripsFileCount, trips, bikes);
+    DIVVYINDEX *index = CreateDivvyIndex(StationAVLCount(stations), cacheBudget);
+    BuildDivvyIndex(index, stations, trips, bikes);
+    
+    // From now on trips and bikes are changed by the background writer only:
+    TripAVLEnableSnapshots(trips);
+    BikeAVLEnableSnapshots(bikes);
     
     // Interact with user:
-    UserInput(stations, trips, bikes);
+    UserInput(stations, trips, bikes, index);
 
     // Done, free memory and quit:
     printf("** Freeing memory **\n");
-    AVLFree(stations, FreeAVLNodeData);
-    AVLFree(trips, FreeAVLNodeData);
-    AVLFree(bikes, FreeAVLNodeData);
+    StationAVLFree(stations, FreeStationData);
+    TripAVLFree(trips, FreeTripData);
+    BikeAVLFree(bikes, FreeBikeData);
+    FreeDivvyIndex(index);
+    AVLScanShutdown();
     
     printf("** Done **\n");
     return 0;
@@ -0,0 +1,273 @@
+/*kdtree.c*/
+
+//
+// 2-d tree of station coordinates implementation file.
+//
+
+// ignore stdlib warnings if working in Visual Studio:
+#define _CRT_SECURE_NO_WARNINGS 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "kdtree.h"
+
+#define KD_PI        3.14159265
+#define KD_EARTH_RAD 3963.1
+
+// Distances are computed with acos(), which loses precision for close
+// points; pruning bounds are loosened by this many miles to stay safe:
+#define KD_BOUND_SLACK 0.001
+
+// DistBetween2Points:
+// Returns the distance in miles between 2 points (lat1, long1) and (lat2, long2).
+// Reference: http://www8.nau.edu/cvm/latlon_formula.html
+//
+double DistBetween2Points(double lat1, double long1, double lat2, double long2) {
+    
+    double PI = KD_PI;
+    double earth_rad = KD_EARTH_RAD;
+
+    double lat1_rad = lat1 * PI / 180.0;
+    double long1_rad = long1 * PI / 180.0;
+    double lat2_rad = lat2 * PI / 180.0;
+    double long2_rad = long2 * PI / 180.0;
+
+    double dist = earth_rad * acos(
+           (cos(lat1_rad)*cos(long1_rad)*cos(lat2_rad)*cos(long2_rad)) +
+           (cos(lat1_rad)*sin(long1_rad)*cos(lat2_rad)*sin(long2_rad)) +
+           (sin(lat1_rad)*sin(lat2_rad))
+           );
+
+  return dist;
+}
+
+// _compareLatitude, _compareLongitude:
+// qsort comparators for the split axes.
+//
+static int _compareLatitude(const void *a, const void *b) {
+    
+    double d = ((const KDPoint *)a)->Latitude - ((const KDPoint *)b)->Latitude;
+    
+    return (d < 0) ? -1 : (d > 0);
+}
+
+static int _compareLongitude(const void *a, const void *b) {
+    
+    double d = ((const KDPoint *)a)->Longitude - ((const KDPoint *)b)->Longitude;
+    
+    return (d < 0) ? -1 : (d > 0);
+}
+
+// _KDBuild:
+// Orders points[lo, hi) so that the middle element splits the subrange on
+// the depth's axis, and builds both halves recursively.
+//
+static void _KDBuild(KDPoint *points, int lo, int hi, int depth) {
+    
+    if(hi - lo <= 1) {
+        return;
+    }
+    
+    qsort(points + lo, hi - lo, sizeof(KDPoint),
+          (depth % 2 == 0) ? _compareLatitude : _compareLongitude);
+    
+    int mid = lo + (hi - lo) / 2;
+    _KDBuild(points, lo, mid, depth + 1);
+    _KDBuild(points, mid + 1, hi, depth + 1);
+    
+    return;
+}
+
+// KDCreate:
+// Dynamically creates and returns a tree of a copy of the points.
+//
+KDTree *KDCreate(KDPoint *points, int count) {
+    
+    KDTree *tree = (KDTree *)malloc(sizeof(KDTree));
+    tree->Count = count;
+    tree->Points = (KDPoint *)malloc((count + 1) * sizeof(KDPoint));
+    memcpy(tree->Points, points, count * sizeof(KDPoint));
+    
+    _KDBuild(tree->Points, 0, count, 0);
+    
+    return tree;
+}
+
+// KDFree:
+// Frees the memory associated with the tree.
+//
+void KDFree(KDTree *tree) {
+    
+    free(tree->Points);
+    free(tree);
+    
+    return;
+}
+
+//
+// Bounded max-heap of the best k neighbors found so far; the root is the
+// worst of them, ordered by distance and then by ID:
+//
+
+typedef struct KDHeap {
+    KDNeighbor *Items;
+    int Count;
+    int Capacity;
+} KDHeap;
+
+// _KDWorse:
+// Returns nonzero if neighbor a ranks after neighbor b.
+//
+static int _KDWorse(KDNeighbor *a, KDNeighbor *b) {
+    
+    if(a->Distance != b->Distance) {
+        return a->Distance > b->Distance;
+    }
+    
+    return a->ID > b->ID;
+}
+
+// _KDHeapOffer:
+// Adds the neighbor if the heap is not full yet, or replaces the worst
+// neighbor if the new one ranks before it.
+//
+static void _KDHeapOffer(KDHeap *heap, KDNeighbor neighbor) {
+    
+    KDNeighbor *items = heap->Items;
+    int i;
+    
+    if(heap->Count < heap->Capacity) {
+        
+        // Sift up from the new leaf:
+        i = heap->Count;
+        heap->Count++;
+        while(i > 0 && _KDWorse(&neighbor, &items[(i - 1) / 2])) {
+            items[i] = items[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        items[i] = neighbor;
+    } else if(_KDWorse(&items[0], &neighbor)) {
+        
+        // Sift down from the root:
+        i = 0;
+        while(2 * i + 1 < heap->Count) {
+            int child = 2 * i + 1;
+            if(child + 1 < heap->Count && _KDWorse(&items[child + 1], &items[child])) {
+                child++;
+            }
+            if(!_KDWorse(&items[child], &neighbor)) {
+                break;
+            }
+            items[i] = items[child];
+            i = child;
+        }
+        items[i] = neighbor;
+    }
+    
+    return;
+}
+
+// _KDPlaneBound:
+// Returns a lower bound of the distance from (latitude, longitude) to any
+// point on the other side of the split plane through split.
+//
+static double _KDPlaneBound(KDPoint *split, int axis, double latitude, double longitude) {
+    
+    double bound = 0.0;
+    
+    if(axis == 0) {
+        
+        // Arc between two latitudes is the shortest way across a parallel:
+        bound = KD_EARTH_RAD * fabs(latitude - split->Latitude) * KD_PI / 180.0;
+    } else {
+        
+        // Distance to the meridian great circle of the split longitude:
+        double dLong = fabs(longitude - split->Longitude) * KD_PI / 180.0;
+        if(dLong < KD_PI / 2.0) {
+            bound = KD_EARTH_RAD * asin(sin(dLong) * cos(latitude * KD_PI / 180.0));
+        }
+    }
+    
+    return bound - KD_BOUND_SLACK;
+}
+
+// _KDNearest:
+// Branch-and-bound search of points[lo, hi): visits the side of the split
+// that holds the query point first, and the other side only if it can still
+// hold a point that ranks before the current k-th neighbor.
+//
+static void _KDNearest(KDPoint *points, int lo, int hi, int depth,
+                       double latitude, double longitude, KDHeap *heap) {
+    
+    if(lo >= hi) {
+        return;
+    }
+    
+    int mid = lo + (hi - lo) / 2;
+    int axis = depth % 2;
+    KDPoint *split = &points[mid];
+    
+    KDNeighbor neighbor;
+    neighbor.ID = split->ID;
+    neighbor.Distance = DistBetween2Points(split->Latitude, split->Longitude,
+                                           latitude, longitude);
+    _KDHeapOffer(heap, neighbor);
+    
+    double delta = (axis == 0) ? latitude - split->Latitude
+                               : longitude - split->Longitude;
+    int nearLo = (delta < 0) ? lo : mid + 1;
+    int nearHi = (delta < 0) ? mid : hi;
+    int farLo = (delta < 0) ? mid + 1 : lo;
+    int farHi = (delta < 0) ? hi : mid;
+    
+    _KDNearest(points, nearLo, nearHi, depth + 1, latitude, longitude, heap);
+    if(heap->Count < heap->Capacity ||
+       _KDPlaneBound(split, axis, latitude, longitude) <= heap->Items[0].Distance) {
+        _KDNearest(points, farLo, farHi, depth + 1, latitude, longitude, heap);
+    }
+    
+    return;
+}
+
+// _KDCompareNeighbors:
+// qsort comparator, orders neighbors by distance and then by ID.
+//
+static int _KDCompareNeighbors(const void *a, const void *b) {
+    
+    KDNeighbor *n1 = (KDNeighbor *)a;
+    KDNeighbor *n2 = (KDNeighbor *)b;
+    
+    if(_KDWorse(n1, n2)) {
+        return 1;
+    } else if(_KDWorse(n2, n1)) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+// KDNearest:
+// Finds the k points closest to (latitude, longitude) and stores them into
+// neighbors (room for k items) ordered by distance, and then by ID for
+// equal distances. Returns the number of neighbors found.
+//
+int KDNearest(KDTree *tree, double latitude, double longitude, int k,
+              KDNeighbor *neighbors) {
+    
+    if(k <= 0) {
+        return 0;
+    }
+    
+    KDHeap heap;
+    heap.Items = neighbors;
+    heap.Count = 0;
+    heap.Capacity = k;
+    _KDNearest(tree->Points, 0, tree->Count, 0, latitude, longitude, &heap);
+    
+    qsort(neighbors, heap.Count, sizeof(KDNeighbor), _KDCompareNeighbors);
+    
+    return heap.Count;
+}
@@ -0,0 +1,43 @@
+/*kdtree.h*/
+
+//
+// 2-d tree of station coordinates header file.
+//
+
+// make sure this header file is #include exactly once:
+#pragma once
+
+//
+// KD type declarations:
+//
+
+typedef struct KDPoint {
+    int    ID;
+    double Latitude;
+    double Longitude;
+} KDPoint;
+
+typedef struct KDNeighbor {
+    int    ID;
+    double Distance;
+} KDNeighbor;
+
+// Points are kept in one array in tree order: the root of every subrange is
+// its middle element, split on latitude at even depths and on longitude at
+// odd depths.
+typedef struct KDTree {
+    KDPoint *Points;
+    int      Count;
+} KDTree;
+
+//
+// KD API: function prototypes
+//
+
+double DistBetween2Points(double lat1, double long1, double lat2, double long2);
+
+KDTree *KDCreate(KDPoint *points, int count);
+void KDFree(KDTree *tree);
+
+int KDNearest(KDTree *tree, double latitude, double longitude, int k,
+              KDNeighbor *neighbors);
@@ -0,0 +1,520 @@
+/*output.c*/
+
+//
+// Buffered result output implementation file.
+//
+
+// ignore stdlib warnings if working in Visual Studio:
+#define _CRT_SECURE_NO_WARNINGS 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+
+#include "output.h"
+
+// OUTBUFFER:
+// Output buffer and record under construction of one thread.
+//
+typedef struct OUTBUFFER {
+    int         Length;
+    char        Data[OUT_BUFFER_SIZE];
+    const char *RecordType;
+    int         FieldCount;
+    OUTFIELD    Fields[OUT_MAX_FIELDS];
+    char        LastHeader[256];
+} OUTBUFFER;
+
+static _Thread_local OUTBUFFER _outBuffer;
+
+static OUTFORMAT _outFormat = OUT_TEXT;
+
+static const char *FormatNames[] = {"text", "csv", "jsonl", "binary"};
+
+static const unsigned long long Powers10[OUT_MAX_DECIMALS + 1] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL
+};
+
+// OutParseFormat:
+// Returns the format with the name, or -1 if there is none.
+//
+int OutParseFormat(const char *name) {
+    
+    for(int format = OUT_TEXT; format <= OUT_BINARY; format++) {
+        if(strcmp(name, FormatNames[format]) == 0) {
+            return format;
+        }
+    }
+    
+    return -1;
+}
+
+// OutFormatName:
+// Returns the name of the format.
+//
+const char *OutFormatName(OUTFORMAT format) {
+    
+    return FormatNames[format];
+}
+
+// OutSetFormat:
+// Selects the format of records written afterwards, by all threads.
+//
+void OutSetFormat(OUTFORMAT format) {
+    
+    _outFormat = format;
+    
+    return;
+}
+
+// OutGetFormat:
+// Returns the selected format of records.
+//
+OUTFORMAT OutGetFormat(void) {
+    
+    return _outFormat;
+}
+
+// OutFlush:
+// Writes the calling thread's buffer to stdout.
+//
+void OutFlush(void) {
+    
+    OUTBUFFER *out = &_outBuffer;
+    if(out->Length > 0) {
+        fwrite(out->Data, 1, out->Length, stdout);
+        out->Length = 0;
+    }
+    fflush(stdout);
+    
+    return;
+}
+
+// _OutBytes:
+// Appends length bytes to the calling thread's buffer, writing the buffer
+// out first if they do not fit.
+//
+static void _OutBytes(const char *bytes, int length) {
+    
+    OUTBUFFER *out = &_outBuffer;
+    if(out->Length + length > OUT_BUFFER_SIZE) {
+        fwrite(out->Data, 1, out->Length, stdout);
+        out->Length = 0;
+        if(length > OUT_BUFFER_SIZE) {
+            fwrite(bytes, 1, length, stdout);
+            return;
+        }
+    }
+    memcpy(out->Data + out->Length, bytes, length);
+    out->Length += length;
+    
+    return;
+}
+
+// OutText:
+// Appends text to the output.
+//
+void OutText(const char *text) {
+    
+    _OutBytes(text, (int)strlen(text));
+    
+    return;
+}
+
+// OutChar:
+// Appends one character to the output.
+//
+void OutChar(char c) {
+    
+    OUTBUFFER *out = &_outBuffer;
+    if(out->Length == OUT_BUFFER_SIZE) {
+        fwrite(out->Data, 1, out->Length, stdout);
+        out->Length = 0;
+    }
+    out->Data[out->Length++] = c;
+    
+    return;
+}
+
+// _OutUnsigned:
+// Appends decimal digits of value, zero-padded to at least width digits.
+//
+static void _OutUnsigned(unsigned long long value, int width) {
+    
+    char digits[24];
+    int length = 0;
+    
+    do {
+        digits[sizeof(digits) - 1 - length] = (char)('0' + value % 10);
+        value /= 10;
+        length++;
+    } while(value != 0 || length < width);
+    _OutBytes(digits + sizeof(digits) - length, length);
+    
+    return;
+}
+
+// OutInt:
+// Appends value as a decimal integer, like printf's "%lld".
+//
+void OutInt(long long value) {
+    
+    if(value < 0) {
+        OutChar('-');
+        _OutUnsigned(0ULL - (unsigned long long)value, 1);
+    } else {
+        _OutUnsigned((unsigned long long)value, 1);
+    }
+    
+    return;
+}
+
+// OutFixed:
+// Appends value with decimals digits after the decimal point, like printf's
+// "%.*f". Values that do not fit into 64 bits once scaled are left to
+// printf.
+//
+void OutFixed(double value, int decimals) {
+    
+    if(decimals < 0) {
+        decimals = 0;
+    } else if(decimals > OUT_MAX_DECIMALS) {
+        decimals = OUT_MAX_DECIMALS;
+    }
+    
+    double magnitude = fabs(value);
+    if(!(magnitude < 9e18 / (double)Powers10[decimals])) {
+        OutPrintf("%.*f", decimals, value);
+        return;
+    }
+    
+    if(signbit(value)) {
+        OutChar('-');
+    }
+    unsigned long long scaled = (unsigned long long)(magnitude * (double)Powers10[decimals] + 0.5);
+    _OutUnsigned(scaled / Powers10[decimals], 1);
+    if(decimals > 0) {
+        OutChar('.');
+        _OutUnsigned(scaled % Powers10[decimals], decimals);
+    }
+    
+    return;
+}
+
+// OutPrintf:
+// Appends printf formatted text to the output.
+//
+void OutPrintf(const char *format, ...) {
+    
+    OUTBUFFER *out = &_outBuffer;
+    va_list args;
+    
+    va_start(args, format);
+    int length = vsnprintf(out->Data + out->Length, OUT_BUFFER_SIZE - out->Length,
+                           format, args);
+    va_end(args);
+    if(length < 0) {
+        return;
+    }
+    if(length < OUT_BUFFER_SIZE - out->Length) {
+        out->Length += length;
+        return;
+    }
+    
+    // Did not fit, write buffer out and format again:
+    fwrite(out->Data, 1, out->Length, stdout);
+    out->Length = 0;
+    if(length < OUT_BUFFER_SIZE) {
+        va_start(args, format);
+        out->Length = vsnprintf(out->Data, OUT_BUFFER_SIZE, format, args);
+        va_end(args);
+    } else {
+        va_start(args, format);
+        vfprintf(stdout, format, args);
+        va_end(args);
+    }
+    
+    return;
+}
+
+// OutRecordBegin:
+// Starts a record of the type. Fields are added with OutField... and the
+// record is written by OutRecordEnd. Names and strings must stay valid
+// until then.
+//
+void OutRecordBegin(const char *type) {
+    
+    _outBuffer.RecordType = type;
+    _outBuffer.FieldCount = 0;
+    
+    return;
+}
+
+// _OutAddField:
+// Returns the next field of the record, or NULL if the record is full.
+//
+static OUTFIELD *_OutAddField(const char *name, OUTKIND kind) {
+    
+    OUTBUFFER *out = &_outBuffer;
+    if(out->FieldCount == OUT_MAX_FIELDS) {
+        return NULL;
+    }
+    
+    OUTFIELD *field = &out->Fields[out->FieldCount++];
+    field->Name = name;
+    field->Kind = kind;
+    
+    return field;
+}
+
+// OutFieldInt:
+// Adds an integer field to the record.
+//
+void OutFieldInt(const char *name, long long value) {
+    
+    OUTFIELD *field = _OutAddField(name, OUT_INT);
+    if(field != NULL) {
+        field->Int = value;
+    }
+    
+    return;
+}
+
+// OutFieldFixed:
+// Adds a float field to the record, written with decimals digits after the
+// decimal point in text formats.
+//
+void OutFieldFixed(const char *name, double value, int decimals) {
+    
+    OUTFIELD *field = _OutAddField(name, OUT_FIXED);
+    if(field != NULL) {
+        field->Fixed = value;
+        field->Decimals = decimals;
+    }
+    
+    return;
+}
+
+// OutFieldString:
+// Adds a string field to the record.
+//
+void OutFieldString(const char *name, const char *value) {
+    
+    OUTFIELD *field = _OutAddField(name, OUT_STRING);
+    if(field != NULL) {
+        field->String = (value != NULL) ? value : "";
+    }
+    
+    return;
+}
+
+// _OutQuoted:
+// Appends string quoted for CSV (quotes doubled) or JSON (escaped).
+//
+static void _OutQuoted(const char *value, int json) {
+    
+    OutChar('"');
+    for(const char *c = value; *c != '\0'; c++) {
+        if(*c == '"') {
+            OutText(json ? "\\\"" : "\"\"");
+        } else if(json && *c == '\\') {
+            OutText("\\\\");
+        } else if(json && (unsigned char)*c < 0x20) {
+            OutPrintf("\\u%04x", (unsigned char)*c);
+        } else {
+            OutChar(*c);
+        }
+    }
+    OutChar('"');
+    
+    return;
+}
+
+// _OutValue:
+// Appends field value as text.
+//
+static void _OutValue(OUTFIELD *field) {
+    
+    if(field->Kind == OUT_INT) {
+        OutInt(field->Int);
+    } else if(field->Kind == OUT_FIXED) {
+        OutFixed(field->Fixed, field->Decimals);
+    } else {
+        OutText(field->String);
+    }
+    
+    return;
+}
+
+// _OutCSVRecord:
+// Appends the record as a CSV row, after a header row if the record has
+// another type or fields than the previous one.
+//
+static void _OutCSVRecord(OUTBUFFER *out) {
+    
+    char header[sizeof(out->LastHeader)];
+    int length = snprintf(header, sizeof(header), "type");
+    for(int i = 0; i < out->FieldCount && length < (int)sizeof(header); i++) {
+        length += snprintf(header + length, sizeof(header) - length, ",%s",
+                           out->Fields[i].Name);
+    }
+    if(strcmp(header, out->LastHeader) != 0) {
+        strcpy(out->LastHeader, header);
+        OutText(header);
+        OutChar('\n');
+    }
+    
+    OutText(out->RecordType);
+    for(int i = 0; i < out->FieldCount; i++) {
+        OUTFIELD *field = &out->Fields[i];
+        OutChar(',');
+        if(field->Kind == OUT_STRING && strpbrk(field->String, ",\"\r\n") != NULL) {
+            _OutQuoted(field->String, 0);
+        } else {
+            _OutValue(field);
+        }
+    }
+    OutChar('\n');
+    
+    return;
+}
+
+// _OutJSONRecord:
+// Appends the record as one line JSON object.
+//
+static void _OutJSONRecord(OUTBUFFER *out) {
+    
+    OutText("{\"type\":");
+    _OutQuoted(out->RecordType, 1);
+    for(int i = 0; i < out->FieldCount; i++) {
+        OUTFIELD *field = &out->Fields[i];
+        OutChar(',');
+        _OutQuoted(field->Name, 1);
+        OutChar(':');
+        if(field->Kind == OUT_STRING) {
+            _OutQuoted(field->String, 1);
+        } else if(field->Kind == OUT_FIXED && !isfinite(field->Fixed)) {
+            OutText("null");
+        } else {
+            _OutValue(field);
+        }
+    }
+    OutText("}\n");
+    
+    return;
+}
+
+// _OutLittleEndian:
+// Stores size low bytes of value into bytes, least significant first.
+//
+static void _OutLittleEndian(unsigned char *bytes, unsigned long long value, int size) {
+    
+    for(int i = 0; i < size; i++) {
+        bytes[i] = (unsigned char)(value >> (8 * i));
+    }
+    
+    return;
+}
+
+// _OutShortLength:
+// Returns the length of string as written by _OutShortString.
+//
+static size_t _OutShortLength(const char *value) {
+    
+    size_t length = strlen(value);
+    
+    return (length > 255) ? 255 : length;
+}
+
+// _OutShortString:
+// Appends string as uint8 length and bytes, cut to 255 bytes.
+//
+static void _OutShortString(const char *value) {
+    
+    size_t length = _OutShortLength(value);
+    OutChar((char)length);
+    _OutBytes(value, (int)length);
+    
+    return;
+}
+
+// _OutBinaryRecord:
+// Appends the record as length-prefixed binary record.
+//
+static void _OutBinaryRecord(OUTBUFFER *out) {
+    
+    // Payload length first:
+    size_t length = 1 + _OutShortLength(out->RecordType) + 1;
+    for(int i = 0; i < out->FieldCount; i++) {
+        OUTFIELD *field = &out->Fields[i];
+        length += 1 + _OutShortLength(field->Name) + 1;
+        length += (field->Kind == OUT_STRING) ? 4 + strlen(field->String) : 8;
+    }
+    
+    unsigned char bytes[8];
+    _OutLittleEndian(bytes, length, 4);
+    _OutBytes((const char *)bytes, 4);
+    _OutShortString(out->RecordType);
+    OutChar((char)out->FieldCount);
+    for(int i = 0; i < out->FieldCount; i++) {
+        OUTFIELD *field = &out->Fields[i];
+        _OutShortString(field->Name);
+        OutChar((char)field->Kind);
+        if(field->Kind == OUT_INT) {
+            _OutLittleEndian(bytes, (unsigned long long)field->Int, 8);
+            _OutBytes((const char *)bytes, 8);
+        } else if(field->Kind == OUT_FIXED) {
+            unsigned long long bits;
+            memcpy(&bits, &field->Fixed, sizeof(bits));
+            _OutLittleEndian(bytes, bits, 8);
+            _OutBytes((const char *)bytes, 8);
+        } else {
+            size_t stringLength = strlen(field->String);
+            _OutLittleEndian(bytes, stringLength, 4);
+            _OutBytes((const char *)bytes, 4);
+            _OutBytes(field->String, (int)stringLength);
+        }
+    }
+    
+    return;
+}
+
+// OutRecordEnd:
+// Writes the record in the selected format.
+//
+void OutRecordEnd(void) {
+    
+    OUTBUFFER *out = &_outBuffer;
+    
+    switch(_outFormat) {
+        case OUT_CSV:
+            _OutCSVRecord(out);
+            break;
+        
+        case OUT_JSONL:
+            _OutJSONRecord(out);
+            break;
+        
+        case OUT_BINARY:
+            _OutBinaryRecord(out);
+            break;
+        
+        default:
+            OutText(out->RecordType);
+            OutChar(':');
+            for(int i = 0; i < out->FieldCount; i++) {
+                OutChar(' ');
+                OutText(out->Fields[i].Name);
+                OutChar('=');
+                _OutValue(&out->Fields[i]);
+            }
+            OutChar('\n');
+            break;
+    }
+    out->FieldCount = 0;
+    
+    return;
+}
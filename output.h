@@ -0,0 +1,79 @@
+/*output.h*/
+
+//
+// Buffered result output header file.
+//
+
+// make sure this header file is #include exactly once:
+#pragma once
+
+//
+// Output type declarations:
+//
+// Results are formatted into a per-thread buffer that is written to stdout
+// when it fills up and on OutFlush(). Integers and fixed-precision floats
+// are formatted by hand instead of through printf; OutPrintf is left for
+// lines that are not written in bulk.
+//
+// Results are either written as text (OutText, OutInt, ...), or as records
+// of named fields (OutRecordBegin, OutField..., OutRecordEnd) that are
+// written in the selected format:
+//   OUT_TEXT    records as "type: name=value ..." lines
+//   OUT_CSV     one row per record, type in the first column; a header row
+//               is written before the first record and whenever the record
+//               type changes
+//   OUT_JSONL   one JSON object per record, {"type":"...", "name":value, ...}
+//   OUT_BINARY  uint32 little-endian payload length, then the payload: type
+//               (uint8 length + bytes), uint8 field count, and for every
+//               field its name (uint8 length + bytes), uint8 kind and value:
+//               1 = int64, 2 = float64 (both little-endian), 3 = string
+//               (uint32 length + bytes)
+//
+
+#define OUT_BUFFER_SIZE  65536
+#define OUT_MAX_FIELDS   16
+#define OUT_MAX_DECIMALS 9
+
+typedef enum OUTFORMAT {
+    OUT_TEXT,
+    OUT_CSV,
+    OUT_JSONL,
+    OUT_BINARY
+} OUTFORMAT;
+
+typedef enum OUTKIND {
+    OUT_INT = 1,
+    OUT_FIXED = 2,
+    OUT_STRING = 3
+} OUTKIND;
+
+typedef struct OUTFIELD {
+    const char *Name;
+    OUTKIND     Kind;
+    long long   Int;
+    double      Fixed;
+    int         Decimals;
+    const char *String;
+} OUTFIELD;
+
+//
+// Output API: function prototypes
+//
+
+int OutParseFormat(const char *name);
+const char *OutFormatName(OUTFORMAT format);
+void OutSetFormat(OUTFORMAT format);
+OUTFORMAT OutGetFormat(void);
+
+void OutFlush(void);
+void OutText(const char *text);
+void OutChar(char c);
+void OutInt(long long value);
+void OutFixed(double value, int decimals);
+void OutPrintf(const char *format, ...);
+
+void OutRecordBegin(const char *type);
+void OutFieldInt(const char *name, long long value);
+void OutFieldFixed(const char *name, double value, int decimals);
+void OutFieldString(const char *name, const char *value);
+void OutRecordEnd(void);
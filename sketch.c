@@ -0,0 +1,355 @@
+/*sketch.c*/
+
+//
+// Mergeable summary sketches implementation file.
+//
+
+// ignore stdlib warnings if working in Visual Studio:
+#define _CRT_SECURE_NO_WARNINGS 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "sketch.h"
+
+// HistInit:
+// Initializes an empty histogram.
+//
+void HistInit(HISTOGRAM *hist) {
+    
+    hist->Count = 0;
+    hist->Buckets = NULL;
+    
+    return;
+}
+
+// HistFree:
+// Frees the memory associated with the histogram, and leaves it empty.
+//
+void HistFree(HISTOGRAM *hist) {
+    
+    free(hist->Buckets);
+    HistInit(hist);
+    
+    return;
+}
+
+// _HistBucket:
+// Returns bucket index of the value.
+//
+static int _HistBucket(int value) {
+    
+    if(value < 0) {
+        value = 0;
+    } else if(value >= (1 << HIST_MAX_BITS)) {
+        value = (1 << HIST_MAX_BITS) - 1;
+    }
+    
+    if(value < 2 * HIST_SUB_BUCKETS) {
+        return value;
+    }
+    
+    int msb = 0;
+    while((value >> (msb + 1)) != 0) {
+        msb++;
+    }
+    int shift = msb - HIST_SUB_BITS;
+    
+    return HIST_SUB_BUCKETS * (shift + 1) + ((value >> shift) - HIST_SUB_BUCKETS);
+}
+
+// _HistBucketValue:
+// Returns the value that represents the bucket: the middle of its range.
+//
+static int _HistBucketValue(int bucket) {
+    
+    if(bucket < 2 * HIST_SUB_BUCKETS) {
+        return bucket;
+    }
+    
+    int shift = bucket / HIST_SUB_BUCKETS - 1;
+    int sub = bucket % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS;
+    int low = sub << shift;
+    int high = ((sub + 1) << shift) - 1;
+    
+    return low + (high - low) / 2;
+}
+
+// _HistExpand:
+// Moves the small values of the histogram into a bucket array.
+//
+static void _HistExpand(HISTOGRAM *hist) {
+    
+    hist->Buckets = (unsigned int *)calloc(HIST_BUCKETS, sizeof(unsigned int));
+    for(unsigned int i = 0; i < hist->Count; i++) {
+        hist->Buckets[_HistBucket(hist->Small[i])] += 1;
+    }
+    
+    return;
+}
+
+// HistAdd:
+// Counts the value.
+//
+void HistAdd(HISTOGRAM *hist, int value) {
+    
+    if(hist->Buckets == NULL && hist->Count < HIST_SMALL) {
+        hist->Small[hist->Count] = value;
+    } else {
+        if(hist->Buckets == NULL) {
+            _HistExpand(hist);
+        }
+        hist->Buckets[_HistBucket(value)] += 1;
+    }
+    hist->Count++;
+    
+    return;
+}
+
+// HistRemove:
+// Uncounts the value, which must have been counted before.
+//
+void HistRemove(HISTOGRAM *hist, int value) {
+    
+    if(hist->Buckets == NULL) {
+        for(unsigned int i = 0; i < hist->Count; i++) {
+            if(hist->Small[i] == value) {
+                hist->Small[i] = hist->Small[hist->Count - 1];
+                hist->Count--;
+                break;
+            }
+        }
+        return;
+    }
+    
+    int bucket = _HistBucket(value);
+    if(hist->Buckets[bucket] > 0) {
+        hist->Buckets[bucket] -= 1;
+        hist->Count--;
+    }
+    
+    return;
+}
+
+// HistMerge:
+// Adds all values counted by src to dest.
+//
+void HistMerge(HISTOGRAM *dest, HISTOGRAM *src) {
+    
+    if(src->Buckets == NULL) {
+        for(unsigned int i = 0; i < src->Count; i++) {
+            HistAdd(dest, src->Small[i]);
+        }
+        return;
+    }
+    
+    if(dest->Buckets == NULL) {
+        _HistExpand(dest);
+    }
+    for(int i = 0; i < HIST_BUCKETS; i++) {
+        dest->Buckets[i] += src->Buckets[i];
+    }
+    dest->Count += src->Count;
+    
+    return;
+}
+
+// _compareInts:
+// qsort comparator for ints.
+//
+static int _compareInts(const void *a, const void *b) {
+    
+    int i1 = *(const int *)a;
+    int i2 = *(const int *)b;
+    
+    return (i1 > i2) - (i1 < i2);
+}
+
+// HistPercentile:
+// Returns the smallest counted value v such that at least percent % of the
+// values are <= v (within the histogram's precision), or -1 if empty.
+//
+int HistPercentile(HISTOGRAM *hist, double percent) {
+    
+    if(hist->Count == 0) {
+        return -1;
+    }
+    
+    unsigned int rank = (unsigned int)ceil(percent / 100.0 * hist->Count);
+    if(rank < 1) {
+        rank = 1;
+    } else if(rank > hist->Count) {
+        rank = hist->Count;
+    }
+    
+    // Small histograms are exact:
+    if(hist->Buckets == NULL) {
+        int values[HIST_SMALL];
+        memcpy(values, hist->Small, hist->Count * sizeof(int));
+        qsort(values, hist->Count, sizeof(int), _compareInts);
+        return values[rank - 1];
+    }
+    
+    unsigned int seen = 0;
+    for(int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->Buckets[i];
+        if(seen >= rank) {
+            return _HistBucketValue(i);
+        }
+    }
+    
+    return _HistBucketValue(HIST_BUCKETS - 1);
+}
+
+// HLLInit:
+// Initializes an empty distinct count sketch.
+//
+void HLLInit(HYPERLOGLOG *hll) {
+    
+    hll->SmallCount = 0;
+    hll->Registers = NULL;
+    
+    return;
+}
+
+// HLLFree:
+// Frees the memory associated with the sketch, and leaves it empty.
+//
+void HLLFree(HYPERLOGLOG *hll) {
+    
+    free(hll->Registers);
+    HLLInit(hll);
+    
+    return;
+}
+
+// _HLLHash:
+// Returns 64-bit hash of the value (splitmix64 finalizer).
+//
+static unsigned long long _HLLHash(long long value) {
+    
+    unsigned long long hash = (unsigned long long)value + 0x9E3779B97F4A7C15ULL;
+    hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+    
+    return hash ^ (hash >> 31);
+}
+
+// _HLLAddHash:
+// Updates the register selected by the top bits of the hash with the rank
+// of the first 1 bit in the remaining bits.
+//
+static void _HLLAddHash(unsigned char *registers, unsigned long long hash) {
+    
+    int reg = (int)(hash >> (64 - HLL_BITS));
+    unsigned long long rest = hash << HLL_BITS;
+    int rank = 1;
+    while(rank <= 64 - HLL_BITS && (rest & 0x8000000000000000ULL) == 0) {
+        rank++;
+        rest <<= 1;
+    }
+    if(registers[reg] < rank) {
+        registers[reg] = (unsigned char)rank;
+    }
+    
+    return;
+}
+
+// _HLLAddHashToSketch:
+// Adds already hashed value to the sketch.
+//
+static void _HLLAddHashToSketch(HYPERLOGLOG *hll, unsigned long long hash) {
+    
+    if(hll->Registers != NULL) {
+        _HLLAddHash(hll->Registers, hash);
+        return;
+    }
+    
+    for(int i = 0; i < hll->SmallCount; i++) {
+        if(hll->Small[i] == hash) {
+            return;
+        }
+    }
+    
+    if(hll->SmallCount < HLL_SMALL) {
+        hll->Small[hll->SmallCount] = hash;
+        hll->SmallCount++;
+    } else {
+        hll->Registers = (unsigned char *)calloc(HLL_REGISTERS, sizeof(unsigned char));
+        for(int i = 0; i < hll->SmallCount; i++) {
+            _HLLAddHash(hll->Registers, hll->Small[i]);
+        }
+        _HLLAddHash(hll->Registers, hash);
+    }
+    
+    return;
+}
+
+// HLLAdd:
+// Adds the value to the sketch.
+//
+void HLLAdd(HYPERLOGLOG *hll, long long value) {
+    
+    _HLLAddHashToSketch(hll, _HLLHash(value));
+    
+    return;
+}
+
+// HLLMerge:
+// Adds all values seen by src to dest.
+//
+void HLLMerge(HYPERLOGLOG *dest, HYPERLOGLOG *src) {
+    
+    if(src->Registers == NULL) {
+        for(int i = 0; i < src->SmallCount; i++) {
+            _HLLAddHashToSketch(dest, src->Small[i]);
+        }
+        return;
+    }
+    
+    if(dest->Registers == NULL) {
+        dest->Registers = (unsigned char *)calloc(HLL_REGISTERS, sizeof(unsigned char));
+        for(int i = 0; i < dest->SmallCount; i++) {
+            _HLLAddHash(dest->Registers, dest->Small[i]);
+        }
+    }
+    for(int i = 0; i < HLL_REGISTERS; i++) {
+        if(dest->Registers[i] < src->Registers[i]) {
+            dest->Registers[i] = src->Registers[i];
+        }
+    }
+    
+    return;
+}
+
+// HLLEstimate:
+// Returns estimated number of distinct values seen by the sketch.
+// Reference: Flajolet et al., HyperLogLog, with linear counting for small
+// cardinalities.
+//
+double HLLEstimate(HYPERLOGLOG *hll) {
+    
+    if(hll->Registers == NULL) {
+        return hll->SmallCount;
+    }
+    
+    double m = HLL_REGISTERS;
+    double sum = 0.0;
+    int zeros = 0;
+    for(int i = 0; i < HLL_REGISTERS; i++) {
+        sum += ldexp(1.0, -hll->Registers[i]);
+        if(hll->Registers[i] == 0) {
+            zeros++;
+        }
+    }
+    
+    double alpha = 0.7213 / (1.0 + 1.079 / m);
+    double estimate = alpha * m * m / sum;
+    if(estimate <= 2.5 * m && zeros > 0) {
+        estimate = m * log(m / zeros);
+    }
+    
+    return estimate;
+}
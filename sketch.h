@@ -0,0 +1,67 @@
+/*sketch.h*/
+
+//
+// Mergeable summary sketches header file.
+//
+
+// make sure this header file is #include exactly once:
+#pragma once
+
+//
+// HISTOGRAM type declarations:
+//
+// Log-linear (HDR-style) histogram of non-negative ints: values below
+// 2 * HIST_SUB_BUCKETS are counted exactly, larger values fall into one of
+// HIST_SUB_BUCKETS equal buckets per power of two, so any reported value is
+// within 1/HIST_SUB_BUCKETS of the true one. Values >= 2^HIST_MAX_BITS are
+// clamped. The first HIST_SMALL values are kept as they are, and the bucket
+// array is only allocated once a histogram grows past them.
+//
+
+#define HIST_SUB_BITS     4
+#define HIST_SUB_BUCKETS  (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS     24
+#define HIST_BUCKETS      ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+#define HIST_SMALL        6
+
+typedef struct HISTOGRAM {
+    unsigned int  Count;
+    int           Small[HIST_SMALL];
+    unsigned int *Buckets;
+} HISTOGRAM;
+
+//
+// HYPERLOGLOG type declarations:
+//
+// Distinct count sketch with 2^HLL_BITS registers, standard error about
+// 1.04 / sqrt(2^HLL_BITS) = 6.5%. Until more than HLL_SMALL distinct values
+// are seen, their hashes are kept as they are and counted exactly, and the
+// register array is only allocated afterwards.
+//
+
+#define HLL_BITS       8
+#define HLL_REGISTERS  (1 << HLL_BITS)
+#define HLL_SMALL      8
+
+typedef struct HYPERLOGLOG {
+    int                 SmallCount;
+    unsigned long long  Small[HLL_SMALL];
+    unsigned char      *Registers;
+} HYPERLOGLOG;
+
+//
+// Sketch API: function prototypes
+//
+
+void HistInit(HISTOGRAM *hist);
+void HistFree(HISTOGRAM *hist);
+void HistAdd(HISTOGRAM *hist, int value);
+void HistRemove(HISTOGRAM *hist, int value);
+void HistMerge(HISTOGRAM *dest, HISTOGRAM *src);
+int HistPercentile(HISTOGRAM *hist, double percent);
+
+void HLLInit(HYPERLOGLOG *hll);
+void HLLFree(HYPERLOGLOG *hll);
+void HLLAdd(HYPERLOGLOG *hll, long long value);
+void HLLMerge(HYPERLOGLOG *dest, HYPERLOGLOG *src);
+double HLLEstimate(HYPERLOGLOG *hll);
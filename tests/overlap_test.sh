@@ -0,0 +1,30 @@
+#!/bin/sh
+#
+# Loads trips.csv as two trips files that share some trips, and checks
+# that every bike's trip count is the number of distinct trips it made.
+#
+# Run from the repository root after building: sh tests/overlap_test.sh
+#
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+head -n 1000 trips.csv > "$dir/first.csv"
+head -n 1 trips.csv > "$dir/second.csv"
+tail -n +500 trips.csv >> "$dir/second.csv"
+
+# Expected trip counts of the bikes, from distinct trip IDs:
+tail -n +2 trips.csv | awk -F, '!seen[$1]++ { count[$4]++ }
+    END { for(bike in count) print "bike," bike "," count[bike] }' |
+    sort > "$dir/expected.txt"
+
+bikes=$(cut -d, -f2 "$dir/expected.txt" | tr '\n' ' ')
+printf "stations.csv\n%s %s\nformat csv\nbike %s\nexit\n" \
+       "$dir/first.csv" "$dir/second.csv" "$bikes" |
+    ./divvy_avl_analysis | grep '^bike,[0-9]' | sort > "$dir/actual.txt"
+
+if ! diff "$dir/expected.txt" "$dir/actual.txt"; then
+    echo "FAIL: bike trip counts of overlapping trips files"
+    exit 1
+fi
+echo "PASS: $(wc -l < "$dir/expected.txt") bikes"